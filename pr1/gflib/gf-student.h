@@ -17,5 +17,199 @@
 #include <sys/socket.h>
 #include <sys/signal.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdlib.h>
+
+#define GF_HEADER_MAX_FIELDS 7 // <scheme> <method|status> <path|length> [RANGE <offset|size> [<length>]] [KEEPALIVE]
+
+/*
+ * A view into a buffer owned by somebody else. It is not null-terminated.
+ */
+typedef struct {
+    const char *ptr;
+    size_t len;
+} gf_view_t;
+
+typedef enum {
+    GF_PARSE_INCOMPLETE,    // need more bytes before the header is complete
+    GF_PARSE_DONE,          // the whole header, including "\r\n\r\n", has been seen
+    GF_PARSE_ERROR          // the bytes can't be a GETFILE header
+} gf_parse_result_t;
+
+/*
+ * Incremental parser for both GETFILE headers:
+ *   request:   <scheme> <method> <path> [RANGE <offset> <length>] [KEEPALIVE]\r\n\r\n
+ *   response:  <scheme> <status> [<length> [RANGE <size>]] [KEEPALIVE]\r\n\r\n
+ * The caller keeps appending recv()'d bytes to one buffer and hands the parser the
+ * whole buffer every time. The parser remembers where it stopped, so every byte
+ * is looked at once. The fields are views into the caller's buffer.
+ */
+typedef struct {
+    size_t scanned;                             // bytes of the buffer already consumed
+    size_t fieldStart;                          // offset where the current field started
+    int nfields;                                // number of completed fields
+    int terminatorMatched;                      // how much of "\r\n\r\n" we've matched so far
+    size_t headerLen;                           // total header length once GF_PARSE_DONE
+    gf_view_t fields[GF_HEADER_MAX_FIELDS];     // scheme, method/status, path/length, range, keep-alive
+} gf_header_parser_t;
+
+/*
+ * Resets the parser so it can be used for a new header.
+ */
+void gf_parser_init(gf_header_parser_t *parser);
+
+/*
+ * Consumes the bytes in buf[parser->scanned, len). buf must start at the first byte
+ * of the header and must keep the bytes the parser has already seen.
+ */
+gf_parse_result_t gf_parser_feed(gf_header_parser_t *parser, const char *buf, size_t len);
+
+/*
+ * Returns 1 if the view holds exactly the given string.
+ */
+int gf_view_equals(gf_view_t view, const char *str);
+
+/*
+ * Parses the view as a decimal size_t. Returns -1 on garbage or overflow.
+ */
+int gf_view_to_size(gf_view_t view, size_t *out);
+
+#define GF_POOL_MAX_POOLS 8     // pools a process can create, each one takes a slot in every thread's cache
+#define GF_POOL_CACHE_SIZE 32   // objects a thread keeps for itself before handing half to the shared list
+
+/*
+ * Free-list allocator for fixed-size objects that get created and destroyed for
+ * every connection or request. Every thread keeps a small cache of free objects
+ * so the common get/put touches no lock. Threads refill from and spill to a shared
+ * free list in batches, and the shared list is bounded so a burst doesn't pin its
+ * peak memory forever. Objects handed out are not zeroed.
+ */
+typedef struct gf_pool_obj_t {
+    struct gf_pool_obj_t *next;                 // only valid while the object is free
+} gf_pool_obj_t;
+
+typedef struct {
+    int id;                                     // this pool's slot in the thread caches, 0 until first use
+    size_t objSize;                             // size of every object, at least a pointer
+    size_t maxFree;                             // bound on the shared free list, the rest goes back to the heap
+    pthread_mutex_t lock;                       // guards freeList and nfree
+    gf_pool_obj_t *freeList;                    // objects spilled by the thread caches
+    size_t nfree;                               // length of freeList
+    unsigned long hits;                         // gets served without touching the heap
+    unsigned long misses;                       // gets that had to malloc
+} gf_pool_t;
+
+#define GF_POOL_INITIALIZER(type, maxFree) \
+    { 0, sizeof(type) < sizeof(gf_pool_obj_t) ? sizeof(gf_pool_obj_t) : sizeof(type), (maxFree), \
+      PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0 }
+
+/*
+ * Returns an uninitialized object from the pool, or NULL if the heap is exhausted.
+ */
+void *gf_pool_get(gf_pool_t *pool);
+
+/*
+ * Returns obj to the pool. It may be handed out again by any thread.
+ */
+void gf_pool_put(gf_pool_t *pool, void *obj);
+
+/*
+ * Reads the pool's hit and miss counters.
+ */
+void gf_pool_stats(gf_pool_t *pool, unsigned long *hits, unsigned long *misses);
+
+/*
+ * Where a request spends its time. Each server records the phases it can see.
+ */
+typedef enum {
+    GF_PHASE_HEADER,        // accept (or first byte of a kept-alive request) until the header is complete
+    GF_PHASE_HANDLER,       // the handler call on the thread that received the request
+    GF_PHASE_QUEUE,         // waiting in the delegate pool's request queue
+    GF_PHASE_CONTENT,       // content_get() and fstat()
+    GF_PHASE_SEND,          // header and body until the last byte was handed to the socket
+    GF_PHASE_TOTAL,         // from the first phase the server saw until the response is out
+    GF_PHASE_COUNT
+} gf_phase_t;
+
+typedef enum {
+    GF_STAT_OK,             // responses by status
+    GF_STAT_FILE_NOT_FOUND,
+    GF_STAT_ERROR,
+    GF_STAT_INVALID,
+    GF_STAT_BYTES_SENT,     // header and body bytes handed to the socket
+    GF_STAT_COUNT
+} gf_counter_t;
+
+typedef enum {
+    GF_GAUGE_CONNECTIONS,   // open connections
+    GF_GAUGE_QUEUE_DEPTH,   // requests waiting in the delegate pool's queue
+    GF_GAUGE_COUNT
+} gf_gauge_t;
+
+#define GF_HIST_SUB_BITS 3  // 8 linear buckets per power of two, values are off by at most 12.5%
+#define GF_HIST_BUCKETS ((64 - GF_HIST_SUB_BITS + 1) << GF_HIST_SUB_BITS)
+
+/*
+ * A log-linear latency histogram in nanoseconds, in the style of HdrHistogram.
+ */
+typedef struct {
+    unsigned long counts[GF_HIST_BUCKETS];
+    unsigned long total;                        // number of recorded values
+    unsigned long sum;                          // sum of all recorded values
+    unsigned long max;
+} gf_hist_t;
+
+/*
+ * Returns CLOCK_MONOTONIC in nanoseconds.
+ */
+unsigned long gf_now_ns();
+
+/*
+ * Records one value into hist. Only one thread may record into a histogram,
+ * though others may read it at the same time.
+ */
+void gf_hist_record(gf_hist_t *hist, unsigned long ns);
+
+/*
+ * Returns the value below which the given fraction of the recorded values
+ * fall, rounded up to the top of its bucket (but never above the max).
+ */
+unsigned long gf_hist_percentile(const gf_hist_t *hist, double fraction);
+
+/*
+ * Records how long a request spent in phase. Every thread records into its own
+ * histograms, so this takes no lock and no atomic read-modify-write.
+ */
+void gf_stats_record(gf_phase_t phase, unsigned long ns);
+
+/*
+ * Adds n to one of the calling thread's counters.
+ */
+void gf_stats_count(gf_counter_t counter, unsigned long n);
+
+/*
+ * Moves a gauge by delta, or sets it to value, and keeps track of its peak.
+ */
+void gf_stats_gauge_add(gf_gauge_t gauge, long delta);
+void gf_stats_gauge_set(gf_gauge_t gauge, long value);
+
+/*
+ * Sums every thread's histograms and counters into a text report. Returns the
+ * length of the report, which is truncated to fit len bytes including the '\0'.
+ */
+size_t gf_stats_format(char *buf, size_t len);
+
+/*
+ * Writes the report to out.
+ */
+void gf_stats_dump(FILE *out);
+
+/*
+ * Blocks SIGUSR1 in the calling thread and starts a thread that writes the report
+ * to stderr whenever the process gets SIGUSR1. Threads inherit the signal mask, so
+ * this has to be called before the server starts any other thread.
+ */
+int gf_stats_start_signal_dumper();
 
  #endif // __GF_STUDENT_H__
@@ -0,0 +1,341 @@
+#include <stdlib.h>
+
+#include "gfclient.h"
+#include "workload.h"
+#include "gfclient-student.h"
+
+#define NS_PER_SEC 1000000000UL
+#define MAX_POLL_MS 100 // longest we sleep in gfc_multi_perform, so the clock is checked often enough
+
+#define USAGE                                                             \
+  "usage:\n"                                                              \
+  "  gfbench [options]\n"                                                 \
+  "options:\n"                                                            \
+  "  -h                  Show this help message\n"                        \
+  "  -p [server_port]    Server port (Default: 53948)\n"                  \
+  "  -w [workload_path]  Path to workload file (Default: workload.txt)\n" \
+  "  -s [server_addr]    Server address (Default: 127.0.0.1)\n"           \
+  "  -c [concurrency]    Requests in flight; with -R the most in flight (Default: 16)\n" \
+  "  -R [rate]           Open loop: start this many requests per second (Default: 0, closed loop)\n" \
+  "  -d [seconds]        Length of the measured run (Default: 10)\n"       \
+  "  -W [seconds]        Warmup before measuring starts (Default: 1)\n"    \
+  "  -D [distribution]   seq, rnd, zipf:S, hotspot:FRACTION:PROBABILITY or trace,\n" \
+  "                      which replays the workload's timestamps open loop (Default: seq)\n" \
+  "  -S [seed]           Seed for the random distributions\n"             \
+  "  -j                  Print the results as one JSON object\n"
+
+/* OPTIONS DESCRIPTOR ====================================================== */
+static struct option gLongOptions[] = {
+    {"server", required_argument, NULL, 's'},
+    {"workload", required_argument, NULL, 'w'},
+    {"port", required_argument, NULL, 'p'},
+    {"concurrency", required_argument, NULL, 'c'},
+    {"rate", required_argument, NULL, 'R'},
+    {"duration", required_argument, NULL, 'd'},
+    {"warmup", required_argument, NULL, 'W'},
+    {"distribution", required_argument, NULL, 'D'},
+    {"seed", required_argument, NULL, 'S'},
+    {"json", no_argument, NULL, 'j'},
+    {"help", no_argument, NULL, 'h'},
+    {NULL, 0, NULL, 0}};
+
+static void Usage() { fprintf(stdout, "%s", USAGE); }
+
+typedef struct {
+  gfcrequest_t *gfr;
+  unsigned long intended;   // when the request should have started
+} bench_request_t;
+
+typedef struct {
+  gf_hist_t latency;          // intended start to last byte, in ns
+  unsigned long statuses[4];  // indexed like gfstatus_t
+  unsigned long failed;       // transfers that didn't get a whole response
+  unsigned long bytes;
+  unsigned long completed;
+  unsigned long lagMax;       // longest a request waited past when it was due to start
+  unsigned long lastDone;     // when the last recorded request finished
+} bench_result_t;
+
+static void discardcb(void *data, size_t data_len, void *arg) {}
+
+static void startRequest(gfcmulti_t *multi, char *server, unsigned short port, char *path,
+                         unsigned long intended) {
+  bench_request_t *request = malloc(sizeof(bench_request_t));
+  if (request == NULL) {
+    perror("Unable to allocate the request");
+    exit(EXIT_FAILURE);
+  }
+  request->intended = intended;
+  request->gfr = gfc_create();
+  gfc_set_port(&request->gfr, port);
+  gfc_set_path(&request->gfr, path);
+  gfc_set_server(&request->gfr, server);
+  gfc_set_writefunc(&request->gfr, discardcb);
+
+  if (gfc_multi_add(multi, &request->gfr, request) == -1) {
+    exit(EXIT_FAILURE);
+  }
+}
+
+/* Collects finished requests. Only the ones meant to start inside the
+ * measured window are recorded. Returns how many finished. */
+static size_t reapRequests(gfcmulti_t *multi, unsigned long measureStart, unsigned long measureEnd,
+                           bench_result_t *result) {
+  unsigned long now = gf_now_ns();
+  size_t finished = 0;
+  int returncode;
+  bench_request_t *request;
+
+  while (gfc_multi_info_read(multi, &returncode, (void **)&request) != NULL) {
+    if (request->intended >= measureStart && request->intended < measureEnd) {
+      gf_hist_record(&result->latency, now - request->intended);
+      result->completed++;
+      result->lastDone = now;
+      result->bytes += gfc_get_bytesreceived(&request->gfr);
+      if (returncode < 0 || gfc_get_status(&request->gfr) > GF_INVALID) {
+        result->failed++;
+      } else {
+        result->statuses[gfc_get_status(&request->gfr)]++;
+      }
+    }
+    gfc_cleanup(&request->gfr);
+    free(request);
+    finished++;
+  }
+  return finished;
+}
+
+/* Throughput is taken over the measured window, or up to the last recorded
+ * completion if an overloaded server made the run go past it. */
+static double elapsedSeconds(bench_result_t *result, unsigned long measureStart, unsigned long duration) {
+  unsigned long elapsed = duration;
+  if (result->lastDone > measureStart && result->lastDone - measureStart > duration) {
+    elapsed = result->lastDone - measureStart;
+  }
+  return (double)elapsed / NS_PER_SEC;
+}
+
+/* Closed loop: keep concurrency requests in flight and start a new one as
+ * soon as one finishes. Latency is then the service time of each request. */
+static double runClosedLoop(char *server, unsigned short port, size_t concurrency,
+                            unsigned long warmup, unsigned long duration, bench_result_t *result) {
+  gfcmulti_t *multi = gfc_multi_create();
+  if (multi == NULL) {
+    exit(EXIT_FAILURE);
+  }
+
+  unsigned long measureStart = gf_now_ns() + warmup;
+  unsigned long measureEnd = measureStart + duration;
+  size_t running = 0;
+
+  for (;;) {
+    unsigned long now = gf_now_ns();
+    while (now < measureEnd && running < concurrency) {
+      startRequest(multi, server, port, workload_get_path(), now);
+      running++;
+    }
+    if (running == 0) {
+      break;
+    }
+    running = gfc_multi_perform(multi, MAX_POLL_MS);
+    reapRequests(multi, measureStart, measureEnd, result);
+  }
+
+  gfc_multi_cleanup(&multi);
+  return elapsedSeconds(result, measureStart, duration);
+}
+
+/* Picks the path of request k and when it is due: every interval ns, or
+ * when the trace says if there is no rate. */
+static char *nextArrival(unsigned long start, double interval, unsigned long k, unsigned long *due) {
+  unsigned long offset;
+  char *path = workload_get_request(&offset);
+  *due = start + (unsigned long)(interval > 0 ? k * interval : offset);
+  return path;
+}
+
+/* Open loop: request k is due at start + k / rate (or when the trace says)
+ * whether or not the server has kept up. A request that can't start on time (concurrency is the most we
+ * keep in flight) still has its latency measured from when it was due, so a
+ * stalled server shows up in the tail instead of slowing the arrivals down
+ * (coordinated omission). Requests due before the end are all sent, even if
+ * that means running past it. */
+static double runOpenLoop(char *server, unsigned short port, size_t concurrency, double rate,
+                          unsigned long warmup, unsigned long duration, bench_result_t *result) {
+  gfcmulti_t *multi = gfc_multi_create();
+  if (multi == NULL) {
+    exit(EXIT_FAILURE);
+  }
+
+  unsigned long start = gf_now_ns();
+  unsigned long measureStart = start + warmup;
+  unsigned long measureEnd = measureStart + duration;
+  double interval = rate > 0 ? NS_PER_SEC / rate : 0;
+  unsigned long issued = 0;
+  size_t running = 0;
+  unsigned long due;
+  char *path = nextArrival(start, interval, issued, &due);
+
+  for (;;) {
+    unsigned long now = gf_now_ns();
+
+    while (due < measureEnd && due <= now && running < concurrency) {
+      startRequest(multi, server, port, path, due);
+      if (due >= measureStart && now - due > result->lagMax) {
+        result->lagMax = now - due;
+      }
+      running++;
+      issued++;
+      path = nextArrival(start, interval, issued, &due);
+    }
+
+    if (due >= measureEnd && running == 0) {
+      break;
+    }
+
+    int timeout = MAX_POLL_MS;
+    if (due < measureEnd && running < concurrency) {
+      unsigned long wait = due > now ? (due - now) / 1000000 : 0;
+      timeout = wait < MAX_POLL_MS ? (int)wait : MAX_POLL_MS;
+    }
+    gfc_multi_perform(multi, timeout);
+    running -= reapRequests(multi, measureStart, measureEnd, result);
+  }
+
+  gfc_multi_cleanup(&multi);
+  return elapsedSeconds(result, measureStart, duration);
+}
+
+static void printResults(bench_result_t *result, int open, double rate, size_t concurrency, double duration,
+                         double seconds, int json) {
+  const char *mode = open ? (rate > 0 ? "open" : "trace") : "closed";
+  gf_hist_t *latency = &result->latency;
+  double mean = latency->total > 0 ? (double)latency->sum / latency->total : 0;
+
+  if (json) {
+    fprintf(stdout,
+            "{\"mode\":\"%s\",\"rate\":%.1f,\"concurrency\":%zu,\"duration_s\":%.1f,\"elapsed_s\":%.3f,"
+            "\"requests\":%lu,\"ok\":%lu,\"file_not_found\":%lu,\"error\":%lu,\"invalid\":%lu,\"failed\":%lu,"
+            "\"throughput_rps\":%.1f,\"throughput_mbps\":%.2f,\"start_lag_max_us\":%.1f,"
+            "\"latency_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}}\n",
+            mode, rate, concurrency, duration, seconds,
+            result->completed, result->statuses[GF_OK], result->statuses[GF_FILE_NOT_FOUND],
+            result->statuses[GF_ERROR], result->statuses[GF_INVALID], result->failed,
+            result->completed / seconds, result->bytes / 1e6 / seconds, result->lagMax / 1e3,
+            mean / 1e3, gf_hist_percentile(latency, 0.5) / 1e3, gf_hist_percentile(latency, 0.9) / 1e3,
+            gf_hist_percentile(latency, 0.99) / 1e3, gf_hist_percentile(latency, 0.999) / 1e3, latency->max / 1e3);
+    return;
+  }
+
+  if (open && rate > 0) {
+    fprintf(stdout, "open loop at %.1f req/s, at most %zu in flight, %.1fs (took %.3fs)\n", rate, concurrency,
+            duration, seconds);
+  } else if (open) {
+    fprintf(stdout, "trace replay, at most %zu in flight, %.1fs (took %.3fs)\n", concurrency, duration, seconds);
+  } else {
+    fprintf(stdout, "closed loop with %zu in flight, %.1fs (took %.3fs)\n", concurrency, duration, seconds);
+  }
+  fprintf(stdout, "requests %lu: ok %lu, file_not_found %lu, error %lu, invalid %lu, failed %lu\n",
+          result->completed, result->statuses[GF_OK], result->statuses[GF_FILE_NOT_FOUND],
+          result->statuses[GF_ERROR], result->statuses[GF_INVALID], result->failed);
+  fprintf(stdout, "throughput %.1f req/s, %.2f MB/s\n", result->completed / seconds, result->bytes / 1e6 / seconds);
+  if (open) {
+    fprintf(stdout, "start lag max %.1fus\n", result->lagMax / 1e3);
+  }
+  fprintf(stdout, "%10s %10s %10s %10s %10s %10s\n", "mean_us", "p50_us", "p90_us", "p99_us", "p999_us", "max_us");
+  fprintf(stdout, "%10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", mean / 1e3,
+          gf_hist_percentile(latency, 0.5) / 1e3, gf_hist_percentile(latency, 0.9) / 1e3,
+          gf_hist_percentile(latency, 0.99) / 1e3, gf_hist_percentile(latency, 0.999) / 1e3, latency->max / 1e3);
+}
+
+/* Main ========================================================= */
+int main(int argc, char **argv) {
+  char *workload_path = "workload.txt";
+  char *server = "localhost";
+  unsigned short port = 53948;
+  int concurrency = 16;
+  double rate = 0;
+  double duration = 10;
+  double warmup = 1;
+  int json = 0;
+  char *distribution = "seq";
+  int option_char = 0;
+
+  while ((option_char = getopt_long(argc, argv, "s:w:p:c:R:d:W:D:S:jh", gLongOptions,
+                                    NULL)) != -1) {
+    switch (option_char) {
+      case 's':  // server
+        server = optarg;
+        break;
+      case 'w':  // workload-path
+        workload_path = optarg;
+        break;
+      case 'p':  // port
+        port = atoi(optarg);
+        break;
+      case 'c':  // concurrency
+        concurrency = atoi(optarg);
+        break;
+      case 'R':  // rate
+        rate = atof(optarg);
+        break;
+      case 'd':  // duration
+        duration = atof(optarg);
+        break;
+      case 'W':  // warmup
+        warmup = atof(optarg);
+        break;
+      case 'D':  // distribution
+        distribution = optarg;
+        break;
+      case 'S':  // seed
+        workload_set_seed(strtoul(optarg, NULL, 0));
+        break;
+      case 'j':  // json
+        json = 1;
+        break;
+      case 'h':  // help
+        Usage();
+        exit(0);
+      default:
+        Usage();
+        exit(1);
+    }
+  }
+
+  if (concurrency < 1 || rate < 0 || duration <= 0 || warmup < 0) {
+    fprintf(stderr, "Invalid concurrency, rate, duration or warmup\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (EXIT_SUCCESS != workload_init(workload_path)) {
+    fprintf(stderr, "Unable to load workload file %s.\n", workload_path);
+    exit(EXIT_FAILURE);
+  }
+  if (EXIT_SUCCESS != workload_set_distribution(distribution)) {
+    fprintf(stderr, "Invalid distribution %s\n", distribution);
+    exit(EXIT_FAILURE);
+  }
+  int open = rate > 0 || strcmp(distribution, "trace") == 0;
+
+  bench_result_t *result = calloc(1, sizeof(bench_result_t));
+  if (result == NULL) {
+    perror("Unable to allocate the results");
+    exit(EXIT_FAILURE);
+  }
+
+  gfc_global_init();
+
+  double seconds;
+  if (open) {
+    seconds = runOpenLoop(server, port, concurrency, rate, warmup * NS_PER_SEC, duration * NS_PER_SEC, result);
+  } else {
+    seconds = runClosedLoop(server, port, concurrency, warmup * NS_PER_SEC, duration * NS_PER_SEC, result);
+  }
+  printResults(result, open, rate, concurrency, duration, seconds, json);
+
+  gfc_global_cleanup();
+  workload_destroy();
+  free(result);
+  return 0;
+}
@@ -6,6 +6,19 @@
  
  #include "gfclient.h"
  #include "gf-student.h"
+ #include <netinet/tcp.h>
+ #include <pthread.h>
+
+ /**
+ * One connection to the server and the bytes we received on it but didn't
+ * consume yet. With pipelining the next response may already be in buf.
+ */
+typedef struct {
+    int sockfd;             // The socket's file descriptor
+    size_t start;           // First byte of buf that hasn't been consumed
+    size_t end;             // One past the last byte received into buf
+    char buf[BUFSIZ];       // Receive buffer, also holds the header while it's parsed
+} gfc_conn_t;
 
  /**
  * This method creates a socket and connects with the first available server address, provided by the addressesList(linked list).
@@ -14,7 +27,81 @@
 int createSocketAndConnect(struct addrinfo *addressesList);
 
 
-gfstatus_t parseResponseHeader(gfcrequest_t **gfr, const char* response, ssize_t bytesRecvd);
+/**
+ * This method resolves the server. Returns the list of its addresses, or NULL on failure.
+ */
+struct addrinfo *resolveServer(const char *server, unsigned short port);
+
+/**
+ * This method resolves the server and connects to it. After gfc_global_init the
+ * addresses come from the resolver cache.
+ * Returns the socket's file descriptor, or -1 on failure.
+ */
+int connectToServer(const char *server, unsigned short port);
+
+/**
+ * This method hands out an idle kept-alive connection to the server if the pool has
+ * one, and connects otherwise. reused tells the caller which one it got, a reused
+ * connection may still turn out to be closed by the server.
+ * Returns the socket's file descriptor, or -1 on failure.
+ */
+int acquireConnection(const char *server, unsigned short port, int *reused);
+
+/**
+ * This method puts a connection back into the pool if it's reusable and the pool
+ * has room, and closes it otherwise.
+ */
+void releaseConnection(const char *server, unsigned short port, int sockfd, int reusable);
+
+/**
+ * This method prints how many connections were reused and how often the resolver
+ * cache answered.
+ */
+void printConnectionStats();
+
+/**
+ * This method writes the GETFILE request for gfr into request.
+ * Returns the length of the request, or -1 if it doesn't fit into len bytes.
+ */
+int formatRequest(gfcrequest_t **gfr, char *request, size_t len, int keepAlive);
+
+/**
+ * This method returns what we learned about the server's keep-alive support: 1
+ * once it granted it, -1 once it rejected a request carrying the token and 0
+ * before either, or always without gfc_global_init.
+ */
+int keepAliveSupport(const char *server, unsigned short port);
+
+/**
+ * This method records the server's keep-alive support for keepAliveSupport.
+ */
+void setKeepAliveSupport(const char *server, unsigned short port, int support);
+
+/**
+ * This method sends the GETFILE request for gfr's path, asking the server to keep
+ * the connection open afterwards when keepAlive is set.
+ */
+int sendRequest(gfcrequest_t **gfr, int sockfd, int keepAlive);
+
+/**
+ * This method reads one response from the connection, hands the header and body
+ * to gfr's callbacks and leaves any bytes that follow in conn for the next response.
+ * Returns 0 on success, -1 on failure, -2 if the connection was closed before
+ * any byte of the response arrived and -3 if the server answered INVALID.
+ */
+int readResponse(gfcrequest_t **gfr, gfc_conn_t *conn);
+
+/**
+ * This method hands as much of data to gfr's writefunc as still belongs to the body.
+ * Returns the number of bytes it handed over.
+ */
+size_t deliverBody(gfcrequest_t **gfr, const char *data, size_t len);
+
+/**
+ * This method maps the fields the header parser extracted onto the response status
+ * and file length stored in gfr.
+ */
+gfstatus_t parseResponseHeader(gfcrequest_t **gfr, const gf_header_parser_t *parser);
 
  
  #endif // __GF_CLIENT_STUDENT_H__
@@ -1,10 +1,13 @@
 
 #include <stdlib.h>
 #include <netdb.h>
+#include <sys/epoll.h>
 
 #include "gfclient-student.h"
 
 #define MAX_PORT_DIGITS 6
+#define PIPELINE_DEPTH 16 // max requests we send ahead of the response we're reading
+#define MAX_IDLE_CONNECTIONS 64 // kept-alive connections we hold on to per server
 
  // Modify this file to implement the interface specified in
  // gfclient.h.
@@ -21,7 +24,11 @@ struct gfcrequest_t {
   size_t fileLen;         // The length of the file we are receiving from server
   gfstatus_t respStatus;  // The response status sent from the server
   int parsedHeader;       // This flag lets us know if for each request we've parsed the header
-  char response[BUFSIZ];  // This buffer stores the response provided by the client.
+  int keepAlive;          // Set when the server keeps the connection open after this response
+  int hasRange;           // Set when we only ask for part of the file
+  size_t rangeOffset;     // The part we ask for, a length of 0 means up to the end of the file
+  size_t rangeLength;
+  size_t totalLen;        // The length of the whole file, which a range response tells us
 
 
   // Function ptr for the registered callback for the headerfunc
@@ -31,6 +38,34 @@ struct gfcrequest_t {
   void (*writefunc)(void *data_buffer, size_t data_buffer_length, void *handlerarg);
 };
 
+// Everything gfc_global_init sets up for one (server, port): its resolved addresses
+// and the connections a previous request left open for the next one.
+typedef struct gfc_host_t {
+  char *server;
+  unsigned short port;
+  struct addrinfo *addresses;             // NULL until resolved, or after connecting to them failed
+  int idle[MAX_IDLE_CONNECTIONS];         // kept-alive connections, the most recently used last
+  int nidle;
+  int keepAlive;                          // 1 once it granted keep-alive, -1 once it rejected the token
+  struct gfc_host_t *next;
+} gfc_host_t;
+
+// Address lists we replaced. Another thread may still be connecting with one, so
+// they are only freed by gfc_global_cleanup.
+typedef struct gfc_retired_t {
+  struct addrinfo *addresses;
+  struct gfc_retired_t *next;
+} gfc_retired_t;
+
+static pthread_mutex_t hostsLock = PTHREAD_MUTEX_INITIALIZER;
+static int poolEnabled = 0;             // set by gfc_global_init, without it every request connects
+static gfc_host_t *hosts = NULL;
+static gfc_retired_t *retired = NULL;
+static size_t resolverHits = 0;
+static size_t resolverMisses = 0;
+static size_t connectionsOpened = 0;
+static size_t connectionsReused = 0;
+
 // optional function for cleaup processing.
 void gfc_cleanup(gfcrequest_t **gfr) {
   if (gfr == NULL || *gfr == NULL) {
@@ -60,8 +95,9 @@ gfcrequest_t *gfc_create() {
   config -> bytesRecvd = 0;
   config -> parsedHeader = 0;
   config -> respStatus = GF_OK;
-
-  memset(&config->response, 0, BUFSIZ);
+  config -> keepAlive = 0;
+  config -> hasRange = 0;
+  config -> totalLen = 0;
 
   return config;
 }
@@ -85,6 +121,15 @@ size_t gfc_get_filelen(gfcrequest_t **gfr) {
   return (*gfr)->fileLen;
 }
 
+size_t gfc_get_totallen(gfcrequest_t **gfr) {
+  if (gfr == NULL || *gfr == NULL) {
+    perror("gfc_get_totallen: gfr or *gfr is NULL");
+    return -1;
+  }
+
+  return (*gfr)->totalLen;
+}
+
 gfstatus_t gfc_get_status(gfcrequest_t **gfr) {
   if (gfr == NULL || *gfr == NULL) {
     perror("gfc_get_status: gfr or *gfr is NULL");
@@ -95,136 +140,181 @@ gfstatus_t gfc_get_status(gfcrequest_t **gfr) {
 }
 
 void gfc_global_init() {
-  // not yet implemented
+  pthread_mutex_lock(&hostsLock);
+  poolEnabled = 1;
+  pthread_mutex_unlock(&hostsLock);
 }
 
 void gfc_global_cleanup() {
-  // not yet implemented
+  pthread_mutex_lock(&hostsLock);
+  poolEnabled = 0;
+  while (hosts != NULL) {
+    gfc_host_t *host = hosts;
+    hosts = host->next;
+    for (int i = 0; i < host->nidle; i++) {
+      close(host->idle[i]);
+    }
+    if (host->addresses != NULL) {
+      freeaddrinfo(host->addresses);
+    }
+    free(host->server);
+    free(host);
+  }
+  while (retired != NULL) {
+    gfc_retired_t *old = retired;
+    retired = old->next;
+    freeaddrinfo(old->addresses);
+    free(old);
+  }
+  pthread_mutex_unlock(&hostsLock);
 }
 
-int gfc_perform(gfcrequest_t **gfr) {
-  struct addrinfo addrConfig;
-
-  // Zero out and set up our address config
-  memset(&addrConfig, 0, sizeof addrConfig);
-  addrConfig.ai_family = AF_UNSPEC;
-  addrConfig.ai_socktype = SOCK_STREAM; // Since we want to make this a TCP socket
-  addrConfig.ai_socktype = SOCK_STREAM;
-
-  char portStr[MAX_PORT_DIGITS];
-  memset(&portStr, 0, sizeof portStr);
-  sprintf(portStr, "%d", (*gfr)->port);
+void printConnectionStats() {
+  pthread_mutex_lock(&hostsLock);
+  size_t total = connectionsOpened + connectionsReused;
+  fprintf(stderr, "client: connections opened: %zu reused: %zu (%.1f%% reuse) resolver hits: %zu misses: %zu\n",
+          connectionsOpened, connectionsReused, total == 0 ? 0.0 : 100.0 * connectionsReused / total,
+          resolverHits, resolverMisses);
+  pthread_mutex_unlock(&hostsLock);
+}
 
-  int addrinfoStatus;
-  struct addrinfo *addressesList;
-  addrinfoStatus = getaddrinfo((*gfr)->server, portStr, &addrConfig, &addressesList);
-  if (addrinfoStatus != 0) {
-      // Send error to stderr and stop the program since ther's no point to continue if getaddrinfo fails
-      fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(addrinfoStatus));
+int gfc_perform(gfcrequest_t **gfr) {
+  gfc_conn_t conn;
+  int status;
+  int support, keepAlive;
+
+  for (;;) {
+    int reused;
+    (*gfr)->sockfd = acquireConnection((*gfr)->server, (*gfr)->port, &reused);
+    if ((*gfr)->sockfd == -1) {
+      perror("client: connectToServer");
       return -1;
-  }
-
-  (*gfr)->sockfd = createSocketAndConnect(addressesList);
-  freeaddrinfo(addressesList); // we don't need the linked list anymore, so let's free it up
-  if ((*gfr)->sockfd == -1) {
-    perror("client: createSocketAndConnect");
-    return -1;
-  }
-
-  // Step 1: Send request to the server
-  char request[BUFSIZ];
-  snprintf(request, sizeof(request), "GETFILE GET %s\r\n\r\n", (*gfr)->path);
+    }
 
-  ssize_t bytesSent = send((*gfr)->sockfd, request, strlen(request), 0);
-  if (bytesSent == -1) {
-      perror("client: send failed");
+    // Step 1: Send request to the server. With a pool we ask the server to keep the
+    // connection open so that the next request can skip the handshake, unless it
+    // already turned the token down.
+    support = keepAliveSupport((*gfr)->server, (*gfr)->port);
+    keepAlive = poolEnabled && support >= 0;
+    if (sendRequest(gfr, (*gfr)->sockfd, keepAlive) == -1) {
       close((*gfr)->sockfd);
+      (*gfr)->sockfd = -1;
+      if (reused) {
+        continue; // the server closed it while it sat in the pool
+      }
       return -1;
-  }
-  
-  ssize_t bytesRecvd;
-  size_t totalHeaderBytes = 0;
-  char headerBuff[BUFSIZ]; 
-  memset(&headerBuff, 0 , sizeof headerBuff);
-
-  while((bytesRecvd = recv((*gfr)->sockfd, (*gfr)->response, BUFSIZ, 0)) > 0) {
-    strncat(headerBuff, (*gfr)->response, bytesRecvd); // append the response to the headerBuff so that we can analyze
-    totalHeaderBytes += bytesRecvd;
+    }
 
-    if (strstr(headerBuff, "\r\n\r\n") != NULL){
-      break; // if we received the delimeter then we have our header and can start parsing
+    // Step 2: Receive the header and hand the body to the writefunc
+    conn.sockfd = (*gfr)->sockfd;
+    conn.start = conn.end = 0;
+    status = readResponse(gfr, &conn);
+    if (status == -2 && reused) {
+      close((*gfr)->sockfd);
+      continue;
+    }
+    // A server that predates keep-alive rejects the whole request because of the
+    // token. Ask again without it, and never send it there again.
+    if (status == -3 && keepAlive && support == 0) {
+      close((*gfr)->sockfd);
+      setKeepAliveSupport((*gfr)->server, (*gfr)->port, -1);
+      continue;
     }
+    break;
   }
 
-  // It's possible we got 0 or -1 before we transfered the entire header
-  if (bytesRecvd == -1) {
-    perror("client: recv got -1 indicating some issue with the transfer");
-    (*gfr)->respStatus = GF_INVALID;
-    close((*gfr)->sockfd);
-    return -1;
-  } else if (bytesRecvd == 0 && strstr(headerBuff, "\r\n\r\n") == NULL) {
-    perror("client: the server terminated the connection during transfer of the message header");
-    (*gfr)->respStatus = GF_INVALID;
-    close((*gfr)->sockfd);
-    return -1;
+  if (status == 0 && (*gfr)->keepAlive && support == 0) {
+    setKeepAliveSupport((*gfr)->server, (*gfr)->port, 1);
   }
 
-  // printf("------- parsing header START--------\n");
-  gfstatus_t status = parseResponseHeader(gfr, (*gfr)->response, totalHeaderBytes);
-  // printf("------- parsing header DONE --------\n");
-  if (status == GF_INVALID) {
-    perror("client: issue with receiving the response from server.");
-    close((*gfr)->sockfd);
-    return -1;
-  } else if (status == GF_FILE_NOT_FOUND || status == GF_ERROR) {
-    return 0; // We should return 0 in these cases
-  }
-
-  char *contentStart = strstr(headerBuff, "\r\n\r\n");
-  // since there are 4 delimiting chars we need to move up 4 to get to the content
-  contentStart += 4; 
-  size_t headerSize = contentStart - headerBuff;
-  size_t contentBytes = totalHeaderBytes - headerSize;
-
-  // Process the first chunk of content
-  if (contentBytes > 0) {
-      (*gfr)->writefunc((void *)contentStart, contentBytes, (*gfr)->writearg);
-      (*gfr)->bytesRecvd += contentBytes;
-  }
+  // A connection can go back to the pool if the server keeps it open and nothing
+  // but our response came in on it
+  int reusable = status == 0 && (*gfr)->keepAlive && conn.start == conn.end;
+  releaseConnection((*gfr)->server, (*gfr)->port, (*gfr)->sockfd, reusable);
+  (*gfr)->sockfd = -1;
 
-  // At this point all we need to do is get the actual content so we just keep looping until we get 0
-  while ((bytesRecvd = recv((*gfr)->sockfd, (*gfr)->response, BUFSIZ, 0)) > 0) {
-    (*gfr)->writefunc((void *)(*gfr)->response, bytesRecvd, (*gfr)->writearg);
-    (*gfr)->bytesRecvd += bytesRecvd;
+  return status < 0 ? -1 : 0;
+}
 
-    if ((*gfr)->bytesRecvd >= (*gfr)->fileLen) {
-      break;  // Stop when file length is reached
+int gfc_perform_pipeline(gfcrequest_t **requests, size_t count) {
+  int failures = 0;
+  size_t next = 0;
+  int rejected = 0;
+
+  // Every pass opens one connection and pipelines as many of the remaining requests
+  // as the server lets us. Requests it didn't get to are retried on a new connection.
+  while (next < count) {
+    gfc_conn_t conn;
+    int reused;
+    int support = keepAliveSupport(requests[next]->server, requests[next]->port);
+    int keepAlive = !rejected && support >= 0;
+    conn.start = conn.end = 0;
+    conn.sockfd = acquireConnection(requests[next]->server, requests[next]->port, &reused);
+    if (conn.sockfd == -1) {
+      perror("client: connectToServer");
+      requests[next]->respStatus = GF_INVALID;
+      failures++;
+      next++;
+      continue;
     }
-  }
 
-  // Validate any error scenarios from recv() like:
-  // 1) Got a generic issu with transfering data
-  // 2) Got a disconnect before sending all bytes
-  if (bytesRecvd == -1) {
-    perror("client: recv got -1 indicating some issue with the transfer");
-    (*gfr)->respStatus = GF_INVALID;
-    close((*gfr)->sockfd);
-    return -1;
-  } else if (bytesRecvd == 0) {
-    if((*gfr)->bytesRecvd != (*gfr)->fileLen) {
-      perror("client: the server terminated the connection during the transfer of message body");
-      (*gfr)->respStatus = status;
-      close((*gfr)->sockfd);
-      return -1;
-    } else {
-      (*gfr)->respStatus = GF_OK;
+    // Our requests are tiny and we don't want each one to wait for the previous one's ACK
+    int noDelay = 1;
+    setsockopt(conn.sockfd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof noDelay);
+
+    // We only send ahead once the server granted keep-alive. A server that doesn't
+    // support it would close with our extra requests unread and reset the connection.
+    size_t sent = next;
+    size_t done = next;
+    size_t window = 1;
+    while (done < count) {
+      // Stay a bounded number of requests ahead so neither side's buffers fill up
+      // while the other one isn't reading.
+      while (sent < count && sent - done < window) {
+        if (sendRequest(&requests[sent], conn.sockfd, keepAlive) == -1) {
+          break;
+        }
+        sent++;
+      }
+      if (sent == done) {
+        requests[done]->respStatus = GF_INVALID;
+        failures++;
+        done++;
+        break;
+      }
+
+      int status = readResponse(&requests[done], &conn);
+      if (status == -2 && (done > next || reused)) {
+        break; // the server closed between responses, retry the rest on a new connection
+      } else if (status == -3 && keepAlive && support == 0 && done == next) {
+        // Only the token was wrong, so ask again without it on a new connection
+        rejected = 1;
+        setKeepAliveSupport(requests[next]->server, requests[next]->port, -1);
+        break;
+      } else if (status < 0) {
+        failures++;
+        done++;
+        break; // we can't tell where the next response starts anymore
+      }
+
+      done++;
+      if (!requests[done-1]->keepAlive) {
+        break; // the server closes the connection after this response
+      }
+      if (support == 0) {
+        setKeepAliveSupport(requests[next]->server, requests[next]->port, 1);
+        support = 1;
+      }
+      window = PIPELINE_DEPTH;
     }
-  } 
-  // Ensure proper cleanup
-  close((*gfr)->sockfd);
-  (*gfr)->sockfd = -1;
 
-  return 0;
+    // We only get to hand the connection back if we read every response we asked for
+    int reusable = done == sent && done > next && requests[done-1]->keepAlive && conn.start == conn.end;
+    releaseConnection(requests[next]->server, requests[next]->port, conn.sockfd, reusable);
+    next = done;
+  }
+
+  return failures;
 }
 
 void gfc_set_port(gfcrequest_t **gfr, unsigned short port) {
@@ -267,6 +357,16 @@ void gfc_set_path(gfcrequest_t **gfr, const char *path) {
   (*gfr)->path = path;
 }
 
+void gfc_set_range(gfcrequest_t **gfr, size_t offset, size_t length) {
+  if (gfr == NULL || *gfr == NULL) {
+    perror("gfc_set_range: gfr or *gfr is NULL");
+    return;
+  }
+  (*gfr)->hasRange = 1;
+  (*gfr)->rangeOffset = offset;
+  (*gfr)->rangeLength = length;
+}
+
 void gfc_set_headerfunc(gfcrequest_t **gfr, void (*headerfunc)(void *, size_t, void *)) {
   if (gfr == NULL || *gfr == NULL) {
     perror("gfc_set_headerfunc: gfr or *gfr is NULL");
@@ -340,90 +440,343 @@ int createSocketAndConnect(struct addrinfo *addressesList) {
     return sockfd;
 }
 
-// <scheme> <status> <length>\r\n\r\n<content>
-// This method should parse the header and get a couple of things.
-// 1. Store the response code in gfr
-// 2. If the status is OK, store the file length in gfr
-gfstatus_t parseResponseHeader(gfcrequest_t **gfr, const char* response, ssize_t bytesRecvd) {
-  if (gfr == NULL || *gfr == NULL || response == NULL) {
-    (*gfr) ->respStatus = GF_INVALID;
-    return (*gfr)->respStatus;
+// Returns the entry for server and port. With resolve set, also resolves the server
+// if we haven't yet. Must be called with hostsLock held.
+static gfc_host_t *lookupHost(const char *server, unsigned short port, int resolve) {
+  gfc_host_t *host = hosts;
+  while (host != NULL && (host->port != port || strcmp(host->server, server) != 0)) {
+    host = host->next;
   }
 
- // printf("checking GETFILE is there\n");
-  const char *prefix = "GETFILE";
-  int prefixLen = strlen(prefix);
-  if (strncmp(response, prefix, prefixLen) != 0) {
-    perror("client: the server returned an incompatible response header");
-    (*gfr)->respStatus = GF_INVALID;
-    return (*gfr)->respStatus;
+  if (host == NULL) {
+    host = calloc(1, sizeof(gfc_host_t));
+    if (host == NULL || (host->server = strdup(server)) == NULL) {
+      perror("client: failed to allocate a host entry");
+      free(host);
+      return NULL;
+    }
+    host->port = port;
+    host->next = hosts;
+    hosts = host;
   }
 
+  if (!resolve) {
+    return host;
+  }
+  if (host->addresses != NULL) {
+    resolverHits++;
+    return host;
+  }
 
- // printf("checking delimiters are present\n");
-  if (strstr(response, "\r\n\r\n") == NULL){
-    perror("client: response didn't contain the '\r\n\r\n' suffix.");
-    (*gfr)->respStatus = GF_INVALID;
-    return (*gfr)->respStatus;
+  resolverMisses++;
+  host->addresses = resolveServer(server, port);
+  return host->addresses != NULL ? host : NULL;
+}
+
+struct addrinfo *resolveServer(const char *server, unsigned short port) {
+  struct addrinfo addrConfig;
+
+  // Zero out and set up our address config
+  memset(&addrConfig, 0, sizeof addrConfig);
+  addrConfig.ai_family = AF_UNSPEC;
+  addrConfig.ai_socktype = SOCK_STREAM; // Since we want to make this a TCP socket
+
+  char portStr[MAX_PORT_DIGITS];
+  memset(&portStr, 0, sizeof portStr);
+  sprintf(portStr, "%d", port);
+
+  int addrinfoStatus;
+  struct addrinfo *addressesList;
+  addrinfoStatus = getaddrinfo(server, portStr, &addrConfig, &addressesList);
+  if (addrinfoStatus != 0) {
+      // Send error to stderr and stop the program since ther's no point to continue if getaddrinfo fails
+      fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(addrinfoStatus));
+      return NULL;
   }
+  return addressesList;
+}
 
-  // let's ensure that we only have 2 spaces in the request since it's an OK status
- // printf("Checking the number of spaces in the string");
-  const char *str = response;
-  int spaceCount = 0;
-  while((str = strchr(str, ' ')) != NULL) {
-      spaceCount++;
-      str++;
+int connectToServer(const char *server, unsigned short port) {
+  if (!poolEnabled) {
+    struct addrinfo *addressesList = resolveServer(server, port);
+    if (addressesList == NULL) {
+      return -1;
+    }
+    int sockfd = createSocketAndConnect(addressesList);
+    freeaddrinfo(addressesList); // we don't need the linked list anymore, so let's free it up
+    return sockfd;
   }
 
- // printf("The number of spaces is: %d\n", spaceCount);
+  pthread_mutex_lock(&hostsLock);
+  gfc_host_t *host = lookupHost(server, port, 1);
+  struct addrinfo *addressesList = host != NULL ? host->addresses : NULL;
+  pthread_mutex_unlock(&hostsLock);
+  if (addressesList == NULL) {
+    return -1;
+  }
 
-  if (spaceCount > 2 || spaceCount < 1) {
-    (*gfr) -> respStatus = GF_INVALID;
-    return (*gfr)->respStatus;
+  int sockfd = createSocketAndConnect(addressesList);
+
+  pthread_mutex_lock(&hostsLock);
+  if (sockfd != -1) {
+    connectionsOpened++;
+  } else if (host->addresses == addressesList) {
+    // The server may have moved, so the next request resolves it again
+    gfc_retired_t *old = malloc(sizeof(gfc_retired_t));
+    if (old != NULL) {
+      old->addresses = addressesList;
+      old->next = retired;
+      retired = old;
+      host->addresses = NULL;
+    }
   }
+  pthread_mutex_unlock(&hostsLock);
+  return sockfd;
+}
 
+int acquireConnection(const char *server, unsigned short port, int *reused) {
+  *reused = 0;
+  if (!poolEnabled) {
+    return connectToServer(server, port);
+  }
 
-  // OK status header:    <scheme> <status> <length>\r\n\r\n<content>
-  // !OK sttatus header:  <scheme> <status>\r\n\r\n
+  pthread_mutex_lock(&hostsLock);
+  gfc_host_t *host = lookupHost(server, port, 0);
+  while (host != NULL && host->nidle > 0) {
+    int sockfd = host->idle[--host->nidle];
+
+    // An idle connection must have nothing to read. EOF (or anything else) means
+    // the server gave up on it, e.g. because it sat idle for too long.
+    char byte;
+    if (recv(sockfd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      connectionsReused++;
+      pthread_mutex_unlock(&hostsLock);
+      *reused = 1;
+      return sockfd;
+    }
+    close(sockfd);
+  }
+  pthread_mutex_unlock(&hostsLock);
 
- // printf("Extracting the status\n");
-  char *statusStart = strchr(response, ' '); // points to the first space which should be after the <scheme>
-  char *statusEnd;
-  if(statusStart != NULL && spaceCount == 2) {
-    statusEnd = strchr(statusStart+1, ' '); // points to the next space which should be after the <status>
-  } else if (statusStart != NULL && spaceCount == 1) {
-    statusEnd = strchr(statusStart+1, '\r'); // points to the start of '\r\n\r\n'
+  return connectToServer(server, port);
+}
+
+void releaseConnection(const char *server, unsigned short port, int sockfd, int reusable) {
+  if (reusable && poolEnabled) {
+    pthread_mutex_lock(&hostsLock);
+    gfc_host_t *host = lookupHost(server, port, 0);
+    if (host != NULL && host->nidle < MAX_IDLE_CONNECTIONS) {
+      host->idle[host->nidle++] = sockfd;
+      sockfd = -1;
+    }
+    pthread_mutex_unlock(&hostsLock);
   }
-  
-  statusStart++; // move up to the first char of the status code
-  if (statusEnd == NULL) {
-    perror("client: statusEnd is NULL, invalid response format");
+
+  if (sockfd != -1) {
+    close(sockfd);
+  }
+}
+
+int keepAliveSupport(const char *server, unsigned short port) {
+  // Without gfc_global_init there's nowhere to remember it
+  if (!poolEnabled) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&hostsLock);
+  gfc_host_t *host = lookupHost(server, port, 0);
+  int support = host != NULL ? host->keepAlive : 0;
+  pthread_mutex_unlock(&hostsLock);
+  return support;
+}
+
+void setKeepAliveSupport(const char *server, unsigned short port, int support) {
+  if (!poolEnabled) {
+    return;
+  }
+
+  pthread_mutex_lock(&hostsLock);
+  gfc_host_t *host = lookupHost(server, port, 0);
+  if (host != NULL) {
+    host->keepAlive = support;
+  }
+  pthread_mutex_unlock(&hostsLock);
+}
+
+int formatRequest(gfcrequest_t **gfr, char *request, size_t len, int keepAlive) {
+  char range[64] = "";
+  if ((*gfr)->hasRange) {
+    snprintf(range, sizeof range, " RANGE %zu %zu", (*gfr)->rangeOffset, (*gfr)->rangeLength);
+  }
+
+  int requestLen = snprintf(request, len, "GETFILE GET %s%s%s\r\n\r\n", (*gfr)->path,
+                            range, keepAlive ? " KEEPALIVE" : "");
+  if (requestLen < 0 || requestLen >= len) {
+    fprintf(stderr, "client: request path is too long\n");
+    return -1;
+  }
+  return requestLen;
+}
+
+int sendRequest(gfcrequest_t **gfr, int sockfd, int keepAlive) {
+  char request[BUFSIZ];
+  int requestLen = formatRequest(gfr, request, sizeof request, keepAlive);
+  if (requestLen == -1) {
+    return -1;
+  }
+
+  size_t totalBytesSent = 0;
+  while (totalBytesSent < requestLen) {
+    ssize_t bytesSent = send(sockfd, request + totalBytesSent, requestLen - totalBytesSent, MSG_NOSIGNAL);
+    if (bytesSent == -1) {
+      perror("client: send failed");
+      return -1;
+    }
+    totalBytesSent += bytesSent;
+  }
+  return 0;
+}
+
+int readResponse(gfcrequest_t **gfr, gfc_conn_t *conn) {
+  // Bytes left over from the previous response start this one. Moving them to the
+  // front means the header never wraps and the parser's views stay valid.
+  size_t leftover = conn->end - conn->start;
+  memmove(conn->buf, conn->buf + conn->start, leftover);
+  conn->start = 0;
+  conn->end = leftover;
+
+  (*gfr)->bytesRecvd = 0;
+  (*gfr)->fileLen = 0;
+  (*gfr)->totalLen = 0;
+  (*gfr)->keepAlive = 0;
+
+  gf_header_parser_t parser;
+  gf_parser_init(&parser);
+  gf_parse_result_t result = gf_parser_feed(&parser, conn->buf, conn->end);
+
+  while (result == GF_PARSE_INCOMPLETE) {
+    if (conn->end == sizeof conn->buf) {
+      fprintf(stderr, "client: the response header is larger than %zu bytes\n", sizeof conn->buf);
+      (*gfr)->respStatus = GF_INVALID;
+      return -1;
+    }
+
+    ssize_t bytesRecvd = recv(conn->sockfd, conn->buf + conn->end, sizeof conn->buf - conn->end, 0);
+    if (bytesRecvd == 0 && conn->end == 0) {
+      // Not a single byte of this response arrived, the caller may retry the request
+      (*gfr)->respStatus = GF_INVALID;
+      return -2;
+    } else if (bytesRecvd == -1) {
+      perror("client: recv got -1 indicating some issue with the transfer");
+      (*gfr)->respStatus = GF_INVALID;
+      return -1;
+    } else if (bytesRecvd == 0) {
+      perror("client: the server terminated the connection during transfer of the message header");
+      (*gfr)->respStatus = GF_INVALID;
+      return -1;
+    }
+
+    conn->end += bytesRecvd;
+    result = gf_parser_feed(&parser, conn->buf, conn->end);
+  }
+
+  // printf("------- parsing header START--------\n");
+  gfstatus_t status = result == GF_PARSE_DONE ? parseResponseHeader(gfr, &parser) : GF_INVALID;
+  // printf("------- parsing header DONE --------\n");
+  if (status == GF_INVALID && parser.nfields == 2 && gf_view_equals(parser.fields[0], "GETFILE") &&
+      gf_view_equals(parser.fields[1], "INVALID")) {
+    // A well-formed answer, the server just didn't understand our request
+    conn->start = parser.headerLen;
+    return -3;
+  }
+  if (status == GF_INVALID) {
+    perror("client: issue with receiving the response from server.");
     (*gfr)->respStatus = GF_INVALID;
-    return (*gfr)->respStatus;
+    return -1;
   }
-  size_t statusLen = statusEnd - statusStart;
 
-  char extractedStatus[16];
-  memset(&extractedStatus, 0, sizeof(extractedStatus));
+  if ((*gfr)->headerfunc != NULL) {
+    (*gfr)->headerfunc(conn->buf, parser.headerLen, (*gfr)->headerarg);
+  }
+  conn->start = parser.headerLen;
+
+  if (status == GF_FILE_NOT_FOUND || status == GF_ERROR) {
+    return 0; // We should return 0 in these cases
+  }
+
+  // Whatever followed the header is the start of the body. After that we keep reading
+  // until we have the whole file, but never past it since the next response may follow.
+  while ((*gfr)->bytesRecvd < (*gfr)->fileLen) {
+    if (conn->start == conn->end) {
+      ssize_t bytesRecvd = recv(conn->sockfd, conn->buf, sizeof conn->buf, 0);
+
+      // Validate any error scenarios from recv() like:
+      // 1) Got a generic issu with transfering data
+      // 2) Got a disconnect before sending all bytes
+      if (bytesRecvd == -1) {
+        perror("client: recv got -1 indicating some issue with the transfer");
+        (*gfr)->respStatus = GF_INVALID;
+        return -1;
+      } else if (bytesRecvd == 0) {
+        perror("client: the server terminated the connection during the transfer of message body");
+        return -1;
+      }
+      conn->start = 0;
+      conn->end = bytesRecvd;
+    }
+
+    conn->start += deliverBody(gfr, conn->buf + conn->start, conn->end - conn->start);
+  }
 
- // printf("Ensuring that the statusLen of '%zu' doesn't exceede '%zu'\n", statusLen, sizeof extractedStatus);
-  if (statusLen >= sizeof extractedStatus){
+  (*gfr)->respStatus = GF_OK;
+  return 0;
+}
+
+size_t deliverBody(gfcrequest_t **gfr, const char *data, size_t len) {
+  size_t chunk = len;
+  if (chunk > (*gfr)->fileLen - (*gfr)->bytesRecvd) {
+    chunk = (*gfr)->fileLen - (*gfr)->bytesRecvd;
+  }
+  if (chunk > 0) {
+    (*gfr)->writefunc((void *) data, chunk, (*gfr)->writearg);
+    (*gfr)->bytesRecvd += chunk;
+  }
+  return chunk;
+}
+
+// <scheme> <status> <length>\r\n\r\n<content>
+// This method checks the fields the parser extracted from the header.
+// 1. Store the response code in gfr
+// 2. If the status is OK, store the file length in gfr
+gfstatus_t parseResponseHeader(gfcrequest_t **gfr, const gf_header_parser_t *parser) {
+  if (gfr == NULL || *gfr == NULL || parser == NULL) {
+    return GF_INVALID;
+  }
+
+  // OK status header:    <scheme> <status> <length>[ RANGE <size>][ KEEPALIVE]\r\n\r\n<content>
+  // !OK sttatus header:  <scheme> <status>[ KEEPALIVE]\r\n\r\n
+  if (parser->nfields < 2 || !gf_view_equals(parser->fields[0], "GETFILE")) {
+    perror("client: the server returned an incompatible response header");
     (*gfr)->respStatus = GF_INVALID;
     return (*gfr)->respStatus;
   }
 
-  strncpy(extractedStatus, statusStart, statusLen);
-  extractedStatus[statusLen] = '\0';
- // printf("status recv: '%s'\n", extractedStatus);
+  // A trailing KEEPALIVE means the server keeps the connection open for our next request
+  int nfields = parser->nfields;
+  (*gfr)->keepAlive = nfields > 2 && gf_view_equals(parser->fields[nfields-1], "KEEPALIVE");
+  if ((*gfr)->keepAlive) {
+    nfields--;
+  }
 
   // Map the status string to enum
-  if (strcmp(extractedStatus, "OK") == 0) {
+  gf_view_t status = parser->fields[1];
+  (*gfr)->fileLen = 0;
+  if (gf_view_equals(status, "OK") && (nfields == 3 || nfields == 5)) {
       (*gfr)->respStatus = GF_OK;
-  } else if (strcmp(extractedStatus, "FILE_NOT_FOUND") == 0) {
+  } else if (gf_view_equals(status, "FILE_NOT_FOUND") && nfields == 2) {
       (*gfr)->respStatus = GF_FILE_NOT_FOUND;
       return (*gfr)->respStatus;
-  } else if (strcmp(extractedStatus, "ERROR") == 0) {
+  } else if (gf_view_equals(status, "ERROR") && nfields == 2) {
       (*gfr)->respStatus = GF_ERROR;
       return (*gfr)->respStatus;
   } else {
@@ -431,27 +784,362 @@ gfstatus_t parseResponseHeader(gfcrequest_t **gfr, const char* response, ssize_t
       return (*gfr)->respStatus;
   }
 
-  char *fileLenStart = statusEnd+1;
-  char *fileLenEnd = strchr(fileLenStart, '\r');
-
-  // extract the length
-  char extractedFileLen[32];
-  memset(&extractedFileLen, 0, 32);
-  size_t fileLenLength = fileLenEnd - fileLenStart;
-  strncpy(extractedFileLen, fileLenStart, fileLenLength);
-
-  extractedFileLen[fileLenLength] = '\0';
-
-  if ((*gfr)->respStatus != GF_OK) {
-    (*gfr)->fileLen = 0;
+  if (gf_view_to_size(parser->fields[2], &(*gfr)->fileLen) == -1){
+    (*gfr)->respStatus = GF_INVALID;
     return (*gfr)->respStatus;
   }
 
-
-  if (sscanf(extractedFileLen, "%zu", &(*gfr)->fileLen) != 1){
+  // A server that ignored our range sent the whole file
+  (*gfr)->totalLen = (*gfr)->fileLen;
+  if (nfields == 5 && (!gf_view_equals(parser->fields[3], "RANGE") ||
+                       gf_view_to_size(parser->fields[4], &(*gfr)->totalLen) == -1)) {
     (*gfr)->respStatus = GF_INVALID;
     return (*gfr)->respStatus;
   }
 
   return (*gfr)->respStatus; 
 }
+
+// The multi interface drives many transfers from one thread. Every transfer owns a
+// nonblocking connection that goes through connecting, sending the request and
+// receiving the response, and is only ever touched when epoll says it's ready.
+typedef enum {
+  TRANSFER_CONNECTING,
+  TRANSFER_SENDING,
+  TRANSFER_RECEIVING
+} gfc_transfer_state_t;
+
+typedef struct gfc_transfer_t {
+  gfcrequest_t *gfr;
+  void *arg;                        // handed back by gfc_multi_info_read
+  gfc_transfer_state_t state;
+  struct addrinfo *addresses;       // only set when we resolved the server ourselves and must free them
+  struct addrinfo *nextAddress;     // the address to try if connecting to the current one fails
+  char request[BUFSIZ];
+  size_t requestLen;
+  size_t requestSent;
+  gf_header_parser_t parser;
+  int parsedHeader;
+  int returncode;
+  gfc_conn_t conn;
+  struct gfc_transfer_t *prev;      // neighbours in the running list, next is also used by the done list
+  struct gfc_transfer_t *next;
+} gfc_transfer_t;
+
+struct gfcmulti_t {
+  int epollFd;
+  size_t running;
+  gfc_transfer_t *runningHead;      // transfers in progress, so cleanup can abort them
+  gfc_transfer_t *doneHead;         // finished transfers in the order they finished
+  gfc_transfer_t *doneTail;
+};
+
+gfcmulti_t *gfc_multi_create() {
+  gfcmulti_t *multi = calloc(1, sizeof(gfcmulti_t));
+  if (multi == NULL) {
+    perror("gfc_multi_create: failed to allocate memory for the gfcmulti_t object");
+    return NULL;
+  }
+
+  multi->epollFd = epoll_create1(EPOLL_CLOEXEC);
+  if (multi->epollFd == -1) {
+    perror("gfc_multi_create: epoll_create1");
+    free(multi);
+    return NULL;
+  }
+  return multi;
+}
+
+static void finishTransfer(gfcmulti_t *multi, gfc_transfer_t *transfer, int returncode) {
+  if (transfer->conn.sockfd != -1) {
+    close(transfer->conn.sockfd); // also drops it from the epoll set
+    transfer->conn.sockfd = -1;
+  }
+  if (transfer->addresses != NULL) {
+    freeaddrinfo(transfer->addresses);
+    transfer->addresses = NULL;
+  }
+  transfer->returncode = returncode;
+
+  if (transfer->prev != NULL) {
+    transfer->prev->next = transfer->next;
+  } else {
+    multi->runningHead = transfer->next;
+  }
+  if (transfer->next != NULL) {
+    transfer->next->prev = transfer->prev;
+  }
+  multi->running--;
+
+  transfer->prev = transfer->next = NULL;
+  if (multi->doneTail != NULL) {
+    multi->doneTail->next = transfer;
+  } else {
+    multi->doneHead = transfer;
+  }
+  multi->doneTail = transfer;
+}
+
+static void failTransfer(gfcmulti_t *multi, gfc_transfer_t *transfer) {
+  if (!transfer->parsedHeader) {
+    transfer->gfr->respStatus = GF_INVALID;
+  }
+  finishTransfer(multi, transfer, -1);
+}
+
+// Starts a nonblocking connect to the next address that takes one
+static int connectNextAddress(gfcmulti_t *multi, gfc_transfer_t *transfer) {
+  while (transfer->nextAddress != NULL) {
+    struct addrinfo *address = transfer->nextAddress;
+    transfer->nextAddress = address->ai_next;
+
+    int sockfd = socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK, address->ai_protocol);
+    if (sockfd == -1) {
+      perror("client: socket");
+      continue;
+    }
+    if (connect(sockfd, address->ai_addr, address->ai_addrlen) == -1 && errno != EINPROGRESS) {
+      perror("client: connect");
+      close(sockfd);
+      continue;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof event);
+    event.events = EPOLLOUT;
+    event.data.ptr = transfer;
+    if (epoll_ctl(multi->epollFd, EPOLL_CTL_ADD, sockfd, &event) == -1) {
+      perror("client: epoll_ctl");
+      close(sockfd);
+      return -1;
+    }
+    transfer->conn.sockfd = sockfd;
+    transfer->state = TRANSFER_CONNECTING;
+    return 0;
+  }
+  return -1;
+}
+
+int gfc_multi_add(gfcmulti_t *multi, gfcrequest_t **gfr, void *arg) {
+  if (multi == NULL || gfr == NULL || *gfr == NULL) {
+    fprintf(stderr, "gfc_multi_add: multi, gfr or *gfr is NULL\n");
+    return -1;
+  }
+
+  gfc_transfer_t *transfer = malloc(sizeof(gfc_transfer_t));
+  if (transfer == NULL) {
+    perror("gfc_multi_add: failed to allocate memory for the transfer");
+    return -1;
+  }
+  transfer->gfr = *gfr;
+  transfer->arg = arg;
+  transfer->addresses = NULL;
+  transfer->requestSent = 0;
+  transfer->parsedHeader = 0;
+  transfer->returncode = 0;
+  transfer->conn.sockfd = -1;
+  transfer->conn.start = transfer->conn.end = 0;
+  gf_parser_init(&transfer->parser);
+  (*gfr)->bytesRecvd = 0;
+  (*gfr)->fileLen = 0;
+  (*gfr)->totalLen = 0;
+  (*gfr)->keepAlive = 0;
+
+  transfer->prev = NULL;
+  transfer->next = multi->runningHead;
+  if (multi->runningHead != NULL) {
+    multi->runningHead->prev = transfer;
+  }
+  multi->runningHead = transfer;
+  multi->running++;
+
+  int requestLen = formatRequest(gfr, transfer->request, sizeof transfer->request, 0);
+  if (requestLen == -1) {
+    failTransfer(multi, transfer);
+    return 0;
+  }
+  transfer->requestLen = requestLen;
+
+  // The resolver cache keeps its addresses until gfc_global_cleanup
+  if (poolEnabled) {
+    pthread_mutex_lock(&hostsLock);
+    gfc_host_t *host = lookupHost((*gfr)->server, (*gfr)->port, 1);
+    transfer->nextAddress = host != NULL ? host->addresses : NULL;
+    pthread_mutex_unlock(&hostsLock);
+  } else {
+    transfer->addresses = resolveServer((*gfr)->server, (*gfr)->port);
+    transfer->nextAddress = transfer->addresses;
+  }
+
+  if (connectNextAddress(multi, transfer) == -1) {
+    failTransfer(multi, transfer);
+  }
+  return 0;
+}
+
+// Reads whatever the socket has for the transfer. Returns 1 once the transfer is finished.
+static int receiveResponse(gfcmulti_t *multi, gfc_transfer_t *transfer) {
+  gfcrequest_t **gfr = &transfer->gfr;
+  gfc_conn_t *conn = &transfer->conn;
+
+  for (;;) {
+    if (transfer->parsedHeader) {
+      conn->start = conn->end = 0; // the body is handed over as it comes, the buffer is all ours
+    } else if (conn->end == sizeof conn->buf) {
+      fprintf(stderr, "client: the response header is larger than %zu bytes\n", sizeof conn->buf);
+      failTransfer(multi, transfer);
+      return 1;
+    }
+
+    ssize_t bytesRecvd = recv(conn->sockfd, conn->buf + conn->end, sizeof conn->buf - conn->end, 0);
+    if (bytesRecvd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+      return 0;
+    } else if (bytesRecvd <= 0) {
+      if (bytesRecvd == -1) {
+        perror("client: recv got -1 indicating some issue with the transfer");
+      } else {
+        fprintf(stderr, "client: the server terminated the connection during the transfer\n");
+      }
+      failTransfer(multi, transfer);
+      return 1;
+    }
+    conn->end += bytesRecvd;
+
+    if (!transfer->parsedHeader) {
+      gf_parse_result_t result = gf_parser_feed(&transfer->parser, conn->buf, conn->end);
+      if (result == GF_PARSE_INCOMPLETE) {
+        continue;
+      }
+      gfstatus_t status = result == GF_PARSE_DONE ? parseResponseHeader(gfr, &transfer->parser) : GF_INVALID;
+      if (status == GF_INVALID) {
+        fprintf(stderr, "client: issue with receiving the response from server.\n");
+        failTransfer(multi, transfer);
+        return 1;
+      }
+
+      if ((*gfr)->headerfunc != NULL) {
+        (*gfr)->headerfunc(conn->buf, transfer->parser.headerLen, (*gfr)->headerarg);
+      }
+      conn->start = transfer->parser.headerLen;
+      transfer->parsedHeader = 1;
+      if (status == GF_FILE_NOT_FOUND || status == GF_ERROR) {
+        finishTransfer(multi, transfer, 0);
+        return 1;
+      }
+    }
+
+    deliverBody(gfr, conn->buf + conn->start, conn->end - conn->start);
+    if ((*gfr)->bytesRecvd == (*gfr)->fileLen) {
+      (*gfr)->respStatus = GF_OK;
+      finishTransfer(multi, transfer, 0);
+      return 1;
+    }
+  }
+}
+
+static void handleTransfer(gfcmulti_t *multi, gfc_transfer_t *transfer) {
+  if (transfer->state == TRANSFER_CONNECTING) {
+    int err = 0;
+    socklen_t errLen = sizeof err;
+    getsockopt(transfer->conn.sockfd, SOL_SOCKET, SO_ERROR, &err, &errLen);
+    if (err != 0) {
+      close(transfer->conn.sockfd);
+      transfer->conn.sockfd = -1;
+      if (connectNextAddress(multi, transfer) == -1) {
+        errno = err;
+        perror("client: connect");
+        failTransfer(multi, transfer);
+      }
+      return;
+    }
+    pthread_mutex_lock(&hostsLock);
+    connectionsOpened++;
+    pthread_mutex_unlock(&hostsLock);
+    transfer->state = TRANSFER_SENDING;
+  }
+
+  if (transfer->state == TRANSFER_SENDING) {
+    while (transfer->requestSent < transfer->requestLen) {
+      ssize_t bytesSent = send(transfer->conn.sockfd, transfer->request + transfer->requestSent,
+                               transfer->requestLen - transfer->requestSent, MSG_NOSIGNAL);
+      if (bytesSent == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+          return; // still registered for EPOLLOUT
+        }
+        perror("client: send failed");
+        failTransfer(multi, transfer);
+        return;
+      }
+      transfer->requestSent += bytesSent;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof event);
+    event.events = EPOLLIN;
+    event.data.ptr = transfer;
+    if (epoll_ctl(multi->epollFd, EPOLL_CTL_MOD, transfer->conn.sockfd, &event) == -1) {
+      perror("client: epoll_ctl");
+      failTransfer(multi, transfer);
+      return;
+    }
+    transfer->state = TRANSFER_RECEIVING;
+    return; // the response can't be here yet
+  }
+
+  receiveResponse(multi, transfer);
+}
+
+size_t gfc_multi_perform(gfcmulti_t *multi, int timeout_ms) {
+  if (multi == NULL || multi->running == 0) {
+    return 0;
+  }
+
+  struct epoll_event events[64];
+  int nready = epoll_wait(multi->epollFd, events, 64, timeout_ms);
+  if (nready == -1 && errno != EINTR) {
+    perror("gfc_multi_perform: epoll_wait");
+  }
+  for (int i = 0; i < nready; i++) {
+    handleTransfer(multi, events[i].data.ptr);
+  }
+  return multi->running;
+}
+
+gfcrequest_t *gfc_multi_info_read(gfcmulti_t *multi, int *returncode, void **arg) {
+  if (multi == NULL || multi->doneHead == NULL) {
+    return NULL;
+  }
+
+  gfc_transfer_t *transfer = multi->doneHead;
+  multi->doneHead = transfer->next;
+  if (multi->doneHead == NULL) {
+    multi->doneTail = NULL;
+  }
+
+  gfcrequest_t *gfr = transfer->gfr;
+  if (returncode != NULL) {
+    *returncode = transfer->returncode;
+  }
+  if (arg != NULL) {
+    *arg = transfer->arg;
+  }
+  free(transfer);
+  return gfr;
+}
+
+void gfc_multi_cleanup(gfcmulti_t **multi) {
+  if (multi == NULL || *multi == NULL) {
+    return;
+  }
+
+  // Transfers still in progress are aborted, and nobody reads the finished ones anymore
+  while ((*multi)->runningHead != NULL) {
+    failTransfer(*multi, (*multi)->runningHead);
+  }
+  while (gfc_multi_info_read(*multi, NULL, NULL) != NULL) {
+  }
+
+  close((*multi)->epollFd);
+  free(*multi);
+  *multi = NULL;
+}
@@ -41,6 +41,14 @@ void gfc_set_port(gfcrequest_t **gfr, unsigned short port);
  */
 void gfc_set_path(gfcrequest_t **gfr, const char* path);
 
+/*
+ * Asks for length bytes of the file starting at offset instead of the whole
+ * file (a length of 0 means up to the end). gfc_get_filelen then returns the
+ * length of that part and gfc_get_totallen the length of the whole file. The
+ * server sends fewer bytes than asked for if the range goes past the end.
+ */
+void gfc_set_range(gfcrequest_t **gfr, size_t offset, size_t length);
+
 /*
  * Sets the server to which the request will be sent.
  */
@@ -93,6 +101,61 @@ void gfc_set_writefunc(gfcrequest_t **gfr, void (*writefunc)(void *data_buffer,
  */
 int gfc_perform(gfcrequest_t **gfr);
 
+/*
+ * Performs count transfers over as few connections as possible. The requests
+ * are pipelined on a persistent connection (the GETFILE KEEPALIVE extension)
+ * and their responses are delivered to each request's callbacks in order.
+ * If the server doesn't support keep-alive or closes the connection, the
+ * remaining requests continue on a new connection. A server that rejects
+ * the first request because of the token gets it again without one, as
+ * described for gfc_global_init. All requests must use the
+ * same server and port. Returns the number of requests whose transfer failed,
+ * so 0 means every communication succeeded. Use gfc_get_status and the other
+ * getters for the outcome of each request.
+ */
+int gfc_perform_pipeline(gfcrequest_t **requests, size_t count);
+
+/*
+ * A set of transfers that one thread drives at the same time, modelled on
+ * libcurl's "multi" interface. Every transfer gets its own nonblocking
+ * connection and the header and write callbacks are called just like with
+ * gfc_perform, but from inside gfc_multi_perform.
+ */
+typedef struct gfcmulti_t gfcmulti_t;
+
+/*
+ * Returns a new, empty multi handle, or NULL on failure.
+ */
+gfcmulti_t *gfc_multi_create();
+
+/*
+ * Starts the transfer described by gfr. The request must stay alive until
+ * gfc_multi_info_read hands it back, together with arg. Returns 0 if the
+ * transfer was added (a transfer that fails right away is reported through
+ * gfc_multi_info_read as well) and -1 otherwise.
+ */
+int gfc_multi_add(gfcmulti_t *multi, gfcrequest_t **gfr, void *arg);
+
+/*
+ * Waits up to timeout_ms milliseconds (-1 waits forever) for any of the
+ * transfers to make progress and moves them along. Returns the number of
+ * transfers that are still running.
+ */
+size_t gfc_multi_perform(gfcmulti_t *multi, int timeout_ms);
+
+/*
+ * Returns the next finished request, or NULL if none finished since the last
+ * call. returncode is set to what gfc_perform would have returned for it and
+ * arg to the one passed to gfc_multi_add. Both may be NULL.
+ */
+gfcrequest_t *gfc_multi_info_read(gfcmulti_t *multi, int *returncode, void **arg);
+
+/*
+ * Aborts the transfers that are still running and frees the multi handle.
+ * The requests themselves still belong to the caller.
+ */
+void gfc_multi_cleanup(gfcmulti_t **multi);
+
 /*
  * Returns the status of the response.
  */
@@ -104,6 +167,12 @@ gfstatus_t gfc_get_status(gfcrequest_t **gfr);
  */
 size_t gfc_get_filelen(gfcrequest_t **gfr);
 
+/*
+ * Returns the length of the whole file. This is the same as gfc_get_filelen
+ * unless the request asked for a range and the server supports them.
+ */
+size_t gfc_get_totallen(gfcrequest_t **gfr);
+
 
 /*
  * Frees memory associated with the request.
@@ -118,14 +187,22 @@ void gfc_cleanup(gfcrequest_t **gfr);
 size_t gfc_get_bytesreceived(gfcrequest_t **gfr);
 
 /*
- * Sets up any global data structures needed for the library.
+ * Sets up any global data structures needed for the library: a cache of
+ * resolved server addresses and a pool of open connections per server and
+ * port. Once it's called, requests ask for keep-alive and a connection the
+ * server keeps open is reused by the next request to the same server.
+ * A server that predates keep-alive rejects a request carrying the token
+ * as INVALID. Its first such answer is taken as a refusal: the request is
+ * sent again without the token, and so is every later one to that server,
+ * each on its own connection as before.
  * Warning: this function may not be thread-safe.
  */
 void gfc_global_init();
 
 
 /*
- * Cleans up any global data structures needed for the library.
+ * Cleans up any global data structures needed for the library and closes
+ * the pooled connections. No request may be in progress.
  * Warning: this function may not be thread-safe.
  */
 void gfc_global_cleanup();
@@ -1,5 +1,6 @@
 #include <regex.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include "gfclient.h"
 #include "workload.h"
@@ -7,6 +8,7 @@
 
 #define BUFSIZE 1024
 #define PATH_BUFFER_SIZE 256
+#define SEGMENT_MIN (1 << 20) // files up to this size come in one piece, larger ones in segments of at least this size
 
 #define USAGE                                                             \
   "usage:\n"                                                              \
@@ -16,7 +18,10 @@
   "  -p [server_port]    Server port (Default: 53948)\n"                  \
   "  -w [workload_path]  Path to workload file (Default: workload.txt)\n" \
   "  -s [server_addr]    Server address (Default: 127.0.0.1)\n"           \
-  "  -n [num_requests]   Request download total (Default: 14)\n"
+  "  -n [num_requests]   Request download total (Default: 14)\n"         \
+  "  -k [batch_size]     Pipeline batches of requests on one connection\n"  \
+  "  -g [segments]       Download large files over this many connections at once\n"  \
+  "  -m [concurrency]    Run this many downloads at once from one thread with gfc_multi\n"
 
 /* OPTIONS DESCRIPTOR ====================================================== */
 static struct option gLongOptions[] = {
@@ -24,6 +29,9 @@ static struct option gLongOptions[] = {
     {"workload", required_argument, NULL, 'w'},
     {"port", required_argument, NULL, 'p'},
     {"nrequests", required_argument, NULL, 'n'},
+    {"keepalive", required_argument, NULL, 'k'},
+    {"segments", required_argument, NULL, 'g'},
+    {"multi", required_argument, NULL, 'm'},
     {"help", no_argument, NULL, 'h'},
     {NULL, 0, NULL, 0}};
 
@@ -70,19 +78,229 @@ static void writecb(void *data, size_t data_len, void *arg) {
   fwrite(data, 1, data_len, file);
 }
 
+/* A segment lands at its own offset of the file, whatever order they arrive in */
+typedef struct {
+  int fd;
+  off_t offset;
+} segment_sink_t;
+
+static void pwritecb(void *data, size_t data_len, void *arg) {
+  segment_sink_t *sink = (segment_sink_t *)arg;
+
+  while (data_len > 0) {
+    ssize_t written = pwrite(sink->fd, data, data_len, sink->offset);
+    if (written == -1) {
+      if (errno == EINTR)
+        continue;
+      perror("Unable to write the segment");
+      return;
+    }
+    data = (char *)data + written;
+    data_len -= written;
+    sink->offset += written;
+  }
+}
+
+typedef struct {
+  gfcrequest_t *gfr;
+  segment_sink_t sink;
+  int returncode;
+} segment_t;
+
+static gfcrequest_t *createSegmentRequest(char *server, unsigned short port, char *req_path,
+                                          segment_sink_t *sink) {
+  gfcrequest_t *gfr = gfc_create();
+
+  gfc_set_port(&gfr, port);
+  gfc_set_path(&gfr, req_path);
+  gfc_set_server(&gfr, server);
+  gfc_set_writefunc(&gfr, pwritecb);
+  gfc_set_writearg(&gfr, sink);
+
+  return gfr;
+}
+
+static void *segmentThread(void *arg) {
+  segment_t *segment = (segment_t *)arg;
+
+  segment->returncode = gfc_perform(&segment->gfr);
+  return NULL;
+}
+
+/* Report one request and drop the local copy of a failed download */
+static void reportRequest(FILE *file, char *local_path, int returncode, gfstatus_t status,
+                          size_t received, size_t filelen) {
+  fclose(file);
+  if (0 > returncode) {
+    fprintf(stdout, "gfc_perform returned error %d\n", returncode);
+    if (0 > unlink(local_path))
+      fprintf(stderr, "warning: unlink failed on %s\n", local_path);
+  } else if (status != GF_OK) {
+    if (0 > unlink(local_path))
+      fprintf(stderr, "warning: unlink failed on %s\n", local_path);
+  }
+
+  fprintf(stdout, "Received:: %zu of %zu bytes\n", received, filelen);
+  fprintf(stdout, "Status: %s\n", gfc_strstatus(status));
+}
+
+/* Finish one request: drop the local copy of a failed download and report */
+static void finishRequest(gfcrequest_t **gfr, FILE *file, char *local_path, int returncode) {
+  reportRequest(file, local_path, returncode, gfc_get_status(gfr), gfc_get_bytesreceived(gfr),
+                gfc_get_filelen(gfr));
+  gfc_cleanup(gfr);
+}
+
+/*
+ * Download req_path over up to nsegments connections at once. The first request asks
+ * for the first SEGMENT_MIN bytes and learns the file's length from the response, the
+ * rest of the file is then split evenly between the other connections.
+ */
+static void downloadSegmented(char *server, unsigned short port, char *req_path, FILE *file,
+                              char *local_path, int nsegments) {
+  segment_sink_t probeSink = {fileno(file), 0};
+  gfcrequest_t *probe = createSegmentRequest(server, port, req_path, &probeSink);
+  gfc_set_range(&probe, 0, SEGMENT_MIN);
+  int returncode = gfc_perform(&probe);
+
+  // A server without range support rejects the request, so we ask for the whole file
+  if (returncode == 0 && gfc_get_status(&probe) == GF_INVALID) {
+    gfc_cleanup(&probe);
+    probeSink.offset = 0;
+    probe = createSegmentRequest(server, port, req_path, &probeSink);
+    returncode = gfc_perform(&probe);
+  }
+
+  gfstatus_t status = gfc_get_status(&probe);
+  size_t received = gfc_get_bytesreceived(&probe);
+  size_t total = gfc_get_totallen(&probe);
+  size_t offset = gfc_get_filelen(&probe);
+  gfc_cleanup(&probe);
+
+  if (returncode < 0 || status != GF_OK || offset >= total) {
+    reportRequest(file, local_path, returncode, status, received, status == GF_OK ? total : 0);
+    return;
+  }
+
+  size_t remaining = total - offset;
+  size_t segmentLen = (remaining + nsegments - 1) / nsegments;
+  if (segmentLen < SEGMENT_MIN)
+    segmentLen = SEGMENT_MIN;
+
+  segment_t *segments = calloc(nsegments, sizeof(segment_t));
+  pthread_t *threads = calloc(nsegments, sizeof(pthread_t));
+  if (segments == NULL || threads == NULL) {
+    perror("Unable to allocate the segments");
+    exit(EXIT_FAILURE);
+  }
+
+  int started = 0;
+  for (; offset < total; offset += segmentLen, started++) {
+    segment_t *segment = &segments[started];
+    segment->sink.fd = fileno(file);
+    segment->sink.offset = offset;
+    segment->gfr = createSegmentRequest(server, port, req_path, &segment->sink);
+    gfc_set_range(&segment->gfr, offset, segmentLen);
+    if (pthread_create(&threads[started], NULL, segmentThread, segment) != 0) {
+      segment->returncode = gfc_perform(&segment->gfr);
+      threads[started] = 0;
+    }
+  }
+
+  for (int i = 0; i < started; i++) {
+    if (threads[i] != 0)
+      pthread_join(threads[i], NULL);
+    if (segments[i].returncode < 0)
+      returncode = segments[i].returncode;
+    if (gfc_get_status(&segments[i].gfr) != GF_OK)
+      status = gfc_get_status(&segments[i].gfr);
+    received += gfc_get_bytesreceived(&segments[i].gfr);
+    gfc_cleanup(&segments[i].gfr);
+  }
+  free(segments);
+  free(threads);
+
+  reportRequest(file, local_path, returncode, status, received, total);
+}
+
+/* One download driven by gfc_multi, it comes back as the arg once it's done */
+typedef struct {
+  gfcrequest_t *gfr;
+  FILE *file;
+  char local_path[PATH_BUFFER_SIZE];
+} download_t;
+
+static download_t *startDownload(gfcmulti_t *multi, char *server, unsigned short port) {
+  char *req_path = workload_get_path();
+
+  if (strlen(req_path) > 256) {
+    fprintf(stderr, "Request path exceeded maximum of 256 characters\n.");
+    exit(EXIT_FAILURE);
+  }
+
+  download_t *download = malloc(sizeof(download_t));
+  if (download == NULL) {
+    perror("Unable to allocate the download");
+    exit(EXIT_FAILURE);
+  }
+  localPath(req_path, download->local_path);
+  download->file = openFile(download->local_path);
+
+  download->gfr = gfc_create();
+  gfc_set_port(&download->gfr, port);
+  gfc_set_path(&download->gfr, req_path);
+  gfc_set_server(&download->gfr, server);
+  gfc_set_writefunc(&download->gfr, writecb);
+  gfc_set_writearg(&download->gfr, download->file);
+
+  fprintf(stdout, "Requesting %s%s\n", server, req_path);
+  if (gfc_multi_add(multi, &download->gfr, download) == -1) {
+    exit(EXIT_FAILURE);
+  }
+  return download;
+}
+
+/* Keep up to concurrency downloads in flight, all from this thread */
+static void downloadMulti(char *server, unsigned short port, int nrequests, int concurrency) {
+  gfcmulti_t *multi = gfc_multi_create();
+  if (multi == NULL) {
+    exit(EXIT_FAILURE);
+  }
+
+  int started = 0;
+  size_t running = 0;
+  while (started < nrequests || running > 0) {
+    while (started < nrequests && running < concurrency) {
+      startDownload(multi, server, port);
+      started++;
+      running++;
+    }
+
+    running = gfc_multi_perform(multi, -1);
+
+    int returncode;
+    download_t *download;
+    while (gfc_multi_info_read(multi, &returncode, (void **)&download) != NULL) {
+      finishRequest(&download->gfr, download->file, download->local_path, returncode);
+      free(download);
+    }
+  }
+
+  gfc_multi_cleanup(&multi);
+}
+
 /* Main ========================================================= */
 int main(int argc, char **argv) {
   /* COMMAND LINE OPTIONS ============================================= */
 
-  gfcrequest_t *gfr;
   char *workload_path = "workload.txt";
   int nrequests = 15;
+  int batch = 1;
+  int nsegments = 1;
+  int concurrency = 0;
   int option_char = 0;
 
-  FILE *file;
-  int returncode;
   char *req_path;
-  char local_path[PATH_BUFFER_SIZE];
 
   char *server = "localhost";
   unsigned short port = 53948;
@@ -90,7 +308,7 @@ int main(int argc, char **argv) {
   setbuf(stdout, NULL);  // disable buffering
 
   // Parse and set command line arguments
-  while ((option_char = getopt_long(argc, argv, "l:r:hp:s:n:", gLongOptions,
+  while ((option_char = getopt_long(argc, argv, "l:r:hp:s:n:w:k:g:m:", gLongOptions,
                                     NULL)) != -1) {
     switch (option_char) {
       case 'r':
@@ -111,6 +329,15 @@ int main(int argc, char **argv) {
       case 'w':  // workload-path
         workload_path = optarg;
         break;
+      case 'k':  // keepalive
+        batch = atoi(optarg);
+        break;
+      case 'g':  // segments
+        nsegments = atoi(optarg);
+        break;
+      case 'm':  // multi
+        concurrency = atoi(optarg);
+        break;
       default:
         exit(1);
     }
@@ -121,60 +348,106 @@ int main(int argc, char **argv) {
     exit(EXIT_FAILURE);
   }
 
+  if (batch < 1) {
+    fprintf(stderr, "Invalid batch size\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (nsegments < 1 || (nsegments > 1 && batch > 1)) {
+    fprintf(stderr, "Invalid number of segments, segmented downloads can't be pipelined\n");
+    exit(EXIT_FAILURE);
+  }
+
   if (EXIT_SUCCESS != workload_init(workload_path)) {
     fprintf(stderr, "Unable to load workload file %s.\n", workload_path);
     exit(EXIT_FAILURE);
   }
 
+  if (concurrency < 0 || (concurrency > 0 && (batch > 1 || nsegments > 1))) {
+    fprintf(stderr, "Invalid concurrency, gfc_multi downloads can't be pipelined or segmented\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (concurrency > 0) {
+    gfc_global_init();
+    downloadMulti(server, port, nrequests, concurrency);
+    printConnectionStats();
+    gfc_global_cleanup();
+    workload_destroy();
+    return 0;
+  }
+
+  gfcrequest_t **gfrs = malloc(batch * sizeof(gfcrequest_t *));
+  FILE **files = malloc(batch * sizeof(FILE *));
+  char (*local_paths)[PATH_BUFFER_SIZE] = malloc(batch * PATH_BUFFER_SIZE);
+  if (gfrs == NULL || files == NULL || local_paths == NULL) {
+    perror("Unable to allocate the request batch");
+    exit(EXIT_FAILURE);
+  }
+
   gfc_global_init();
 
   /*Making the requests...*/
-  for (int i = 0; i < nrequests; i++) {
-    req_path = workload_get_path();
+  for (int i = 0; i < nrequests; i += batch) {
+    int count = nrequests - i < batch ? nrequests - i : batch;
 
-    if (strlen(req_path) > 256) {
-      fprintf(stderr, "Request path exceeded maximum of 256 characters\n.");
-      exit(EXIT_FAILURE);
-    }
+    for (int j = 0; j < count; j++) {
+      req_path = workload_get_path();
 
-    localPath(req_path, local_path);
+      if (strlen(req_path) > 256) {
+        fprintf(stderr, "Request path exceeded maximum of 256 characters\n.");
+        exit(EXIT_FAILURE);
+      }
 
-    file = openFile(local_path);
+      localPath(req_path, local_paths[j]);
 
-    gfr = gfc_create();
+      files[j] = openFile(local_paths[j]);
 
-    gfc_set_port(&gfr, port);
-    gfc_set_path(&gfr, req_path);
-    gfc_set_server(&gfr, server);
+      if (nsegments > 1) {
+        fprintf(stdout, "Requesting %s%s\n", server, req_path);
+        downloadSegmented(server, port, req_path, files[j], local_paths[j], nsegments);
+        continue;
+      }
 
+      gfrs[j] = gfc_create();
 
-    gfc_set_writefunc(&gfr, writecb);
-    gfc_set_writearg(&gfr, file);
+      gfc_set_port(&gfrs[j], port);
+      gfc_set_path(&gfrs[j], req_path);
+      gfc_set_server(&gfrs[j], server);
 
-    fprintf(stdout, "Requesting %s%s\n", server, req_path);
 
-    if (0 > (returncode = gfc_perform(&gfr))) {
-      fprintf(stdout, "gfc_perform returned error %d\n", returncode);
-      fclose(file);
-      if (0 > unlink(local_path))
-        fprintf(stderr, "warning: unlink failed on %s\n", local_path);
-    } else {
-      fclose(file);
-    }
+      gfc_set_writefunc(&gfrs[j], writecb);
+      gfc_set_writearg(&gfrs[j], files[j]);
 
-    if (gfc_get_status(&gfr) != GF_OK) {
-      if (0 > unlink(local_path))
-        fprintf(stderr, "warning: unlink failed on %s\n", local_path);
+      fprintf(stdout, "Requesting %s%s\n", server, req_path);
     }
 
+    if (nsegments > 1) {
+      continue;
+    }
 
-    fprintf(stdout, "Received:: %zu of %zu bytes\n", gfc_get_bytesreceived(&gfr),
-            gfc_get_filelen(&gfr));
-        fprintf(stdout, "Status: %s\n", gfc_strstatus(gfc_get_status(&gfr)));
+    if (batch == 1) {
+      finishRequest(&gfrs[0], files[0], local_paths[0], gfc_perform(&gfrs[0]));
+      continue;
+    }
 
-    gfc_cleanup(&gfr);
+    // Each request's status and byte count tell us how its own transfer went
+    gfc_perform_pipeline(gfrs, count);
+    for (int j = 0; j < count; j++) {
+      int returncode = 0;
+      if (gfc_get_status(&gfrs[j]) == GF_INVALID ||
+          gfc_get_bytesreceived(&gfrs[j]) < gfc_get_filelen(&gfrs[j])) {
+        returncode = -1;
+      }
+      finishRequest(&gfrs[j], files[j], local_paths[j], returncode);
+    }
   }
 
+  free(gfrs);
+  free(files);
+  free(local_paths);
+
+  printConnectionStats();
   gfc_global_cleanup();
 
   workload_destroy();  // clean up workload package
@@ -8,12 +8,99 @@
 #include "gfserver.h"
 #include <stdlib.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <netinet/tcp.h>
+
+/*
+ * The states a connection moves through inside the epoll event loop:
+ * accept -> reading the header -> handler -> sending -> closed.
+ * The handler runs inline once the header is complete, so it has no state of its own.
+ */
+typedef enum {
+    CONN_READING_HEADER,    // waiting for the full "\r\n\r\n" terminated request
+    CONN_SENDING,           // handler is done, flushing whatever the socket couldn't take yet
+    CONN_DRAINING           // last response sent, discarding pipelined requests until the client closes
+} gfconn_state_t;
+
+/*
+ * A FIFO of connections waiting on the same timeout, so the head always expires first.
+ */
+typedef struct {
+    gfcontext_t *head;
+    gfcontext_t *tail;
+} gfconn_list_t;
+
+/*
+ * A piece of a response. Memory segments carry the bytes themselves, file segments
+ * (data == NULL) send len bytes of fileFd starting at offset without copying them
+ * through user space.
+ */
+typedef struct gfout_seg_t {
+    char *data;                 // the bytes to send, NULL for file segments
+    size_t cap;                 // allocated size of data
+    int fileFd;                 // file to send from (file segments only)
+    off_t offset;               // next file offset to send (file segments only)
+    size_t len;                 // total number of bytes in this segment
+    size_t done;                // number of bytes already sent
+    int piped;                  // 1 once the splice fallback gave the segment its own pipe
+    int pipeFds[2];             // that pipe, holding file bytes the socket hasn't taken yet
+    size_t inPipe;              // how many bytes are in it
+    struct gfout_seg_t *next;   // next segment in the connection's queue
+} gfout_seg_t;
+
+#define RING_ENTRIES 1024 // submission queue size of an io_uring event loop
+#define RING_BUFFERS 64 // registered buffers per ring, one per connection streaming a file
+#define RING_BUFFER_SIZE (64 * 1024)
+
+/*
+ * An io_uring instance set up through the raw syscalls, with its shared rings mapped
+ * in and a set of registered buffers that file chunks are read into.
+ */
+typedef struct {
+    int fd;                         // the ring's file descriptor
+    void *ringMap;                  // submission and completion rings (one mapping)
+    size_t ringLen;
+    struct io_uring_sqe *sqes;      // submission queue entries
+    size_t sqesLen;
+    unsigned *sqHead;               // advanced by the kernel as it consumes entries
+    unsigned *sqTail;               // advanced by us when we publish entries
+    unsigned sqMask;
+    unsigned *sqArray;
+    unsigned sqEntries;
+    unsigned sqLocalTail;           // entries prepared but not published yet
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe *cqes;
+    char *buffers;                  // the registered buffers, back to back
+    int freeBuffers[RING_BUFFERS];  // indexes of the buffers nobody is using
+    int nfreeBuffers;
+    int multishotAccept;            // 0 once the kernel turned down multishot accept (before 5.19)
+    int acceptArmed;                // 1 while an accept is submitted and may still complete
+    unsigned long acceptRetryAt;    // after an accept failed, gf_now_ns() before which we don't retry
+} gfring_t;
 
 /*
  * This function creates a socket and binds to the first valid address in the addressList (linked list).
+ * With reusePort set the socket may share its port with the other acceptors' sockets.
  * The socket's file descriptor is retured if the operation succeeded.
  */
-int createAndBindSocket(struct addrinfo *adressesList);
+int createAndBindSocket(struct addrinfo *adressesList, int reusePort);
+
+/*
+ * This function starts listening on the bound socket and runs the epoll event loop
+ * that serves its connections. Does not return unless setting up the loop fails.
+ */
+void runEventLoop(gfserver_t *gfs);
 
 /*
  * This function creates and initilizes the gfcontext_t object
@@ -21,21 +108,158 @@ int createAndBindSocket(struct addrinfo *adressesList);
 gfcontext_t* context_create();
 
 /**
- * This function sanitizes the request and returns the valid status
+ * This function prints how often a new context came from the pool instead of the heap.
+ */
+void printPoolStats();
+
+/**
+ * This function sanitizes the parsed request and returns the valid status
+ */
+gfstatus_t validateRequest(const gf_header_parser_t *parser);
+
+/**
+ * This function puts the file descriptor into nonblocking mode
  */
-gfstatus_t validateRequest(const char *request);
+int setNonBlocking(int fd);
 
+/**
+ * This function accepts every pending connection on the listening socket and
+ * registers them with the server's epoll instance.
+ */
+void acceptConnections(gfserver_t *gfs);
+
+/**
+ * This function reads whatever part of the header is available without blocking.
+ * Once the entire header arrived the request is dispatched to the handler.
+ */
+void readHeader(gfserver_t *gfs, gfcontext_t *ctx);
+
+/**
+ * This function accounts for header bytes that just arrived.
+ */
+void headerBytesReceived(gfserver_t *gfs, gfcontext_t *ctx, size_t bytesRecv);
+
+/**
+ * This function moves a connection whose header is complete (or broken) on to the handler.
+ */
+void headerComplete(gfserver_t *gfs, gfcontext_t *ctx, gf_parse_result_t result);
+
+/**
+ * This function validates the received header and runs the handler on it.
+ */
+void dispatchRequest(gfserver_t *gfs, gfcontext_t *ctx);
+
+/**
+ * This function answers a request for the reserved stats path with the report.
+ */
+void sendStats(gfserver_t *gfs, gfcontext_t *ctx);
+
+/**
+ * This function either closes the connection or, if part of the response is
+ * still queued, waits for the socket to become writable again.
+ */
+void finishResponse(gfserver_t *gfs, gfcontext_t *ctx);
+
+/**
+ * This function resets a kept-alive connection for its next request. Bytes the
+ * client already pipelined after the previous header are kept.
+ */
+void startNextRequest(gfserver_t *gfs, gfcontext_t *ctx);
+
+/**
+ * This function closes a connection whose client may have pipelined requests we
+ * won't answer. Closing with unread data makes the kernel send a reset, which can
+ * destroy our last response before the client reads it, so we shut down our side
+ * and discard input until the client closes or the idle timeout passes.
+ */
+void lingerClose(gfserver_t *gfs, gfcontext_t *ctx);
+
+/**
+ * This function discards whatever a lingering connection received and closes it
+ * once the client has closed its side.
+ */
+void drainInput(gfserver_t *gfs, gfcontext_t *ctx);
+
+/**
+ * This function flushes the queued response once the socket is writable.
+ */
+void flushOutput(gfserver_t *gfs, gfcontext_t *ctx);
+
+/**
+ * This function drops the connection and frees its context.
+ */
+void closeConnection(gfserver_t *gfs, gfcontext_t *ctx);
+
+/**
+ * This function sends as much of the segment as the socket takes right now and queues
+ * the rest for the event loop. Outside of the event loop thread it blocks until
+ * everything has been sent.
+ */
+ssize_t sendSegmentOrQueue(gfcontext_t *ctx, gfout_seg_t *seg);
+
+/**
+ * This function sends the header gfs_sendheader held back, together with the first
+ * bytes of body when there is one, and queues whatever the socket doesn't take.
+ */
+int sendHeldHeader(gfcontext_t *ctx, gfout_seg_t *body);
+
+/**
+ * Same as sendSegmentOrQueue for a plain memory buffer.
+ */
+ssize_t sendOrQueue(gfcontext_t *ctx, const void *data, size_t len);
+
+/**
+ * This function writes the queued segments to the socket. Returns 1 once the queue
+ * is empty, 0 if the socket filled up first (nonblocking only) and -1 on error.
+ */
+int flushOutputQueue(gfcontext_t *ctx, int blocking);
+
+/**
+ * This function frees every queued segment without sending it.
+ */
+void freeOutput(gfcontext_t *ctx);
+
+/**
+ * This function returns how long epoll_wait may sleep before the oldest
+ * connection that is still reading its header times out.
+ */
+int nextTimeoutMs(gfserver_t *gfs);
+
+/**
+ * This function drops connections that didn't send their entire header in time
+ * and kept-alive connections that sat idle for too long.
+ */
+void expireConnections(gfserver_t *gfs);
+
+/**
+ * This function runs the event loop on io_uring instead of epoll. It only returns
+ * if the ring can't be set up, the caller then falls back to epoll.
+ */
+void runUringLoop(gfserver_t *gfs);
+
+/**
+ * This function is the io_uring counterpart of rearming the connection in epoll:
+ * it submits the recv, or the next piece of output, that the connection waits on.
+ */
+int uringArm(gfserver_t *gfs, gfcontext_t *ctx, uint32_t events);
+
+/**
+ * This function submits the next piece of the connection's queued output. Returns 1
+ * once everything has been sent, 0 if something was submitted (or the connection
+ * waits for a free buffer) and -1 on error.
+ */
+int uringSubmitOutput(gfserver_t *gfs, gfcontext_t *ctx);
 
 /**
- * This function extracts the path from the request
+ * Same as uringSubmitOutput, but closes the connection on error and finishes the
+ * response once everything has been sent.
  */
-const char* extractPath(const char* requestPath);
+void uringContinueOutput(gfserver_t *gfs, gfcontext_t *ctx);
 
 /**
- * This function receives the entire header even if the header is partitioned into
- * multiple network transactions. A timeout is applied to the recv function to 
- * avoid deadlocks.
+ * This function closes a connection of an io_uring loop. If the ring still has an
+ * operation in flight for it, the ctx is freed once that one completed.
  */
-size_t recvHeader(gfcontext_t *ctx);
+void uringClose(gfserver_t *gfs, gfcontext_t *ctx);
 
 #endif // __GF_SERVER_STUDENT_H__
\ No newline at end of file
@@ -1,11 +1,20 @@
+#define _GNU_SOURCE // for accept4()
+
 #include "gfserver-student.h"
 
-#define REQ_MAX_LEN 4113 // GETFILE GET <path>\r\n\r\n\0 = 7+1+3+1+4096+4+1 = 4113 bytes
+#define REQ_MAX_LEN 4171 // GETFILE GET <path> RANGE <offset> <length> KEEPALIVE\r\n\r\n\0 = 4123 + 1+5+1+20+1+20 bytes
 #define FILE_PATH_MAX_LEN 4096 // max length in a linux file system is 4096 bytes
 #define MAX_PORT_DIGITS 6
 #define GETFILE "GETFILE"
+#define KEEPALIVE "KEEPALIVE"
+#define RANGE "RANGE"
 #define TIMEOUT_SEC 5
 #define TIMEOUT_MILI 0
+#define MAX_EVENTS 256 // max number of ready connections we pick up per epoll_wait
+#define ACCEPT_RETRY_MS 100 // how long the io_uring loop waits before accepting again after an error
+#define HELD_HEADER_MAX 96 // GETFILE OK <20 digits> RANGE <20 digits> KEEPALIVE\r\n\r\n fits with room to spare
+#define OUTPUT_HIGH_WATER (4 * 1024 * 1024) // bytes of copied output a connection may queue before a send waits
+#define OUTPUT_STALL_SEC 5 // how long that send waits for the client to take anything before giving up
 
 // Modify this file to implement the interface specified in
  // gfserver.h.
@@ -17,6 +26,17 @@ struct gfserver_t {
     unsigned short port;    // port number the server is listening on
     int maxnpending;        // the max pending connections the server will queue up
     void *handlerarg;       // Argument for our handler function
+    int epollFd;            // epoll instance that drives every connection of this server
+    gfconn_list_t headerWait;   // connections in the middle of receiving a header, oldest first
+    gfconn_list_t idleWait;     // kept-alive connections waiting for their next request, oldest first
+    int keepAliveMax;           // max requests served on one connection, 0 disables keep-alive
+    int keepAliveIdleSec;       // how long a kept-alive connection may sit idle between requests
+    int coalesceHeader;         // 1 if OK headers wait for the first body bytes to go out with them
+    int nacceptors;             // number of event loops, each with its own SO_REUSEPORT listening socket
+    int useIoUring;             // 1 if the event loops should drive their sockets through io_uring
+    gfring_t *ring;             // this event loop's ring, NULL when it runs on epoll
+    gfconn_list_t bufferWait;   // connections waiting for one of the ring's registered buffers
+    const char *statsPath;      // requests for this path get the stats report, NULL disables it
 
     // Function ptr for the request handler described in gfserver.h
     gfh_error_t (*handler)(gfcontext_t **ctx, const char *path, void* arg);
@@ -30,8 +50,51 @@ struct gfcontext_t {
     size_t bytesRecvd;                      // This outlines the total number of bytes received 
     size_t bytesSent;                       // This outlines the number of bytes sent
     gfstatus_t responseCode;                // The response associated with the request
+    gf_header_parser_t parser;              // Picks up the header parsing where the last recv left off
+
+    gfconn_state_t state;                   // Where this connection is in the event loop's state machine
+    struct timespec deadline;               // When a connection still reading its header gets dropped
+    gfconn_list_t *waitList;                // The timeout list this connection is on, if any
+    gfcontext_t *prev;                      // Neighbours in that list
+    gfcontext_t *next;
+    int keepAlive;                          // 1 if the connection stays open after this response
+    int requestsServed;                     // Number of requests received on this connection so far
+    gfout_seg_t *outHead;                   // Response pieces the socket couldn't take yet, in order
+    gfout_seg_t *outTail;
+    int coalesceHeader;                     // Copied from the server when the request is dispatched
+    char heldHeader[HELD_HEADER_MAX];       // An OK header waiting to go out with the first body bytes
+    size_t heldHeaderLen;                   // 0 when no header is held back
+    unsigned long startTime;                // When the current request's header started, 0 if it hasn't yet
+    unsigned long sendStart;                // When the handler returned and the response started going out
+    int hasRange;                           // 1 if the client asked for part of the file only
+    size_t rangeOffset;                     // The part it asked for, a length of 0 means up to the end
+    size_t rangeLength;
+    size_t bodyStart;                       // The part of the handler's body that goes out, set by the OK header
+    size_t bodyEnd;
+    size_t bodyPos;                         // How far into its body the handler has sent
+
+    // io_uring event loop only
+    int inflight;                           // Submitted operations that haven't completed yet
+    int closing;                            // 1 once closed, the ctx is freed when inflight drops to 0
+    int ringError;                          // 1 if a file read in the current link failed
+    int bufIndex;                           // Registered buffer used to stream a file, -1 if none
+    size_t bufLen;                          // Bytes of the file read into that buffer
+    size_t bufOff;                          // Bytes of the buffer already written to the socket
 };
 
+// Set on the thread running gfserver_serve. Only that thread may queue output
+// on a connection, every other thread (e.g. a delegate that took ownership of
+// the ctx) falls back to blocking sends.
+static __thread int onEventLoop = 0;
+
+// Set on an event loop thread that runs on io_uring. Its sockets are driven by the
+// ring, so sends from the handler are only queued and submitted by the loop.
+static __thread gfring_t *loopRing = NULL;
+
+// Every accepted connection takes a context and gives it back when it closes,
+// so we recycle them instead of going through malloc for each one.
+static gf_pool_t contextPool = GF_POOL_INITIALIZER(gfcontext_t, 1024);
+
 void gfs_abort(gfcontext_t **ctx){
     if (ctx == NULL || *ctx == NULL) {
         return;
@@ -39,104 +102,132 @@ void gfs_abort(gfcontext_t **ctx){
 
     if ((*ctx) -> connFd != -1) {
         close((*ctx) -> connFd);
+        gf_stats_gauge_add(GF_GAUGE_CONNECTIONS, -1);
     }
 
-    free(*ctx);
+    freeOutput(*ctx);
+    gf_pool_put(&contextPool, *ctx);
     *ctx = NULL;
 }
 
-const char* extractPath(const char* requestPath) {
-    char *pathStart = strchr(requestPath, ' ');
-    if (pathStart != NULL) {
-        pathStart = strchr(pathStart+1, ' '); // point to the next space which should be after GET
-    }
-
-    // at this point, I'm pointing to the space before the path
-    // so I just need to copy the path characters up until I find '\r'
-    pathStart++;
-    
-    char *pathEnd = strchr(pathStart, '\r'); // we know that our path ends when we encounter '\r'
-    static char extractedPath[FILE_PATH_MAX_LEN];
-    size_t pathLength = pathEnd - pathStart;  // Calculate path length
-
-    if (pathLength >= REQ_MAX_LEN) {
-        return NULL;  // Path too long
-    }
-
-    strncpy(extractedPath, pathStart, pathLength);
-    extractedPath[pathLength] = '\0';  // Null-terminate the extracted path
-    return extractedPath;
-
+// A trailing KEEPALIVE is the last field of the request, after the optional range
+static int wantsKeepAlive(const gf_header_parser_t *parser) {
+    return (parser->nfields == 4 || parser->nfields == 7) &&
+           gf_view_equals(parser->fields[parser->nfields - 1], KEEPALIVE);
 }
 
-gfstatus_t validateRequest(const char *request) {
-    // If request is null then return invalid code
-    if (request == NULL) {
-        perror("Failed because request is NULL");
-        return GF_INVALID; // Verify that this error fits the requirements
-    }
-    
-    // Every request must have "GETFILE GET /", let's verify that
-    const char *prefix = "GETFILE GET /";
-    int prefixLen = strlen(prefix);
-    if (strncmp(request, prefix, prefixLen) != 0) {
-        perror("Doesn't start with 'GETFILE GET /'\n");
+gfstatus_t validateRequest(const gf_header_parser_t *parser) {
+    // Every request must be exactly "GETFILE GET /<path>[ RANGE <offset> <length>][ KEEPALIVE]\r\n\r\n".
+    // The parser already made sure there is nothing but single spaces between the fields.
+    int nfields = parser->nfields;
+    if (nfields != 3 && nfields != 4 && nfields != 6 && nfields != 7) {
+        fprintf(stderr, "number of fields is: '%d' but should be '3', '4', '6' or '7'\n", nfields);
         return GF_INVALID;
     }
 
-    if (strstr(request, "\r\n\r\n") == NULL){
-        perror("Didn't contain the delimiter suffix.\n");
+    if ((nfields == 4 || nfields == 7) && !wantsKeepAlive(parser)) {
+        fprintf(stderr, "the optional last field must be '%s'\n", KEEPALIVE);
         return GF_INVALID;
     }
 
-    // let's ensure that we only have 2 spaces in the request
-    const char *str = request;
-    int spaceCount = 0;
-    while((str = strchr(str, ' ')) != NULL) {
-        spaceCount++;
-        str++;
+    size_t offset, length;
+    if (nfields >= 6 && (!gf_view_equals(parser->fields[3], RANGE) ||
+                         gf_view_to_size(parser->fields[4], &offset) == -1 ||
+                         gf_view_to_size(parser->fields[5], &length) == -1)) {
+        fprintf(stderr, "a range must be '%s <offset> <length>'\n", RANGE);
+        return GF_INVALID;
     }
 
-    if (spaceCount != 2) {
-        fprintf(stderr, "number of spaces is: '%d' but should be '2'\n", spaceCount);
+    if (!gf_view_equals(parser->fields[0], GETFILE) || !gf_view_equals(parser->fields[1], "GET")) {
+        fprintf(stderr, "Doesn't start with 'GETFILE GET'\n");
         return GF_INVALID;
     }
 
     // let's verify that the path starts with '/' and doesn't exceed the length of the max
-    char *pathStart = strchr(request, ' ');
-    if (pathStart != NULL) {
-        pathStart = strchr(pathStart+1, ' '); // point to the next space which should be after GET
-    }
-
-    if (pathStart == NULL || *(pathStart + 1) != '/' || strlen(pathStart + 1) >= REQ_MAX_LEN) {
+    const gf_view_t *path = &parser->fields[2];
+    if (path->ptr[0] != '/' || path->len >= FILE_PATH_MAX_LEN) {
         return GF_INVALID;
     }
 
     return GF_OK;
 }
 
+// Handlers always send the whole file. For a range request we work out which part of
+// the next len bytes of their body the client asked for, and pretend to have sent the
+// rest. Returns how many bytes to skip, *take is how many to send after those.
+static size_t clipToRange(gfcontext_t *ctx, size_t len, size_t *take) {
+    size_t from = ctx->bodyPos > ctx->bodyStart ? ctx->bodyPos : ctx->bodyStart;
+    size_t to = ctx->bodyPos + len < ctx->bodyEnd ? ctx->bodyPos + len : ctx->bodyEnd;
+    size_t skip = from - ctx->bodyPos;
+    *take = to > from ? to - from : 0;
+    ctx->bodyPos += len;
+    return skip < len ? skip : len;
+}
+
 ssize_t gfs_send(gfcontext_t **ctx, const void *data, size_t len){
-    // not yet implemented
-    const char *ptr = (const char *)data;
-    ssize_t bytesSent, totalBytesSent = 0;
-    ssize_t bytesToSend = len;
-    while(bytesToSend > 0) {
-        bytesSent = send((*ctx)->connFd, ptr, bytesToSend, 0);
-        if (bytesSent == -1) {
-            perror("server: send");
-            return -1;
-        } else if(bytesSent == 0) {
-            perror("server: send failed because the client closed the connection.");
-            return -1;
-        }
+    if (ctx == NULL || *ctx == NULL) {
+        fprintf(stderr, "gfs_send: Invalid context\n");
+        return -1;
+    }
+
+    size_t take = len;
+    size_t skip = (*ctx)->hasRange ? clipToRange(*ctx, len, &take) : 0;
+    if (take == 0) {
+        return len;
+    }
 
-        bytesToSend -= bytesSent;
-        ptr += bytesSent;
-        totalBytesSent += bytesSent;
-        (*ctx)->bytesSent += bytesSent;
+    ssize_t totalBytesSent = sendOrQueue(*ctx, (const char *) data + skip, take);
+    if (totalBytesSent > 0) {
+        (*ctx)->bytesSent += totalBytesSent;
+        gf_stats_count(GF_STAT_BYTES_SENT, totalBytesSent);
     }
     
-    return totalBytesSent;
+    return totalBytesSent == -1 ? -1 : totalBytesSent + (ssize_t)(len - take);
+}
+
+ssize_t gfs_sendfile(gfcontext_t **ctx, int fd, off_t offset, size_t len){
+    if (ctx == NULL || *ctx == NULL) {
+        fprintf(stderr, "gfs_sendfile: Invalid context\n");
+        return -1;
+    }
+
+    // For a range we only hand the requested part of the file to the socket
+    size_t take = len;
+    size_t skip = (*ctx)->hasRange ? clipToRange(*ctx, len, &take) : 0;
+    if (take == 0) {
+        return len;
+    }
+
+    gfout_seg_t seg;
+    memset(&seg, 0, sizeof seg);
+    seg.fileFd = fd;
+    seg.offset = offset + skip;
+    seg.len = take;
+
+    ssize_t totalBytesSent = sendSegmentOrQueue(*ctx, &seg);
+    if (totalBytesSent > 0) {
+        (*ctx)->bytesSent += totalBytesSent;
+        gf_stats_count(GF_STAT_BYTES_SENT, totalBytesSent);
+    }
+
+    return totalBytesSent == -1 ? -1 : totalBytesSent + (ssize_t)(len - take);
+}
+
+// Returns GF_STAT_COUNT for anything that isn't a status we send a header for,
+// e.g. the byte count some handlers return instead of GF_OK
+static gf_counter_t statusCounter(gfstatus_t status) {
+    switch (status) {
+    case GF_OK:
+        return GF_STAT_OK;
+    case GF_FILE_NOT_FOUND:
+        return GF_STAT_FILE_NOT_FOUND;
+    case GF_INVALID:
+        return GF_STAT_INVALID;
+    case GF_ERROR:
+        return GF_STAT_ERROR;
+    default:
+        return GF_STAT_COUNT;
+    }
 }
 
 ssize_t gfs_sendheader(gfcontext_t **ctx, gfstatus_t status, size_t file_len){
@@ -144,46 +235,113 @@ ssize_t gfs_sendheader(gfcontext_t **ctx, gfstatus_t status, size_t file_len){
         fprintf(stderr, "gfs_sendheader: Invalid context\n");
         return -1;
     }
+    gf_counter_t counter = statusCounter(status);
+    if (counter != GF_STAT_COUNT) {
+        gf_stats_count(counter, 1);
+    }
 
     char header[REQ_MAX_LEN];
     memset(&header, 0, REQ_MAX_LEN);
 
+    // We only promise to keep the connection open when the event loop still owns it.
+    // A ctx a handler passed on to another thread gets closed once that thread is done.
+    if (status == GF_INVALID || !onEventLoop) {
+        (*ctx)->keepAlive = 0;
+    }
+    const char *keepAlive = (*ctx)->keepAlive ? " " KEEPALIVE : "";
+
+    // The body the client gets is the part of the file it asked for. The response to
+    // a range request also tells it how large the whole file is.
+    size_t bodyLen = file_len;
+    char range[32] = "";
+    if (status == GF_OK && (*ctx)->hasRange) {
+        size_t offset = (*ctx)->rangeOffset;
+        size_t length = (*ctx)->rangeLength;
+        (*ctx)->bodyStart = offset < file_len ? offset : file_len;
+        (*ctx)->bodyEnd = length == 0 || length > file_len - (*ctx)->bodyStart ? file_len : (*ctx)->bodyStart + length;
+        (*ctx)->bodyPos = 0;
+        bodyLen = (*ctx)->bodyEnd - (*ctx)->bodyStart;
+        snprintf(range, sizeof range, " %s %zu", RANGE, file_len);
+    }
+
+    // A body is coming, so hold the header back and send both with one syscall. Anything
+    // else sent on this ctx (including another header) pushes the held header out first.
+    if (status == GF_OK && bodyLen > 0 && (*ctx)->coalesceHeader &&
+        (*ctx)->heldHeaderLen == 0 && (*ctx)->outHead == NULL) {
+        int headerLen = snprintf((*ctx)->heldHeader, HELD_HEADER_MAX, "%s OK %zu%s%s\r\n\r\n",
+                                 GETFILE, bodyLen, range, keepAlive);
+        (*ctx)->heldHeaderLen = headerLen;
+        gf_stats_count(GF_STAT_BYTES_SENT, headerLen);
+        return headerLen;
+    }
+
     if (status == GF_OK) {
-        snprintf(header, sizeof(header), "%s OK %zu\r\n\r\n", GETFILE, file_len);
+        snprintf(header, sizeof(header), "%s OK %zu%s%s\r\n\r\n", GETFILE, bodyLen, range, keepAlive);
     } else if(status == GF_INVALID) {
         snprintf(header, sizeof(header), "%s INVALID\r\n\r\n", GETFILE);
     } else if(status == GF_ERROR) {
-        snprintf(header, sizeof(header), "%s ERROR\r\n\r\n", GETFILE);
+        snprintf(header, sizeof(header), "%s ERROR%s\r\n\r\n", GETFILE, keepAlive);
     } else if(status == GF_FILE_NOT_FOUND) {
-        snprintf(header, sizeof(header), "%s FILE_NOT_FOUND\r\n\r\n", GETFILE);
+        snprintf(header, sizeof(header), "%s FILE_NOT_FOUND%s\r\n\r\n", GETFILE, keepAlive);
     } 
     
     size_t headerLen = strlen(header);
     ssize_t bytesSent;
-    bytesSent = send((*ctx)->connFd, header, headerLen, 0);
+    bytesSent = sendOrQueue(*ctx, header, headerLen);
     if (bytesSent == -1){
         perror("server: send");
         gfs_abort(ctx);
-    } 
+    } else {
+        gf_stats_count(GF_STAT_BYTES_SENT, bytesSent);
+    }
     return bytesSent;
 }
 
 gfcontext_t* context_create(){
-    gfcontext_t* connectionConfig = malloc(sizeof(gfcontext_t));
+    gfcontext_t* connectionConfig = gf_pool_get(&contextPool);
     if (connectionConfig == NULL) {
         perror("context_create: failed to allocate memory for the struct");
         return NULL;
     }
 
-    memset(connectionConfig, 0, sizeof(gfcontext_t));
+    // A recycled context still holds the last connection's state. We reset every
+    // field instead of memset()ing the whole thing, most of it is the request buffer.
     connectionConfig -> connFd = -1; // to allow error detection during socket creation
+    connectionConfig -> request[0] = '\0';
     connectionConfig -> addrSize = sizeof(struct sockaddr_storage);
     connectionConfig -> bytesSent = 0;
     connectionConfig -> bytesRecvd = 0;
+    connectionConfig -> responseCode = GF_OK;
+    connectionConfig -> state = CONN_READING_HEADER;
+    connectionConfig -> waitList = NULL;
+    connectionConfig -> prev = NULL;
+    connectionConfig -> next = NULL;
+    connectionConfig -> keepAlive = 0;
+    connectionConfig -> requestsServed = 0;
+    connectionConfig -> outHead = NULL;
+    connectionConfig -> outTail = NULL;
+    connectionConfig -> coalesceHeader = 0;
+    connectionConfig -> heldHeaderLen = 0;
+    connectionConfig -> inflight = 0;
+    connectionConfig -> closing = 0;
+    connectionConfig -> ringError = 0;
+    connectionConfig -> bufIndex = -1;
+    connectionConfig -> bufLen = 0;
+    connectionConfig -> bufOff = 0;
+    connectionConfig -> startTime = 0;
+    connectionConfig -> sendStart = 0;
+    connectionConfig -> hasRange = 0;
+    gf_parser_init(&connectionConfig->parser);
     
     return connectionConfig;
 }
 
+void printPoolStats() {
+    unsigned long hits, misses;
+    gf_pool_stats(&contextPool, &hits, &misses);
+    fprintf(stderr, "server: context pool hits: %lu misses: %lu\n", hits, misses);
+}
+
 gfserver_t* gfserver_create(){
     gfserver_t *serverConfig = malloc(sizeof(gfserver_t));
     if (serverConfig == NULL) {
@@ -199,6 +357,17 @@ gfserver_t* gfserver_create(){
     serverConfig -> maxnpending = 0;
     serverConfig -> handlerarg = NULL;
     serverConfig -> handler = NULL;
+    serverConfig -> epollFd = -1;
+    serverConfig -> headerWait.head = serverConfig -> headerWait.tail = NULL;
+    serverConfig -> idleWait.head = serverConfig -> idleWait.tail = NULL;
+    serverConfig -> keepAliveMax = 0;
+    serverConfig -> keepAliveIdleSec = 0;
+    serverConfig -> coalesceHeader = 1;
+    serverConfig -> nacceptors = 1;
+    serverConfig -> useIoUring = 0;
+    serverConfig -> ring = NULL;
+    serverConfig -> bufferWait.head = serverConfig -> bufferWait.tail = NULL;
+    serverConfig -> statsPath = NULL;
     
     return serverConfig;
 }
@@ -219,6 +388,12 @@ void gfserver_set_port(gfserver_t **gfs, unsigned short port){
     (*gfs)->port = port;
 }
 
+// Entry point of the extra acceptor threads, each one owns a copy of the server
+static void *acceptorThread(void *arg) {
+    runEventLoop(arg);
+    return NULL;
+}
+
 void gfserver_serve(gfserver_t **gfs){
     struct addrinfo addrConfig;
     memset(&addrConfig, 0, sizeof addrConfig);
@@ -239,79 +414,126 @@ void gfserver_serve(gfserver_t **gfs){
         return;
     }
 
-    // Set and bind our server's file descriptor
-    (*gfs) -> sockfd = createAndBindSocket(addressesList);
-    // Once we're done with adressesList let's free up the linked list
-    freeaddrinfo(addressesList);
+    // With more than one acceptor every event loop binds its own socket to the same port
+    // and the kernel spreads incoming connections across them
+    int reusePort = (*gfs)->nacceptors > 1;
 
+    // Set and bind our server's file descriptor
+    (*gfs) -> sockfd = createAndBindSocket(addressesList, reusePort);
     if ((*gfs)->sockfd == -1) {
         perror("server: createAndBindSocket");
+        freeaddrinfo(addressesList);
         return;
     }
 
+    for (int i = 1; i < (*gfs)->nacceptors; i++) {
+        // The copy shares the configuration and gets its own socket, epoll instance
+        // and timeout lists. Handlers may now run on several threads at once.
+        gfserver_t *acceptor = malloc(sizeof(gfserver_t));
+        if (acceptor == NULL) {
+            perror("server: failed to allocate an acceptor");
+            break;
+        }
+        memcpy(acceptor, *gfs, sizeof(gfserver_t));
+        acceptor->epollFd = -1;
+        acceptor->headerWait.head = acceptor->headerWait.tail = NULL;
+        acceptor->idleWait.head = acceptor->idleWait.tail = NULL;
+        acceptor->bufferWait.head = acceptor->bufferWait.tail = NULL;
+
+        acceptor->sockfd = createAndBindSocket(addressesList, reusePort);
+        if (acceptor->sockfd == -1) {
+            perror("server: createAndBindSocket");
+            free(acceptor);
+            break;
+        }
+
+        pthread_t thread;
+        int err = pthread_create(&thread, NULL, acceptorThread, acceptor);
+        if (err != 0) {
+            fprintf(stderr, "server: pthread_create: %s\n", strerror(err));
+            close(acceptor->sockfd);
+            free(acceptor);
+            break;
+        }
+        pthread_detach(thread);
+    }
+
+    // Once we're done with adressesList let's free up the linked list
+    freeaddrinfo(addressesList);
+
+    runEventLoop(*gfs);
+}
+
+void runEventLoop(gfserver_t *gfs) {
     int err = 0;
-    err = listen((*gfs) -> sockfd, (*gfs) -> maxnpending);
+    err = listen(gfs -> sockfd, gfs -> maxnpending);
     if (err == -1) {
         perror("server: listen");
-        close((*gfs) -> sockfd);
+        close(gfs -> sockfd);
         return;
     }
 
-    for (;;) {
-        gfcontext_t *ctx = context_create();
-        ctx->connFd = accept((*gfs)->sockfd, (struct sockaddr *)&(ctx->connAddress), &(ctx->addrSize));
-        if (ctx->connFd == -1) {
-            perror("server: accept");
-            gfs_sendheader(&ctx, GF_ERROR, 0);
-            gfs_abort(&ctx);
-            continue;
-        }
-
-        // Resource on how to create a timeout for recv during client connection: https://linux.die.net/man/3/setsockopt
-        // Resource for defining the timeval struct: https://linux.die.net/man/3/timercmp
-        struct timeval timeout;
-        timeout.tv_sec = TIMEOUT_SEC; 
-        timeout.tv_usec = TIMEOUT_MILI;
+    // The listening socket is nonblocking so that we can drain the accept
+    // backlog in one go without ever parking the event loop in accept()
+    if (setNonBlocking(gfs->sockfd) == -1) {
+        perror("server: setNonBlocking");
+        close(gfs -> sockfd);
+        return;
+    }
 
-        // Let's set the socket option so that it timeouts after X seconds to avoid hanging connections
-        if (setsockopt(ctx->connFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
-            perror("server: setsockopt (SO_RCVTIMEO) failed");
-            gfs_sendheader(&ctx, GF_ERROR, 0);
-            gfs_abort(&ctx);
-            continue;
-        }
+    if (gfs->useIoUring) {
+        runUringLoop(gfs);
+        // Only returns if this kernel can't give us a ring
+        fprintf(stderr, "server: io_uring unavailable, falling back to epoll\n");
+    }
 
-        size_t bytesRecv;        
-        bytesRecv = recvHeader(ctx);
-        if (bytesRecv <= 0) {
-            perror("server: recvHeader");
-            gfs_sendheader(&ctx, GF_INVALID, 0);
-            gfs_abort(&ctx);
-            continue;
-        }
+    gfs->epollFd = epoll_create1(0);
+    if (gfs->epollFd == -1) {
+        perror("server: epoll_create1");
+        close(gfs -> sockfd);
+        return;
+    }
 
-        if (bytesRecv < REQ_MAX_LEN) {
-            ctx->request[bytesRecv] = '\0';
-        } else {
-            ctx->request[REQ_MAX_LEN-1] = '\0';
-        }
+    // The listening socket is the only registration with a NULL data pointer
+    struct epoll_event listenEvent;
+    memset(&listenEvent, 0, sizeof listenEvent);
+    listenEvent.events = EPOLLIN;
+    listenEvent.data.ptr = NULL;
+    if (epoll_ctl(gfs->epollFd, EPOLL_CTL_ADD, gfs->sockfd, &listenEvent) == -1) {
+        perror("server: epoll_ctl (listen socket)");
+        close(gfs->epollFd);
+        close(gfs -> sockfd);
+        return;
+    }
 
-        gfstatus_t valid = validateRequest(ctx->request);
-        if (valid != GF_OK) {
-            gfs_sendheader(&ctx, valid, 0);
-            gfs_abort(&ctx);
+    onEventLoop = 1;
+    struct epoll_event events[MAX_EVENTS];
+    for (;;) {
+        int nready = epoll_wait(gfs->epollFd, events, MAX_EVENTS, nextTimeoutMs(gfs));
+        if (nready == -1) {
+            if (errno != EINTR) {
+                perror("server: epoll_wait");
+            }
             continue;
         }
 
-        const char* extractedPath = extractPath(ctx->request);
-        
-        gfh_error_t status = (*gfs)->handler(&ctx, extractedPath, (*gfs) -> handlerarg);
-        if (status != GF_OK){
-            gfs_sendheader(&ctx, status, 0);
+        for (int i = 0; i < nready; i++) {
+            gfcontext_t *ctx = events[i].data.ptr;
+            if (ctx == NULL) {
+                acceptConnections(gfs);
+            } else if (ctx->state == CONN_READING_HEADER) {
+                readHeader(gfs, ctx);
+            } else if (ctx->state == CONN_DRAINING) {
+                drainInput(gfs, ctx);
+            } else if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                closeConnection(gfs, ctx);
+            } else {
+                flushOutput(gfs, ctx);
+            }
         }
-        gfs_abort(&ctx);
+
+        expireConnections(gfs);
     }
-    
 }
 
 void gfserver_set_handlerarg(gfserver_t **gfs, void* arg){
@@ -322,6 +544,47 @@ void gfserver_set_handlerarg(gfserver_t **gfs, void* arg){
     (*gfs)->handlerarg = arg;
 }
 
+void gfserver_set_keepalive(gfserver_t **gfs, int max_requests, int idle_timeout_sec){
+    if(gfs == NULL || *gfs == NULL) {
+        perror("gfserver_set_keepalive: gfserver_t pointer is NULL");
+        return;
+    }
+    (*gfs)->keepAliveMax = max_requests > 1 ? max_requests : 0;
+    (*gfs)->keepAliveIdleSec = idle_timeout_sec > 0 ? idle_timeout_sec : TIMEOUT_SEC;
+}
+
+void gfserver_set_coalesce(gfserver_t **gfs, int enable){
+    if(gfs == NULL || *gfs == NULL) {
+        perror("gfserver_set_coalesce: gfserver_t pointer is NULL");
+        return;
+    }
+    (*gfs)->coalesceHeader = enable != 0;
+}
+
+void gfserver_set_acceptors(gfserver_t **gfs, int nacceptors){
+    if(gfs == NULL || *gfs == NULL) {
+        perror("gfserver_set_acceptors: gfserver_t pointer is NULL");
+        return;
+    }
+    (*gfs)->nacceptors = nacceptors > 1 ? nacceptors : 1;
+}
+
+void gfserver_set_io_uring(gfserver_t **gfs, int enable){
+    if(gfs == NULL || *gfs == NULL) {
+        perror("gfserver_set_io_uring: gfserver_t pointer is NULL");
+        return;
+    }
+    (*gfs)->useIoUring = enable != 0;
+}
+
+void gfserver_set_stats_path(gfserver_t **gfs, const char *path){
+    if(gfs == NULL || *gfs == NULL) {
+        perror("gfserver_set_stats_path: gfserver_t pointer is NULL");
+        return;
+    }
+    (*gfs)->statsPath = path;
+}
+
 void gfserver_set_maxpending(gfserver_t **gfs, int max_npending){
     if(gfs == NULL || *gfs == NULL) {
         perror("gfserver_set_port: gfserver_t pointer is NULL");
@@ -333,7 +596,7 @@ void gfserver_set_maxpending(gfserver_t **gfs, int max_npending){
 
 // This function creates a socket and binds to the first valid address in the addressList (linked list).
 // The socket's file descriptor is retured if the operation succeeded.
-int createAndBindSocket(struct addrinfo *adressesList) {
+int createAndBindSocket(struct addrinfo *adressesList, int reusePort) {
     int sockfd = -1;
     struct addrinfo *curr;
     int yes = 1;
@@ -354,6 +617,12 @@ int createAndBindSocket(struct addrinfo *adressesList) {
             close(sockfd);
             return -1; // No point in continuing if for some reason we can't reuse the port since subsequent code will fail
         }
+
+        if (reusePort && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+            perror("server: setsockopt (SO_REUSEPORT)");
+            close(sockfd);
+            return -1;
+        }
         
         err = bind(sockfd, curr->ai_addr, curr->ai_addrlen);
         if (err == -1) {
@@ -374,43 +643,1296 @@ int createAndBindSocket(struct addrinfo *adressesList) {
     return sockfd;
 }
 
-size_t recvHeader(gfcontext_t *ctx) {
+int setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
 
-    char headerBuf[REQ_MAX_LEN];
-    memset(&headerBuf, 0, sizeof headerBuf);
+// Fallback for descriptors sendfile() refuses: move the bytes through a pipe with
+// splice() so they still never enter user space. Each segment gets its own pipe,
+// so when the socket fills up the bytes already taken from the file wait there
+// and the segment can be queued like any other. One attempt, like send().
+static ssize_t spliceFile(int sockFd, gfout_seg_t *seg) {
+    if (!seg->piped) {
+        if (pipe2(seg->pipeFds, O_CLOEXEC | O_NONBLOCK) == -1) {
+            perror("server: pipe2");
+            return -1;
+        }
+        seg->piped = 1;
+    }
 
-    size_t bytesRecv;
-    for(;;) {
+    if (seg->inPipe == 0) {
+        size_t unread = seg->len - seg->done;
+        ssize_t n = splice(seg->fileFd, &seg->offset, seg->pipeFds[1], NULL, unread, SPLICE_F_MOVE);
+        if (n <= 0) {
+            return n;
+        }
+        seg->inPipe = n;
+    }
 
-        bytesRecv = recv(ctx->connFd, headerBuf, REQ_MAX_LEN, 0);
+    ssize_t n = splice(seg->pipeFds[0], NULL, sockFd, NULL, seg->inPipe,
+                       SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+    if (n > 0) {
+        seg->inPipe -= n;
+    }
+    return n;
+}
 
-        if (bytesRecv == 0) {
-            // If we get 0 then that means the connection was terminated by the client.
-            perror("server: client disconnected prematurely");
-            ctx->responseCode = GF_INVALID;
-            return -1;
-        } else if (bytesRecv == -1) {
-            if (errno == EWOULDBLOCK) {
-                perror("server: recv timed out while waiting for entire header");
-            } else {
-                perror("server: recv");
+static void closeSplicePipe(gfout_seg_t *seg) {
+    if (seg->piped) {
+        close(seg->pipeFds[0]);
+        close(seg->pipeFds[1]);
+        seg->piped = 0;
+        seg->inPipe = 0;
+    }
+}
+
+// Makes one attempt at pushing the rest of the segment into the socket.
+// Returns the number of bytes sent, or -1 with errno set.
+static ssize_t writeSegment(int sockFd, gfout_seg_t *seg) {
+    size_t remaining = seg->len - seg->done;
+    if (seg->data != NULL) {
+        return send(sockFd, seg->data + seg->done, remaining, MSG_NOSIGNAL);
+    }
+
+    // Once we fell back to splice the pipe holds bytes that have to go first
+    ssize_t n;
+    if (seg->piped) {
+        n = spliceFile(sockFd, seg);
+    } else {
+        n = sendfile(sockFd, seg->fileFd, &seg->offset, remaining);
+        if (n == -1 && (errno == EINVAL || errno == ENOSYS)) {
+            n = spliceFile(sockFd, seg);
+        }
+    }
+    if (n == 0) {
+        fprintf(stderr, "server: file ended %zu bytes before the expected length\n", remaining);
+        errno = EIO;
+        return -1;
+    }
+    return n;
+}
+
+// Pushes the segment into the socket. When blocking, waits for the socket to drain
+// whenever it's full. Returns 1 once the segment is done, 0 if the socket is full
+// (nonblocking only) and -1 on error.
+static int drainSegment(int sockFd, gfout_seg_t *seg, int blocking) {
+    while (seg->done < seg->len) {
+        ssize_t n = writeSegment(sockFd, seg);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (!blocking) {
+                    return 0;
+                }
+                struct pollfd pfd = { .fd = sockFd, .events = POLLOUT };
+                if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+                    perror("server: poll");
+                    return -1;
+                }
+                continue;
             }
-            ctx->responseCode = GF_INVALID;
+            perror("server: send");
             return -1;
         }
+        seg->done += n;
+    }
+    return 1;
+}
+
+static void freeSegment(gfout_seg_t *seg) {
+    if (seg->data != NULL) {
+        free(seg->data);
+    } else {
+        close(seg->fileFd);
+        closeSplicePipe(seg);
+    }
+    free(seg);
+}
+
+void freeOutput(gfcontext_t *ctx) {
+    while (ctx->outHead != NULL) {
+        gfout_seg_t *next = ctx->outHead->next;
+        freeSegment(ctx->outHead);
+        ctx->outHead = next;
+    }
+    ctx->outTail = NULL;
+}
+
+int flushOutputQueue(gfcontext_t *ctx, int blocking) {
+    while (ctx->outHead != NULL) {
+        int done = drainSegment(ctx->connFd, ctx->outHead, blocking);
+        if (done != 1) {
+            return done;
+        }
+        gfout_seg_t *next = ctx->outHead->next;
+        freeSegment(ctx->outHead);
+        ctx->outHead = next;
+    }
+    ctx->outTail = NULL;
+    return 1;
+}
+
+// Copies what's left of the segment to the end of the queue. Memory is appended to the
+// last memory segment when possible, a file segment keeps its own dup() of the descriptor
+// since the handler is free to close its copy as soon as we return, and takes over the
+// segment's splice pipe.
+static int queueSegment(gfcontext_t *ctx, gfout_seg_t *seg) {
+    size_t remaining = seg->len - seg->done;
+    gfout_seg_t *tail = ctx->outTail;
+
+    if (seg->data != NULL && tail != NULL && tail->data != NULL) {
+        if (tail->len + remaining > tail->cap) {
+            size_t newCap = tail->cap;
+            while (newCap < tail->len + remaining) {
+                newCap *= 2;
+            }
+            char *newData = realloc(tail->data, newCap);
+            if (newData == NULL) {
+                perror("server: failed to grow the output buffer");
+                return -1;
+            }
+            tail->data = newData;
+            tail->cap = newCap;
+        }
+        memcpy(tail->data + tail->len, seg->data + seg->done, remaining);
+        tail->len += remaining;
+        return 0;
+    }
+
+    gfout_seg_t *queued = calloc(1, sizeof(gfout_seg_t));
+    if (queued == NULL) {
+        perror("server: failed to allocate an output segment");
+        return -1;
+    }
 
-        if (ctx->bytesRecvd + bytesRecv >= REQ_MAX_LEN-1) {
-            perror("server: client sent a larger header than expected");
+    if (seg->data != NULL) {
+        queued->cap = remaining > BUFSIZ ? remaining : BUFSIZ;
+        queued->data = malloc(queued->cap);
+        if (queued->data == NULL) {
+            perror("server: failed to allocate the output buffer");
+            free(queued);
+            return -1;
+        }
+        memcpy(queued->data, seg->data + seg->done, remaining);
+    } else {
+        queued->fileFd = dup(seg->fileFd);
+        if (queued->fileFd == -1) {
+            perror("server: dup");
+            free(queued);
             return -1;
         }
+        queued->offset = seg->offset;
+        queued->piped = seg->piped;
+        queued->pipeFds[0] = seg->pipeFds[0];
+        queued->pipeFds[1] = seg->pipeFds[1];
+        queued->inPipe = seg->inPipe;
+        seg->piped = 0;
+        seg->inPipe = 0;
+    }
+    queued->len = remaining;
+
+    if (tail != NULL) {
+        tail->next = queued;
+    } else {
+        ctx->outHead = queued;
+    }
+    ctx->outTail = queued;
+    return 0;
+}
+
+// Bytes of handler memory the queue holds, file segments only hold a descriptor
+static size_t queuedBytes(const gfcontext_t *ctx) {
+    size_t total = 0;
+    for (const gfout_seg_t *seg = ctx->outHead; seg != NULL; seg = seg->next) {
+        if (seg->data != NULL) {
+            total += seg->len - seg->done;
+        }
+    }
+    return total;
+}
 
-        strncat(ctx->request, headerBuf, bytesRecv);
-        ctx->bytesRecvd += bytesRecv;
+// An inline handler sends the whole response before the loop gets back to the socket,
+// so everything a slow client doesn't take piles up in the queue. Past the high-water
+// mark the send waits here until the client took half of it. A client that takes
+// nothing for OUTPUT_STALL_SEC gets its connection shut down and the send fails.
+static int throttleOutput(gfcontext_t *ctx) {
+    if (queuedBytes(ctx) <= OUTPUT_HIGH_WATER) {
+        return 0;
+    }
+
+    // Ring sockets are blocking, a stalled client must not keep us in send() for good
+    int flags = 0;
+    if (loopRing != NULL) {
+        flags = fcntl(ctx->connFd, F_GETFL);
+        if (flags == -1 || fcntl(ctx->connFd, F_SETFL, flags | O_NONBLOCK) == -1) {
+            perror("server: fcntl");
+            return -1;
+        }
+    }
 
-        if(strstr(ctx->request, "\r\n\r\n") != NULL) {
+    int result = 0;
+    while (queuedBytes(ctx) > OUTPUT_HIGH_WATER / 2) {
+        if (flushOutputQueue(ctx, 0) == -1) {
+            result = -1;
+            break;
+        }
+        if (queuedBytes(ctx) <= OUTPUT_HIGH_WATER / 2) {
+            break;
+        }
+        struct pollfd pfd = { .fd = ctx->connFd, .events = POLLOUT };
+        int ready = poll(&pfd, 1, OUTPUT_STALL_SEC * 1000);
+        if (ready == 0) {
+            fprintf(stderr, "server: client took no output for %d seconds, dropping it\n", OUTPUT_STALL_SEC);
+            result = -1;
+            break;
+        }
+        if (ready == -1 && errno != EINTR) {
+            perror("server: poll");
+            result = -1;
             break;
         }
     }
-        
-    return ctx->bytesRecvd;
-}
\ No newline at end of file
+
+    if (loopRing != NULL) {
+        fcntl(ctx->connFd, F_SETFL, flags);
+    }
+    if (result == -1) {
+        // The response can't be finished, so don't let the client take it for a whole one
+        freeOutput(ctx);
+        shutdown(ctx->connFd, SHUT_RDWR);
+    }
+    return result;
+}
+
+// Makes one attempt at sending the header together with the start of the body. Memory
+// goes out in a single writev(). For a file the header is sent with MSG_MORE so the
+// kernel holds it until sendfile() fills the rest of the segment.
+static ssize_t writeCoalesced(int sockFd, gfout_seg_t *header, gfout_seg_t *body) {
+    if (body->data == NULL) {
+        ssize_t n = send(sockFd, header->data, header->len, MSG_NOSIGNAL | MSG_MORE);
+        if (n > 0) {
+            header->done += n;
+        }
+        return n;
+    }
+
+    struct iovec iov[2];
+    iov[0].iov_base = header->data;
+    iov[0].iov_len = header->len;
+    iov[1].iov_base = body->data + body->done;
+    iov[1].iov_len = body->len - body->done;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    ssize_t n = sendmsg(sockFd, &msg, MSG_NOSIGNAL);
+    if (n > 0) {
+        size_t headerPart = (size_t) n < header->len ? (size_t) n : header->len;
+        header->done += headerPart;
+        body->done += n - headerPart;
+    }
+    return n;
+}
+
+int sendHeldHeader(gfcontext_t *ctx, gfout_seg_t *body) {
+    gfout_seg_t header;
+    memset(&header, 0, sizeof header);
+    header.data = ctx->heldHeader;
+    header.len = ctx->heldHeaderLen;
+    ctx->heldHeaderLen = 0;
+
+    // Bytes already queued have to go first, so then the header just queues behind them.
+    // On a ring loop everything is queued anyway and header and body end up in one send.
+    if (body != NULL && ctx->outHead == NULL && loopRing == NULL) {
+        ssize_t n;
+        do {
+            n = writeCoalesced(ctx->connFd, &header, body);
+        } while (n == -1 && errno == EINTR);
+        if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("server: send");
+            return -1;
+        }
+    }
+
+    // Whatever part of the header didn't make it takes the usual path, ahead of the body
+    if (header.done < header.len && sendSegmentOrQueue(ctx, &header) == -1) {
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t sendSegmentOrQueue(gfcontext_t *ctx, gfout_seg_t *seg) {
+    if (ctx->heldHeaderLen > 0 && sendHeldHeader(ctx, seg) == -1) {
+        return -1;
+    }
+
+    if (!onEventLoop) {
+        // A delegate may own this ctx now; flush anything the loop queued first
+        // so the bytes still reach the client in order.
+        int done = flushOutputQueue(ctx, 1) != -1 && drainSegment(ctx->connFd, seg, 1) != -1;
+        closeSplicePipe(seg);
+        return done ? (ssize_t) seg->len : -1;
+    }
+
+    // The ring loop submits the queue itself once the handler returns
+    if (loopRing != NULL) {
+        if (queueSegment(ctx, seg) == -1 || throttleOutput(ctx) == -1) {
+            return -1;
+        }
+        return seg->len;
+    }
+
+    // Never jump ahead of bytes that are already waiting in the queue
+    if (ctx->outHead == NULL && drainSegment(ctx->connFd, seg, 0) == -1) {
+        closeSplicePipe(seg);
+        return -1;
+    }
+
+    // Whatever the socket couldn't take now gets flushed once it reports EPOLLOUT
+    if (seg->done < seg->len && queueSegment(ctx, seg) == -1) {
+        closeSplicePipe(seg);
+        return -1;
+    }
+    closeSplicePipe(seg); // nothing left in it once the segment is done
+    return throttleOutput(ctx) == -1 ? -1 : (ssize_t) seg->len;
+}
+
+ssize_t sendOrQueue(gfcontext_t *ctx, const void *data, size_t len) {
+    gfout_seg_t seg;
+    memset(&seg, 0, sizeof seg);
+    seg.data = (char *)data;
+    seg.len = len;
+    return sendSegmentOrQueue(ctx, &seg);
+}
+
+static void waitListRemove(gfcontext_t *ctx) {
+    gfconn_list_t *list = ctx->waitList;
+    if (list == NULL) {
+        return;
+    }
+    if (ctx->prev != NULL) {
+        ctx->prev->next = ctx->next;
+    } else {
+        list->head = ctx->next;
+    }
+    if (ctx->next != NULL) {
+        ctx->next->prev = ctx->prev;
+    } else {
+        list->tail = ctx->prev;
+    }
+    ctx->prev = ctx->next = NULL;
+    ctx->waitList = NULL;
+}
+
+// Every connection on a list gets the same timeout, so appending keeps the list sorted by deadline
+static void waitListAppend(gfconn_list_t *list, gfcontext_t *ctx, int timeoutSec) {
+    clock_gettime(CLOCK_MONOTONIC, &ctx->deadline);
+    ctx->deadline.tv_sec += timeoutSec;
+    ctx->deadline.tv_nsec += TIMEOUT_MILI * 1000000L;
+    if (ctx->deadline.tv_nsec >= 1000000000L) {
+        ctx->deadline.tv_sec += 1;
+        ctx->deadline.tv_nsec -= 1000000000L;
+    }
+
+    ctx->waitList = list;
+    ctx->next = NULL;
+    ctx->prev = list->tail;
+    if (list->tail != NULL) {
+        list->tail->next = ctx;
+    } else {
+        list->head = ctx;
+    }
+    list->tail = ctx;
+}
+
+void closeConnection(gfserver_t *gfs, gfcontext_t *ctx) {
+    waitListRemove(ctx);
+    if (gfs->ring != NULL) {
+        uringClose(gfs, ctx); // the ring may still be using the ctx
+        return;
+    }
+    // closing the fd also drops it from the epoll interest list
+    gfs_abort(&ctx);
+}
+
+void acceptConnections(gfserver_t *gfs) {
+    for (;;) {
+        gfcontext_t *ctx = context_create();
+        if (ctx == NULL) {
+            return;
+        }
+
+        ctx->connFd = accept4(gfs->sockfd, (struct sockaddr *)&(ctx->connAddress), &(ctx->addrSize), SOCK_NONBLOCK);
+        if (ctx->connFd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("server: accept");
+            }
+            gfs_abort(&ctx);
+            return;
+        }
+        ctx->startTime = gf_now_ns();
+        gf_stats_gauge_add(GF_GAUGE_CONNECTIONS, 1);
+
+        struct epoll_event event;
+        memset(&event, 0, sizeof event);
+        event.events = EPOLLIN | EPOLLONESHOT;
+        event.data.ptr = ctx;
+        if (epoll_ctl(gfs->epollFd, EPOLL_CTL_ADD, ctx->connFd, &event) == -1) {
+            perror("server: epoll_ctl (accept)");
+            gfs_abort(&ctx);
+            continue;
+        }
+
+        waitListAppend(&gfs->headerWait, ctx, TIMEOUT_SEC);
+    }
+}
+
+static int rearm(gfserver_t *gfs, gfcontext_t *ctx, uint32_t events) {
+    if (gfs->ring != NULL) {
+        return uringArm(gfs, ctx, events);
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof event);
+    event.events = events | EPOLLONESHOT;
+    event.data.ptr = ctx;
+    return epoll_ctl(gfs->epollFd, EPOLL_CTL_MOD, ctx->connFd, &event);
+}
+
+static size_t headerRoom(const gfcontext_t *ctx) {
+    return REQ_MAX_LEN - 1 - ctx->bytesRecvd;
+}
+
+void headerBytesReceived(gfserver_t *gfs, gfcontext_t *ctx, size_t bytesRecv) {
+    // An idle kept-alive connection started a new request, from now on it gets
+    // the same time to finish its header as a fresh connection
+    if (ctx->waitList == &gfs->idleWait) {
+        waitListRemove(ctx);
+        waitListAppend(&gfs->headerWait, ctx, TIMEOUT_SEC);
+    }
+    if (ctx->startTime == 0) {
+        ctx->startTime = gf_now_ns();
+    }
+
+    ctx->bytesRecvd += bytesRecv;
+}
+
+void readHeader(gfserver_t *gfs, gfcontext_t *ctx) {
+    // A pipelining client may have sent this header along with the previous one
+    gf_parse_result_t result = gf_parser_feed(&ctx->parser, ctx->request, ctx->bytesRecvd);
+
+    while (result == GF_PARSE_INCOMPLETE) {
+        size_t room = headerRoom(ctx);
+        if (room == 0) {
+            fprintf(stderr, "server: client sent a larger header than expected\n");
+            result = GF_PARSE_ERROR;
+            break;
+        }
+
+        ssize_t bytesRecv = recv(ctx->connFd, ctx->request + ctx->bytesRecvd, room, 0);
+        if (bytesRecv == 0) {
+            // If we get 0 then that means the connection was terminated by the client.
+            closeConnection(gfs, ctx);
+            return;
+        } else if (bytesRecv == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // wait for the rest of the header
+                if (rearm(gfs, ctx, EPOLLIN) == -1) {
+                    perror("server: epoll_ctl (rearm)");
+                    closeConnection(gfs, ctx);
+                }
+                return;
+            }
+            perror("server: recv");
+            closeConnection(gfs, ctx);
+            return;
+        }
+
+        headerBytesReceived(gfs, ctx, bytesRecv);
+        result = gf_parser_feed(&ctx->parser, ctx->request, ctx->bytesRecvd);
+    }
+
+    headerComplete(gfs, ctx, result);
+}
+
+void headerComplete(gfserver_t *gfs, gfcontext_t *ctx, gf_parse_result_t result) {
+    waitListRemove(ctx);
+    ctx->state = CONN_SENDING;
+    ctx->sendStart = gf_now_ns();
+    gf_stats_record(GF_PHASE_HEADER, ctx->sendStart - ctx->startTime);
+    if (result == GF_PARSE_ERROR) {
+        // No need to wait for the rest, it can't turn into a valid request anymore
+        ctx->keepAlive = 0;
+        gfs_sendheader(&ctx, GF_INVALID, 0);
+        finishResponse(gfs, ctx);
+        return;
+    }
+    dispatchRequest(gfs, ctx);
+}
+
+void dispatchRequest(gfserver_t *gfs, gfcontext_t *ctx) {
+    ctx->requestsServed++;
+    ctx->keepAlive = 0;
+
+    gfstatus_t valid = validateRequest(&ctx->parser);
+    if (valid != GF_OK) {
+        gfs_sendheader(&ctx, valid, 0);
+        finishResponse(gfs, ctx);
+        return;
+    }
+
+    ctx->hasRange = ctx->parser.nfields >= 6;
+    if (ctx->hasRange) {
+        gf_view_to_size(ctx->parser.fields[4], &ctx->rangeOffset);
+        gf_view_to_size(ctx->parser.fields[5], &ctx->rangeLength);
+        ctx->bodyStart = ctx->bodyEnd = ctx->bodyPos = 0; // nothing goes out before an OK header
+    }
+
+    // Keep-alive is opt-in on both sides, and the last request we allow on a
+    // connection is answered without it so the client knows we're closing.
+    ctx->coalesceHeader = gfs->coalesceHeader;
+    ctx->keepAlive = wantsKeepAlive(&ctx->parser) && gfs->keepAliveMax > 0 &&
+                     ctx->requestsServed < gfs->keepAliveMax;
+    if (ctx->keepAlive && ctx->requestsServed == 1) {
+        // A header and a small body go out as separate sends. On a connection that
+        // stays open Nagle would hold the body back until the client's delayed ACK.
+        int noDelay = 1;
+        setsockopt(ctx->connFd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof noDelay);
+    }
+
+    // The path is followed by the delimiter we already matched, so we can terminate
+    // it in place and hand the handler a pointer into our own request buffer.
+    char *extractedPath = ctx->request + (ctx->parser.fields[2].ptr - ctx->request);
+    extractedPath[ctx->parser.fields[2].len] = '\0';
+
+    if (gfs->statsPath != NULL && strcmp(extractedPath, gfs->statsPath) == 0) {
+        sendStats(gfs, ctx);
+        return;
+    }
+
+    // Once the handler returns we can only trust ctx if the handler left it with
+    // us. If it was aborted or handed to another thread, it's not ours anymore.
+    int connFd = ctx->connFd;
+    gfcontext_t *handlerCtx = ctx;
+    gfh_error_t status = gfs->handler(&handlerCtx, extractedPath, gfs -> handlerarg);
+    unsigned long handlerDone = gf_now_ns();
+    gf_stats_record(GF_PHASE_HANDLER, handlerDone - ctx->sendStart);
+    if (handlerCtx == NULL) {
+        // The fd is still registered (one-shot, so disarmed) unless it was closed already.
+        // A ring loop has nothing in flight for it at this point.
+        if (gfs->ring == NULL) {
+            epoll_ctl(gfs->epollFd, EPOLL_CTL_DEL, connFd, NULL);
+        }
+        return;
+    }
+
+    handlerCtx->sendStart = handlerDone;
+    if (status != GF_OK){
+        gfs_sendheader(&handlerCtx, status, 0);
+    }
+    finishResponse(gfs, handlerCtx);
+}
+
+void sendStats(gfserver_t *gfs, gfcontext_t *ctx) {
+    char report[4096];
+    size_t len = gf_stats_format(report, sizeof report);
+    if (gfs_sendheader(&ctx, GF_OK, len) != -1) {
+        gfs_send(&ctx, report, len);
+    }
+    finishResponse(gfs, ctx);
+}
+
+void finishResponse(gfserver_t *gfs, gfcontext_t *ctx) {
+    if (ctx == NULL) {
+        return; // gfs_sendheader already aborted it
+    }
+
+    // The handler promised a body but never sent one, the client still gets the header
+    if (ctx->heldHeaderLen > 0 && sendHeldHeader(ctx, NULL) == -1) {
+        closeConnection(gfs, ctx);
+        return;
+    }
+
+    if (ctx->outHead != NULL) {
+        if (rearm(gfs, ctx, EPOLLOUT) == -1) {
+            perror("server: epoll_ctl (rearm)");
+            closeConnection(gfs, ctx);
+        }
+        return;
+    }
+
+    // Everything was handed to the socket
+    unsigned long now = gf_now_ns();
+    gf_stats_record(GF_PHASE_SEND, now - ctx->sendStart);
+    gf_stats_record(GF_PHASE_TOTAL, now - ctx->startTime);
+
+    if (ctx->keepAlive) {
+        startNextRequest(gfs, ctx);
+        return;
+    }
+    if (wantsKeepAlive(&ctx->parser)) {
+        lingerClose(gfs, ctx); // a keep-alive client may have sent more requests already
+        return;
+    }
+    closeConnection(gfs, ctx);
+}
+
+void startNextRequest(gfserver_t *gfs, gfcontext_t *ctx) {
+    // Anything after the header we just answered is the start of the next request
+    size_t leftover = ctx->bytesRecvd - ctx->parser.headerLen;
+    memmove(ctx->request, ctx->request + ctx->parser.headerLen, leftover);
+    ctx->bytesRecvd = leftover;
+    ctx->request[leftover] = '\0';
+    ctx->bytesSent = 0;
+    ctx->keepAlive = 0;
+    ctx->heldHeaderLen = 0;
+    ctx->hasRange = 0;
+    gf_parser_init(&ctx->parser);
+    ctx->state = CONN_READING_HEADER;
+
+    uint32_t events = EPOLLIN;
+    ctx->startTime = leftover > 0 ? gf_now_ns() : 0;
+    if (leftover > 0) {
+        // The socket is writable, so EPOLLOUT brings us straight back to readHeader to
+        // parse the pipelined bytes without recursing through the handler again.
+        events |= EPOLLOUT;
+        waitListAppend(&gfs->headerWait, ctx, TIMEOUT_SEC);
+    } else {
+        waitListAppend(&gfs->idleWait, ctx, gfs->keepAliveIdleSec);
+    }
+
+    if (rearm(gfs, ctx, events) == -1) {
+        perror("server: epoll_ctl (rearm)");
+        closeConnection(gfs, ctx);
+    }
+}
+
+void lingerClose(gfserver_t *gfs, gfcontext_t *ctx) {
+    if (shutdown(ctx->connFd, SHUT_WR) == -1) {
+        closeConnection(gfs, ctx);
+        return;
+    }
+
+    ctx->state = CONN_DRAINING;
+    waitListAppend(&gfs->idleWait, ctx, gfs->keepAliveIdleSec);
+    if (rearm(gfs, ctx, EPOLLIN) == -1) {
+        perror("server: epoll_ctl (rearm)");
+        closeConnection(gfs, ctx);
+    }
+}
+
+void drainInput(gfserver_t *gfs, gfcontext_t *ctx) {
+    for (;;) {
+        ssize_t bytesRecvd = recv(ctx->connFd, ctx->request, sizeof(ctx->request), 0);
+        if (bytesRecvd > 0) {
+            continue;
+        }
+        if (bytesRecvd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        closeConnection(gfs, ctx); // the client closed (or reset) its side
+        return;
+    }
+
+    if (rearm(gfs, ctx, EPOLLIN) == -1) {
+        perror("server: epoll_ctl (rearm)");
+        closeConnection(gfs, ctx);
+    }
+}
+
+void flushOutput(gfserver_t *gfs, gfcontext_t *ctx) {
+    if (flushOutputQueue(ctx, 0) == -1) {
+        closeConnection(gfs, ctx);
+        return;
+    }
+    finishResponse(gfs, ctx);
+}
+
+static long msUntil(const struct timespec *deadline, const struct timespec *now) {
+    return (deadline->tv_sec - now->tv_sec) * 1000L + (deadline->tv_nsec - now->tv_nsec) / 1000000L;
+}
+
+static int expired(const gfcontext_t *ctx, const struct timespec *now) {
+    return ctx->deadline.tv_sec < now->tv_sec ||
+           (ctx->deadline.tv_sec == now->tv_sec && ctx->deadline.tv_nsec <= now->tv_nsec);
+}
+
+int nextTimeoutMs(gfserver_t *gfs) {
+    if (gfs->headerWait.head == NULL && gfs->idleWait.head == NULL) {
+        return -1; // nobody can time out, sleep until there's work
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long ms = -1;
+    if (gfs->headerWait.head != NULL) {
+        ms = msUntil(&gfs->headerWait.head->deadline, &now);
+    }
+    if (gfs->idleWait.head != NULL) {
+        long idleMs = msUntil(&gfs->idleWait.head->deadline, &now);
+        if (ms == -1 || idleMs < ms) {
+            ms = idleMs;
+        }
+    }
+    return ms < 0 ? 0 : (int) ms + 1;
+}
+
+void expireConnections(gfserver_t *gfs) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    while (gfs->headerWait.head != NULL && expired(gfs->headerWait.head, &now)) {
+        gfcontext_t *ctx = gfs->headerWait.head;
+        fprintf(stderr, "server: recv timed out while waiting for entire header\n");
+        waitListRemove(ctx);
+        ctx->state = CONN_SENDING;
+        ctx->keepAlive = 0;
+        gfs_sendheader(&ctx, GF_INVALID, 0);
+        if (ctx != NULL) {
+            closeConnection(gfs, ctx);
+        }
+    }
+
+    // An idle kept-alive or lingering connection is between requests, so we just close it
+    while (gfs->idleWait.head != NULL && expired(gfs->idleWait.head, &now)) {
+        closeConnection(gfs, gfs->idleWait.head);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// io_uring event loop
+//
+// Same state machine as the epoll loop, but instead of waiting for readiness and
+// then making the syscall, every step is submitted to the ring and handled when its
+// completion comes back. Connections are accepted by one multishot accept on the
+// registered listening socket, or one accept per connection where the kernel
+// doesn't have multishot accept yet. A file segment is streamed as linked pairs of
+// READ_FIXED into one of the ring's registered buffers and WRITE_FIXED from it to
+// the socket, so each chunk costs no syscall of its own.
+// ---------------------------------------------------------------------------
+
+// What a completion belongs to, kept in the low bits of user_data next to the ctx pointer
+enum {
+    RING_ACCEPT = 1,    // the multishot accept on the listening socket, no ctx
+    RING_RECV,          // header bytes
+    RING_DRAIN,         // input of a lingering connection we discard
+    RING_PARSE,         // a NOP that brings a connection with pipelined bytes back to the parser
+    RING_SEND,          // a memory segment
+    RING_READ,          // a file chunk into the ctx's registered buffer
+    RING_WRITE          // that buffer to the socket
+};
+#define RING_OP_MASK 7ULL
+
+static int ringEnter(gfring_t *ring, unsigned minComplete, int timeoutMs) {
+    // Everything between the kernel's head and our tail still has to be submitted
+    __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+    unsigned toSubmit = ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof arg);
+    unsigned flags = IORING_ENTER_EXT_ARG;
+    if (minComplete > 0) {
+        flags |= IORING_ENTER_GETEVENTS;
+        if (timeoutMs >= 0) {
+            ts.tv_sec = timeoutMs / 1000;
+            ts.tv_nsec = (timeoutMs % 1000) * 1000000L;
+            arg.ts = (uint64_t)(uintptr_t) &ts;
+        }
+    }
+
+    int ret = syscall(__NR_io_uring_enter, ring->fd, toSubmit, minComplete, flags, &arg, sizeof arg);
+    if (ret == -1 && (errno == ETIME || errno == EINTR)) {
+        return 0;
+    }
+    return ret;
+}
+
+static struct io_uring_sqe *ringGetSqe(gfring_t *ring) {
+    if (ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) == ring->sqEntries) {
+        // The queue is full, hand it to the kernel to make room
+        if (ringEnter(ring, 0, -1) == -1 ||
+            ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) == ring->sqEntries) {
+            perror("server: io_uring_enter");
+            return NULL;
+        }
+    }
+
+    unsigned index = ring->sqLocalTail & ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof *sqe);
+    ring->sqArray[index] = index;
+    ring->sqLocalTail++;
+    return sqe;
+}
+
+static void ringDestroy(gfring_t *ring) {
+    if (ring->sqes != MAP_FAILED && ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqesLen);
+    }
+    if (ring->ringMap != MAP_FAILED && ring->ringMap != NULL) {
+        munmap(ring->ringMap, ring->ringLen);
+    }
+    if (ring->fd != -1) {
+        close(ring->fd);
+    }
+    free(ring->buffers);
+    free(ring);
+}
+
+static gfring_t *ringCreate(int listenFd) {
+    gfring_t *ring = calloc(1, sizeof(gfring_t));
+    if (ring == NULL) {
+        perror("server: failed to allocate the ring");
+        return NULL;
+    }
+    ring->multishotAccept = 1;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof params);
+    ring->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    if (ring->fd == -1) {
+        perror("server: io_uring_setup");
+        free(ring);
+        return NULL;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+        fprintf(stderr, "server: io_uring lacks the features we need\n");
+        ringDestroy(ring);
+        return NULL;
+    }
+
+    // Both rings live in one mapping, the submission entries in another
+    size_t sqLen = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cqLen = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ringLen = sqLen > cqLen ? sqLen : cqLen;
+    ring->ringMap = mmap(NULL, ring->ringLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    ring->sqesLen = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqesLen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->ringMap == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        perror("server: mmap (io_uring)");
+        ringDestroy(ring);
+        return NULL;
+    }
+
+    char *base = ring->ringMap;
+    ring->sqHead = (unsigned *)(base + params.sq_off.head);
+    ring->sqTail = (unsigned *)(base + params.sq_off.tail);
+    ring->sqMask = *(unsigned *)(base + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(base + params.sq_off.array);
+    ring->sqEntries = params.sq_entries;
+    ring->sqLocalTail = *ring->sqTail;
+    ring->cqHead = (unsigned *)(base + params.cq_off.head);
+    ring->cqTail = (unsigned *)(base + params.cq_off.tail);
+    ring->cqMask = *(unsigned *)(base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+
+    // The kernel pins the buffers once instead of mapping them for every read and write
+    ring->buffers = malloc(RING_BUFFERS * RING_BUFFER_SIZE);
+    if (ring->buffers == NULL) {
+        perror("server: failed to allocate the ring buffers");
+        ringDestroy(ring);
+        return NULL;
+    }
+    struct iovec iov[RING_BUFFERS];
+    for (int i = 0; i < RING_BUFFERS; i++) {
+        iov[i].iov_base = ring->buffers + (size_t) i * RING_BUFFER_SIZE;
+        iov[i].iov_len = RING_BUFFER_SIZE;
+        ring->freeBuffers[i] = RING_BUFFERS - 1 - i;
+    }
+    ring->nfreeBuffers = RING_BUFFERS;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iov, RING_BUFFERS) == -1) {
+        perror("server: io_uring_register (buffers)");
+        ringDestroy(ring);
+        return NULL;
+    }
+
+    // The listening socket is fixed file 0, so the accept skips the fd table lookup
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, &listenFd, 1) == -1) {
+        perror("server: io_uring_register (files)");
+        ringDestroy(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+static void ringPrep(struct io_uring_sqe *sqe, int op, int fd, gfcontext_t *ctx, int tag) {
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->user_data = (uint64_t)(uintptr_t) ctx | tag;
+    if (ctx != NULL) {
+        ctx->inflight++;
+    }
+}
+
+static int submitAccept(gfserver_t *gfs) {
+    struct io_uring_sqe *sqe = ringGetSqe(gfs->ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+    ringPrep(sqe, IORING_OP_ACCEPT, 0, NULL, RING_ACCEPT);
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->ioprio = gfs->ring->multishotAccept ? IORING_ACCEPT_MULTISHOT : 0;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    gfs->ring->acceptArmed = 1;
+    return 0;
+}
+
+static int submitRecv(gfserver_t *gfs, gfcontext_t *ctx, char *buf, size_t len, int tag) {
+    struct io_uring_sqe *sqe = ringGetSqe(gfs->ring);
+    if (sqe == NULL) {
+        return -1;
+    }
+    ringPrep(sqe, IORING_OP_RECV, ctx->connFd, ctx, tag);
+    sqe->addr = (uint64_t)(uintptr_t) buf;
+    sqe->len = len;
+    return 0;
+}
+
+int uringArm(gfserver_t *gfs, gfcontext_t *ctx, uint32_t events) {
+    if (ctx->state == CONN_DRAINING) {
+        return submitRecv(gfs, ctx, ctx->request, sizeof(ctx->request), RING_DRAIN);
+    }
+
+    if (ctx->state == CONN_READING_HEADER) {
+        if (events & EPOLLOUT) {
+            // Pipelined bytes are already here, come back to them on the next completion
+            struct io_uring_sqe *sqe = ringGetSqe(gfs->ring);
+            if (sqe == NULL) {
+                return -1;
+            }
+            ringPrep(sqe, IORING_OP_NOP, -1, ctx, RING_PARSE);
+            return 0;
+        }
+        return submitRecv(gfs, ctx, ctx->request + ctx->bytesRecvd, headerRoom(ctx), RING_RECV);
+    }
+
+    return uringSubmitOutput(gfs, ctx) == -1 ? -1 : 0;
+}
+
+static void releaseBuffer(gfserver_t *gfs, gfcontext_t *ctx) {
+    if (ctx->bufIndex == -1) {
+        return;
+    }
+    gfs->ring->freeBuffers[gfs->ring->nfreeBuffers++] = ctx->bufIndex;
+    ctx->bufIndex = -1;
+    ctx->bufLen = ctx->bufOff = 0;
+
+    // Hand it straight to a connection that is stuck waiting for one
+    gfcontext_t *waiting = gfs->bufferWait.head;
+    if (waiting != NULL) {
+        waitListRemove(waiting);
+        uringContinueOutput(gfs, waiting);
+    }
+}
+
+int uringSubmitOutput(gfserver_t *gfs, gfcontext_t *ctx) {
+    gfring_t *ring = gfs->ring;
+
+    // A file chunk in the buffer the socket didn't take all of yet goes first
+    if (ctx->bufIndex != -1 && ctx->bufOff < ctx->bufLen) {
+        struct io_uring_sqe *sqe = ringGetSqe(ring);
+        if (sqe == NULL) {
+            return -1;
+        }
+        ringPrep(sqe, IORING_OP_WRITE_FIXED, ctx->connFd, ctx, RING_WRITE);
+        sqe->addr = (uint64_t)(uintptr_t)(ring->buffers + (size_t) ctx->bufIndex * RING_BUFFER_SIZE + ctx->bufOff);
+        sqe->len = ctx->bufLen - ctx->bufOff;
+        sqe->off = -1; // sockets have no file position
+        sqe->buf_index = ctx->bufIndex;
+        return 0;
+    }
+
+    gfout_seg_t *seg = ctx->outHead;
+    if (seg != NULL && seg->data == NULL && seg->done == seg->len) {
+        // The whole file went through the buffer
+        ctx->outHead = seg->next;
+        if (ctx->outHead == NULL) {
+            ctx->outTail = NULL;
+        }
+        freeSegment(seg);
+        releaseBuffer(gfs, ctx);
+        seg = ctx->outHead;
+    }
+    if (seg == NULL) {
+        return 1;
+    }
+
+    if (seg->data != NULL) {
+        struct io_uring_sqe *sqe = ringGetSqe(ring);
+        if (sqe == NULL) {
+            return -1;
+        }
+        ringPrep(sqe, IORING_OP_SEND, ctx->connFd, ctx, RING_SEND);
+        sqe->addr = (uint64_t)(uintptr_t)(seg->data + seg->done);
+        sqe->len = seg->len - seg->done;
+        // A file coming up next should share the segment with the tail of this one
+        sqe->msg_flags = MSG_NOSIGNAL | (seg->next != NULL ? MSG_MORE : 0);
+        return 0;
+    }
+
+    if (ctx->bufIndex == -1) {
+        if (ring->nfreeBuffers == 0) {
+            waitListAppend(&gfs->bufferWait, ctx, 0); // releaseBuffer picks it up
+            return 0;
+        }
+        ctx->bufIndex = ring->freeBuffers[--ring->nfreeBuffers];
+    }
+
+    size_t chunk = seg->len - seg->done;
+    if (chunk > RING_BUFFER_SIZE) {
+        chunk = RING_BUFFER_SIZE;
+    }
+    char *buf = ring->buffers + (size_t) ctx->bufIndex * RING_BUFFER_SIZE;
+    ctx->bufLen = ctx->bufOff = 0;
+
+    // The write only runs once the read filled the buffer. A short read breaks the
+    // link and cancels it, then we write what we got and read again.
+    struct io_uring_sqe *read = ringGetSqe(ring);
+    if (read == NULL) {
+        return -1;
+    }
+    ringPrep(read, IORING_OP_READ_FIXED, seg->fileFd, ctx, RING_READ);
+    read->addr = (uint64_t)(uintptr_t) buf;
+    read->len = chunk;
+    read->off = seg->offset;
+    read->buf_index = ctx->bufIndex;
+    read->flags = IOSQE_IO_LINK;
+
+    struct io_uring_sqe *write = ringGetSqe(ring);
+    if (write == NULL) {
+        return -1; // the read is already queued and its completion will clean up
+    }
+    ringPrep(write, IORING_OP_WRITE_FIXED, ctx->connFd, ctx, RING_WRITE);
+    write->addr = (uint64_t)(uintptr_t) buf;
+    write->len = chunk;
+    write->off = -1;
+    write->buf_index = ctx->bufIndex;
+    return 0;
+}
+
+void uringContinueOutput(gfserver_t *gfs, gfcontext_t *ctx) {
+    int done = uringSubmitOutput(gfs, ctx);
+    if (done == -1) {
+        closeConnection(gfs, ctx);
+    } else if (done == 1) {
+        finishResponse(gfs, ctx);
+    }
+}
+
+void uringClose(gfserver_t *gfs, gfcontext_t *ctx) {
+    releaseBuffer(gfs, ctx);
+    if (ctx->inflight > 0) {
+        // Only a recv can be outstanding here (a timed out or lingering connection).
+        // Shutting the socket down completes it, and whatever the loop queued in the
+        // meantime, e.g. the INVALID reply to a timeout, still gets a chance to go out.
+        ctx->closing = 1;
+        shutdown(ctx->connFd, ctx->outHead != NULL ? SHUT_RD : SHUT_RDWR);
+        return;
+    }
+    gfs_abort(&ctx);
+}
+
+static void finishClose(gfcontext_t *ctx) {
+    if (ctx->outHead != NULL && setNonBlocking(ctx->connFd) == 0) {
+        flushOutputQueue(ctx, 0);
+    }
+    gfs_abort(&ctx);
+}
+
+static void printRingError(const char *what, int res) {
+    errno = -res;
+    perror(what);
+}
+
+static void handleCompletion(gfserver_t *gfs, const struct io_uring_cqe *cqe) {
+    int tag = cqe->user_data & RING_OP_MASK;
+    gfcontext_t *ctx = (gfcontext_t *)(uintptr_t)(cqe->user_data & ~RING_OP_MASK);
+    int res = cqe->res;
+
+    if (tag == RING_ACCEPT) {
+        // Once the accept is done the loop submits the next one
+        gfring_t *ring = gfs->ring;
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            ring->acceptArmed = 0;
+        }
+        if (res == -EINVAL && ring->multishotAccept) {
+            // Kernels before 5.19 reject multishot accept, take one connection per accept
+            fprintf(stderr, "server: no multishot accept, accepting one connection at a time\n");
+            ring->multishotAccept = 0;
+            return;
+        }
+        if (res < 0) {
+            // Retrying right away would spin on an error that doesn't go away by itself,
+            // like running out of descriptors
+            if (res != -ECONNABORTED && res != -EINTR && res != -EAGAIN) {
+                printRingError("server: accept", res);
+                ring->acceptRetryAt = gf_now_ns() + ACCEPT_RETRY_MS * 1000000UL;
+            }
+            return;
+        }
+        ctx = context_create();
+        if (ctx == NULL) {
+            close(res);
+            return;
+        }
+        ctx->connFd = res;
+        ctx->startTime = gf_now_ns();
+        gf_stats_gauge_add(GF_GAUGE_CONNECTIONS, 1);
+        waitListAppend(&gfs->headerWait, ctx, TIMEOUT_SEC);
+        if (rearm(gfs, ctx, EPOLLIN) == -1) {
+            closeConnection(gfs, ctx);
+        }
+        return;
+    }
+
+    ctx->inflight--;
+    if (ctx->closing) {
+        if (ctx->inflight == 0) {
+            finishClose(ctx);
+        }
+        return;
+    }
+
+    gfout_seg_t *seg = ctx->outHead;
+    switch (tag) {
+    case RING_RECV:
+        if (res <= 0) {
+            if (res < 0) {
+                printRingError("server: recv", res);
+            }
+            closeConnection(gfs, ctx);
+            return;
+        }
+        headerBytesReceived(gfs, ctx, res);
+        // fall through
+    case RING_PARSE: {
+        gf_parse_result_t result = gf_parser_feed(&ctx->parser, ctx->request, ctx->bytesRecvd);
+        if (result == GF_PARSE_INCOMPLETE) {
+            if (headerRoom(ctx) > 0) {
+                if (rearm(gfs, ctx, EPOLLIN) == -1) {
+                    closeConnection(gfs, ctx);
+                }
+                return;
+            }
+            fprintf(stderr, "server: client sent a larger header than expected\n");
+            result = GF_PARSE_ERROR;
+        }
+        headerComplete(gfs, ctx, result);
+        return;
+    }
+    case RING_DRAIN:
+        if (res <= 0 || rearm(gfs, ctx, EPOLLIN) == -1) {
+            closeConnection(gfs, ctx); // the client closed (or reset) its side
+        }
+        return;
+    case RING_SEND:
+        if (res < 0) {
+            printRingError("server: send", res);
+            closeConnection(gfs, ctx);
+            return;
+        }
+        seg->done += res;
+        if (seg->done == seg->len) {
+            ctx->outHead = seg->next;
+            if (ctx->outHead == NULL) {
+                ctx->outTail = NULL;
+            }
+            freeSegment(seg);
+        }
+        uringContinueOutput(gfs, ctx);
+        return;
+    case RING_READ:
+        if (res <= 0) {
+            // The linked write gets cancelled, we close once it completed
+            if (res == 0) {
+                fprintf(stderr, "server: file ended %zu bytes before the expected length\n", seg->len - seg->done);
+            } else {
+                printRingError("server: read", res);
+            }
+            ctx->ringError = 1;
+            return;
+        }
+        ctx->bufLen = res;
+        seg->offset += res;
+        seg->done += res;
+        return;
+    case RING_WRITE:
+        if (res == -ECANCELED && !ctx->ringError) {
+            uringContinueOutput(gfs, ctx); // a short read, write what it got
+            return;
+        }
+        if (res < 0) {
+            if (res != -ECANCELED) {
+                printRingError("server: write", res);
+            }
+            closeConnection(gfs, ctx);
+            return;
+        }
+        ctx->bufOff += res;
+        uringContinueOutput(gfs, ctx);
+        return;
+    }
+}
+
+void runUringLoop(gfserver_t *gfs) {
+    gfs->ring = ringCreate(gfs->sockfd);
+    if (gfs->ring == NULL) {
+        return;
+    }
+
+    // Only this loop's connections end up in the ring, everything else still
+    // behaves as before
+    if (submitAccept(gfs) == -1) {
+        ringDestroy(gfs->ring);
+        gfs->ring = NULL;
+        return;
+    }
+
+    gfring_t *ring = gfs->ring;
+    onEventLoop = 1;
+    loopRing = ring;
+    for (;;) {
+        int timeoutMs = nextTimeoutMs(gfs);
+        if (!ring->acceptArmed) {
+            unsigned long now = gf_now_ns();
+            if (now >= ring->acceptRetryAt && submitAccept(gfs) == -1) {
+                ring->acceptRetryAt = now + ACCEPT_RETRY_MS * 1000000UL; // the ring is full
+            }
+            if (!ring->acceptArmed) {
+                int retryMs = (ring->acceptRetryAt - now) / 1000000 + 1;
+                if (timeoutMs == -1 || retryMs < timeoutMs) {
+                    timeoutMs = retryMs;
+                }
+            }
+        }
+
+        // Submit whatever the last round queued and sleep until something completes
+        if (ringEnter(ring, 1, timeoutMs) == -1 && errno != EBUSY) {
+            perror("server: io_uring_enter");
+        }
+
+        unsigned head = *ring->cqHead;
+        while (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe cqe = ring->cqes[head & ring->cqMask];
+            head++;
+            // Hand the slot back before handling it, the handler may submit more work
+            __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+            handleCompletion(gfs, &cqe);
+        }
+
+        expireConnections(gfs);
+    }
+}
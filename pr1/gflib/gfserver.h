@@ -59,11 +59,72 @@ void gfserver_set_handlerarg(gfserver_t **gfs, void* arg);
  */
 void gfserver_set_maxpending(gfserver_t **gfs, int max_npending);
 
+/*
+ * Enables persistent connections for clients that ask for them by ending
+ * their request with " KEEPALIVE" (GETFILE GET <path> KEEPALIVE\r\n\r\n).
+ * Such a client may pipeline several requests on one connection and gets
+ * the responses back in order. A response that keeps the connection open
+ * ends with " KEEPALIVE" as well. The connection is closed after
+ * max_requests requests or once it sat idle for idle_timeout_sec seconds.
+ * Keep-alive only applies to requests the handler answers before it
+ * returns. A max_requests below 2 disables it (the default).
+ *
+ * The token is not invisible to older peers. A server built before
+ * keep-alive counts the fields of a request and answers INVALID to one
+ * that carries it; only lenient parsers like mtgf's ignore it. Clients
+ * must therefore be ready to ask again without it, as gfclient does. A
+ * response only carries the token when the request did, so old clients
+ * never see it.
+ */
+void gfserver_set_keepalive(gfserver_t **gfs, int max_requests, int idle_timeout_sec);
+
+/*
+ * Controls whether an OK header is held back until the handler sends the first
+ * body bytes, so both leave in one syscall and usually one TCP segment instead
+ * of a tiny header segment followed by the body. Handlers don't need to change:
+ * gfs_send and gfs_sendfile push a held header out first, and so does returning
+ * from the handler. Enabled by default, pass 0 to send headers right away.
+ */
+void gfserver_set_coalesce(gfserver_t **gfs, int enable);
+
+/*
+ * Sets the number of acceptor threads. Each one binds its own listening
+ * socket to the server's port with SO_REUSEPORT and runs its own event loop,
+ * and the kernel spreads new connections across them. With more than one
+ * acceptor the handler is called from several threads at once, so it (and
+ * the handler arg) must be thread-safe. Defaults to 1.
+ */
+void gfserver_set_acceptors(gfserver_t **gfs, int nacceptors);
+
+/*
+ * Runs the event loops on io_uring instead of epoll. Accepts, receives and
+ * sends are submitted to the ring, and gfs_sendfile streams the file through
+ * registered buffers with linked read/write requests. Falls back to epoll if
+ * the kernel doesn't provide io_uring. Disabled by default.
+ */
+void gfserver_set_io_uring(gfserver_t **gfs, int enable);
+
+/*
+ * Reserves a path for the server's stats. A request for it is answered by the
+ * server itself, never the handler, with the report from gf_stats_format():
+ * per-phase latency percentiles, responses by status, bytes sent and the
+ * number of open connections. The string must outlive the server. Disabled
+ * (NULL) by default.
+ */
+void gfserver_set_stats_path(gfserver_t **gfs, const char *path);
+
 
 /*
  * Sends to the client the Getfile header containing the appropriate
  * status and file length for the given inputs.  This function should
  * only be called from within a callback registered gfserver_set_handler.
+ *
+ * A client may ask for part of a file only, with
+ * GETFILE GET <path> RANGE <offset> <length>\r\n\r\n (a length of 0 means up
+ * to the end). Handlers don't have to know about it: they still pass the
+ * whole file's length here and send the whole file, and the server passes
+ * on just the requested part as GETFILE OK <part length> RANGE <file length>.
+ * Bytes outside the range that go through gfs_sendfile are never read.
  */
 ssize_t gfs_sendheader(gfcontext_t **ctx, gfstatus_t status, size_t file_len);
 
@@ -71,10 +132,21 @@ ssize_t gfs_sendheader(gfcontext_t **ctx, gfstatus_t status, size_t file_len);
  * Sends size bytes starting at the pointer data to the client
  * This function should only be called from within a callback registered
  * with gfserver_set_handler.  It returns once the data has been
- * sent.
+ * sent.  If the client falls megabytes behind, the call waits for it to
+ * catch up, and fails and closes the connection if it takes nothing for
+ * a few seconds.
  */
 ssize_t gfs_send(gfcontext_t **ctx, const void *data, size_t size);
 
+/*
+ * Sends len bytes of the file fd starting at offset to the client without
+ * copying them through user space. The file position of fd is not changed
+ * and fd may be closed as soon as this returns. Like gfs_send, this function
+ * should only be called from within a callback registered with
+ * gfserver_set_handler.
+ */
+ssize_t gfs_sendfile(gfcontext_t **ctx, int fd, off_t offset, size_t len);
+
 /*
  * Aborts the connection to the client associated with the input
  * gfcontext_t.
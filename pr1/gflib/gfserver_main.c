@@ -20,27 +20,61 @@
   "options:\n"                                                                                 \
   "  -h          		Show this help message.\n"              		                       \
   "  -m [content_file]  Content file mapping keys to content filea (Default: 'content.txt')\n" \
-  "  -p [listen_port]   Listen port (Default: 53948)\n"
+  "  -p [listen_port]   Listen port (Default: 53948)\n"                                        \
+  "  -k [max_requests]  Keep-alive requests per connection, 0 disables it (Default: 0)\n"    \
+  "  -c [0|1]           Send OK headers together with the first body bytes (Default: 1)\n"    \
+  "  -a [acceptors]     Acceptor threads sharing the port with SO_REUSEPORT (Default: 1)\n"    \
+  "  -u [0|1]           Drive the event loops with io_uring instead of epoll (Default: 0)\n"    \
+  "  -s [stats_path]    Answer requests for this path with the server's stats (Default: off)\n"
 
 /* OPTIONS DESCRIPTOR ====================================================== */
 static struct option gLongOptions[] = {
     {"content", required_argument, NULL, 'm'},
     {"help", no_argument, NULL, 'h'},
     {"port", required_argument, NULL, 'p'},
+    {"keepalive", required_argument, NULL, 'k'},
+    {"coalesce", required_argument, NULL, 'c'},
+    {"acceptors", required_argument, NULL, 'a'},
+    {"io-uring", required_argument, NULL, 'u'},
+    {"stats", required_argument, NULL, 's'},
     {NULL, 0, NULL, 0}};
 
+static void _sig_handler(int signo) {
+  if ((SIGINT == signo) || (SIGTERM == signo)) {
+    exit(signo);
+  }
+}
+
 /* Main ========================================================= */
 int main(int argc, char **argv) {
   int option_char = 0;
   gfserver_t *gfs = NULL;
   unsigned short port = 53948;
   char *content_map_file = "content.txt";
+  int keepalive_max = 0;
+  int coalesce = 1;
+  int acceptors = 1;
+  int io_uring = 0;
+  char *stats_path = NULL;
 
 
   setbuf(stdout, NULL);  // disable caching of standpard output
 
+  // Report the context pool on the way out, exit() from the signal handler runs it
+  atexit(printPoolStats);
+
+  if (SIG_ERR == signal(SIGINT, _sig_handler)) {
+    fprintf(stderr, "Can't catch SIGINT...exiting.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (SIG_ERR == signal(SIGTERM, _sig_handler)) {
+    fprintf(stderr, "Can't catch SIGTERM...exiting.\n");
+    exit(EXIT_FAILURE);
+  }
+
   // Parse and set command line arguments
-  while ((option_char = getopt_long(argc, argv, "hal:p:m:", gLongOptions, NULL)) != -1) {
+  while ((option_char = getopt_long(argc, argv, "ha:l:p:m:k:c:u:s:", gLongOptions, NULL)) != -1) {
     switch (option_char) {
 
       case 'p':  /* listen-port */
@@ -49,6 +83,21 @@ int main(int argc, char **argv) {
       case 'm':  /* file-path */
         content_map_file = optarg;
         break;
+      case 'k':  /* keepalive */
+        keepalive_max = atoi(optarg);
+        break;
+      case 'c':  /* coalesce */
+        coalesce = atoi(optarg);
+        break;
+      case 'a':  /* acceptors */
+        acceptors = atoi(optarg);
+        break;
+      case 'u':  /* io-uring */
+        io_uring = atoi(optarg);
+        break;
+      case 's':  /* stats */
+        stats_path = optarg;
+        break;
       case 'h':  /* help */
         fprintf(stdout, "%s", USAGE);
         exit(0);
@@ -73,12 +122,21 @@ int main(int argc, char **argv) {
   gfserver_set_handler(&gfs, gfs_handler);
   gfserver_set_port(&gfs, port);
   gfserver_set_maxpending(&gfs, 25);
+  gfserver_set_keepalive(&gfs, keepalive_max, 5);
+  gfserver_set_coalesce(&gfs, coalesce);
+  gfserver_set_acceptors(&gfs, acceptors);
+  gfserver_set_io_uring(&gfs, io_uring);
+  gfserver_set_stats_path(&gfs, stats_path);
 
   /* this implementation does not pass any extra state, so it uses NULL. */
   /* this value could be non-NULL.  You might want to test that in your own */
   /* code. */
   gfserver_set_handlerarg(&gfs, NULL);
 
+  // kill -USR1 dumps the stats to stderr. This has to happen before gfserver_serve
+  // starts the acceptor threads so that none of them takes the signal.
+  gf_stats_start_signal_dumper();
+
   // Run forever
   gfserver_serve(&gfs);
 }
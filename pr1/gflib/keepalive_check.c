@@ -0,0 +1,151 @@
+/*
+ * Checks that the client still works with a server that predates keep-alive.
+ * Like the original validateRequest, the server here answers INVALID to any
+ * request that isn't exactly "GETFILE GET <path>", so the KEEPALIVE token
+ * gets a request rejected. With gfc_global_init the client may send the token
+ * once, must then ask again without it, and must never send it to that server
+ * again. Exits with 0 if every download came back whole.
+ *
+ * usage: keepalive_check
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "gfclient.h"
+
+#define BODY "hello from a strict server"
+#define REQUESTS 5
+#define PIPELINED 3
+
+static int listenfd;
+static int withToken, withoutToken;
+
+// Serves one request per connection, like the server before keep-alive
+static void *strictServer(void *arg) {
+  char request[4096];
+  char response[128];
+
+  for (;;) {
+    int sockfd = accept(listenfd, NULL, NULL);
+    if (sockfd == -1) {
+      return NULL;
+    }
+
+    size_t len = 0;
+    while (len < sizeof request - 1 && (len < 4 || memcmp(request + len - 4, "\r\n\r\n", 4) != 0)) {
+      ssize_t n = recv(sockfd, request + len, sizeof request - 1 - len, 0);
+      if (n <= 0) {
+        break;
+      }
+      len += n;
+    }
+    request[len] = '\0';
+
+    int spaces = 0;
+    for (size_t i = 0; i < len; i++) {
+      spaces += request[i] == ' ';
+    }
+    if (spaces == 2) {
+      __atomic_add_fetch(&withoutToken, 1, __ATOMIC_RELAXED);
+      snprintf(response, sizeof response, "GETFILE OK %zu\r\n\r\n%s", strlen(BODY), BODY);
+    } else {
+      __atomic_add_fetch(&withToken, 1, __ATOMIC_RELAXED);
+      snprintf(response, sizeof response, "GETFILE INVALID\r\n\r\n");
+    }
+    send(sockfd, response, strlen(response), MSG_NOSIGNAL);
+    close(sockfd);
+  }
+}
+
+typedef struct {
+  char data[128];
+  size_t len;
+} body_t;
+
+static void writeBody(void *data, size_t len, void *arg) {
+  body_t *body = arg;
+  if (body->len + len <= sizeof body->data) {
+    memcpy(body->data + body->len, data, len);
+  }
+  body->len += len;
+}
+
+static gfcrequest_t *createRequest(unsigned short port, body_t *body) {
+  gfcrequest_t *gfr = gfc_create();
+  gfc_set_server(&gfr, "127.0.0.1");
+  gfc_set_port(&gfr, port);
+  gfc_set_path(&gfr, "/file");
+  gfc_set_writefunc(&gfr, writeBody);
+  gfc_set_writearg(&gfr, body);
+  body->len = 0;
+  return gfr;
+}
+
+static int bodyOk(gfcrequest_t **gfr, const body_t *body) {
+  return gfc_get_status(gfr) == GF_OK && body->len == strlen(BODY) && memcmp(body->data, BODY, body->len) == 0;
+}
+
+int main(int argc, char **argv) {
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof addr;
+  pthread_t thread;
+  int failed = 0;
+
+  memset(&addr, 0, sizeof addr);
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) == -1 ||
+      bind(listenfd, (struct sockaddr *) &addr, sizeof addr) == -1 || listen(listenfd, 16) == -1 ||
+      getsockname(listenfd, (struct sockaddr *) &addr, &addrlen) == -1) {
+    perror("keepalive_check: can't listen");
+    return EXIT_FAILURE;
+  }
+  pthread_create(&thread, NULL, strictServer, NULL);
+  pthread_detach(thread);
+  unsigned short port = ntohs(addr.sin_port);
+
+  gfc_global_init();
+  for (int i = 0; i < REQUESTS; i++) {
+    body_t body;
+    gfcrequest_t *gfr = createRequest(port, &body);
+    if (gfc_perform(&gfr) != 0 || !bodyOk(&gfr, &body)) {
+      fprintf(stderr, "keepalive_check: download %d failed\n", i);
+      failed++;
+    }
+    gfc_cleanup(&gfr);
+  }
+  gfc_global_cleanup();
+
+  // Without gfc_global_init nothing is remembered, but pipelining asks for
+  // keep-alive anyway and has to take no for an answer the same way
+  body_t bodies[PIPELINED];
+  gfcrequest_t *gfrs[PIPELINED];
+  int tokenBefore = __atomic_load_n(&withToken, __ATOMIC_RELAXED);
+  for (int i = 0; i < PIPELINED; i++) {
+    gfrs[i] = createRequest(port, &bodies[i]);
+  }
+  gfc_perform_pipeline(gfrs, PIPELINED);
+  for (int i = 0; i < PIPELINED; i++) {
+    if (!bodyOk(&gfrs[i], &bodies[i])) {
+      fprintf(stderr, "keepalive_check: pipelined download %d failed\n", i);
+      failed++;
+    }
+    gfc_cleanup(&gfrs[i]);
+  }
+
+  int tokenAfter = __atomic_load_n(&withToken, __ATOMIC_RELAXED);
+  printf("downloads: %d ok of %d, requests with KEEPALIVE: %d then %d pipelined, without: %d\n",
+         REQUESTS + PIPELINED - failed, REQUESTS + PIPELINED, tokenBefore, tokenAfter - tokenBefore,
+         __atomic_load_n(&withoutToken, __ATOMIC_RELAXED));
+  if (failed > 0 || tokenBefore != 1 || tokenAfter - tokenBefore != 1) {
+    printf("FAIL\n");
+    return EXIT_FAILURE;
+  }
+  printf("PASS\n");
+  return EXIT_SUCCESS;
+}
@@ -1,61 +1,349 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <pthread.h>
+#include <ctype.h>
+#include <limits.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "workload.h"
 
-static char *gWorkloadPathArray[100];
-static unsigned short int gUniqueWorkloadPaths = 0;
+#define WORKLOAD_CLAIM 64  // sequential and trace entries a thread takes from the shared cursor at once
+#define NS_PER_SEC 1000000000.0
+
+// Paths point into a private mapping of the workload file, terminated in place
+static char **gWorkloadPathArray = NULL;
+static size_t gUniqueWorkloadPaths = 0;
+static unsigned long *gTraceOffsets = NULL;  // ns since the first entry, only for traces
+static unsigned long gTraceSpan = 0;         // how much later the trace starts over
+static char *gMap = NULL;
+static size_t gMapLen = 0;
+static char *gTail = NULL;                    // last path, if the file didn't end in whitespace
 
-static pthread_mutex_t counter_mutex;
-static int counter = 0;
 static int mode = WORKLOAD_SEQ;
+static double *gZipfCdf = NULL;
+static double gHotFraction = 0.2;
+static double gHotProbability = 0.8;
+static unsigned long gSeed = 0x9e3779b97f4a7c15UL;
 
-int workload_init(char *workload_path) {
-  int i = 0;
-  char temp_buf[256];
+// Next unclaimed entry for WORKLOAD_SEQ and WORKLOAD_TRACE. Threads take
+// WORKLOAD_CLAIM entries at a time so the atomic stays off the hot path.
+static size_t gCursor = 0;
+static unsigned int gThreads = 0;
+
+typedef struct {
+  int seeded;
+  unsigned long rng;
+  size_t next;   // next entry of the claimed block
+  size_t end;    // end of the claimed block
+} workload_thread_t;
+
+static __thread workload_thread_t local;
+
+static unsigned long splitmix64(unsigned long x) {
+  x += 0x9e3779b97f4a7c15UL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9UL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebUL;
+  return x ^ (x >> 31);
+}
 
-  FILE *file_handle;
+static workload_thread_t *threadState() {
+  if (!local.seeded) {
+    unsigned int index = __atomic_fetch_add(&gThreads, 1, __ATOMIC_RELAXED);
+    local.rng = splitmix64(gSeed + index) | 1;
+    local.seeded = 1;
+  }
+  return &local;
+}
+
+// xorshift64*, uniform in [0, 1)
+static double uniform(workload_thread_t *state) {
+  state->rng ^= state->rng >> 12;
+  state->rng ^= state->rng << 25;
+  state->rng ^= state->rng >> 27;
+  return ((state->rng * 0x2545f4914f6cdd1dUL) >> 11) * 0x1.0p-53;
+}
 
-  file_handle = fopen(workload_path, "r");
-  if (file_handle == NULL) {
+static size_t claimEntry(workload_thread_t *state) {
+  if (state->next == state->end) {
+    state->next = __atomic_fetch_add(&gCursor, WORKLOAD_CLAIM, __ATOMIC_RELAXED);
+    state->end = state->next + WORKLOAD_CLAIM;
+  }
+  return state->next++;
+}
+
+static int isTimestamp(const char *token) {
+  char *end;
+  strtod(token, &end);
+  return end != token && *end == '\0';
+}
+
+int workload_init(char *workload_path) {
+  struct stat st;
+  int fd = open(workload_path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0) {
     fprintf(stderr, "cannot open workload file %s", workload_path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return EXIT_FAILURE;
+  }
+
+  gMapLen = st.st_size;
+  if (gMapLen > 0) {
+    // Private and writable so the paths can be terminated in place without
+    // copying them; only the pages we touch get copied.
+    gMap = mmap(NULL, gMapLen, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (gMap == MAP_FAILED) {
+    gMap = NULL;
+    fprintf(stderr, "cannot map workload file %s", workload_path);
     return EXIT_FAILURE;
   }
 
-  while (fscanf(file_handle, "%s", temp_buf) != EOF)
-    gWorkloadPathArray[i++] = strdup(temp_buf);
+  size_t tokens = 0;
+  for (size_t i = 0; i < gMapLen; i++) {
+    if (!isspace((unsigned char)gMap[i]) && (i == 0 || isspace((unsigned char)gMap[i - 1]))) {
+      tokens++;
+    }
+  }
+
+  char **words = malloc((tokens ? tokens : 1) * sizeof(char *));
+  if (words == NULL) {
+    workload_destroy();
+    return EXIT_FAILURE;
+  }
+  size_t n = 0;
+  for (size_t i = 0; i < gMapLen;) {
+    while (i < gMapLen && isspace((unsigned char)gMap[i])) {
+      i++;
+    }
+    if (i == gMapLen) {
+      break;
+    }
+    size_t start = i;
+    while (i < gMapLen && !isspace((unsigned char)gMap[i])) {
+      i++;
+    }
+    if (i < gMapLen) {
+      gMap[i++] = '\0';
+      words[n++] = &gMap[start];
+    } else if (NULL != (gTail = strndup(&gMap[start], i - start))) {
+      words[n++] = gTail;
+    }
+  }
 
-  gUniqueWorkloadPaths = i;
+  if (n >= 2 && n % 2 == 0 && isTimestamp(words[0])) {
+    // "<seconds> <path>" per line
+    gTraceOffsets = malloc(n / 2 * sizeof(unsigned long));
+    if (gTraceOffsets == NULL) {
+      free(words);
+      workload_destroy();
+      return EXIT_FAILURE;
+    }
+    double first = strtod(words[0], NULL);
+    for (size_t i = 0; i < n / 2; i++) {
+      if (!isTimestamp(words[2 * i])) {
+        fprintf(stderr, "malformed trace entry %zu in %s\n", i + 1, workload_path);
+        free(words);
+        workload_destroy();
+        return EXIT_FAILURE;
+      }
+      double offset = strtod(words[2 * i], NULL) - first;
+      gTraceOffsets[i] = offset > 0 ? (unsigned long)(offset * NS_PER_SEC) : 0;
+      if (i > 0 && gTraceOffsets[i] < gTraceOffsets[i - 1]) {
+        gTraceOffsets[i] = gTraceOffsets[i - 1];
+      }
+      words[i] = words[2 * i + 1];
+    }
+    n /= 2;
+    // Start the next lap one average gap after the last entry
+    gTraceSpan = gTraceOffsets[n - 1] + (n > 1 ? gTraceOffsets[n - 1] / (n - 1) : (unsigned long)NS_PER_SEC);
+    if (gTraceSpan == 0) {
+      gTraceSpan = 1;
+    }
+  }
 
-  pthread_mutex_init(&counter_mutex, NULL);
+  gWorkloadPathArray = words;
+  gUniqueWorkloadPaths = n;
+  return EXIT_SUCCESS;
+}
 
-  fclose(file_handle);
+int workload_set_zipf(double s) {
+  if (s <= 0 || gUniqueWorkloadPaths == 0) {
+    return EXIT_FAILURE;
+  }
+  double *cdf = malloc(gUniqueWorkloadPaths * sizeof(double));
+  if (cdf == NULL) {
+    return EXIT_FAILURE;
+  }
+  double sum = 0;
+  for (size_t i = 0; i < gUniqueWorkloadPaths; i++) {
+    sum += pow((double)(i + 1), -s);
+    cdf[i] = sum;
+  }
+  for (size_t i = 0; i < gUniqueWorkloadPaths; i++) {
+    cdf[i] /= sum;
+  }
+  free(gZipfCdf);
+  gZipfCdf = cdf;
+  return EXIT_SUCCESS;
+}
+
+int workload_set_hotspot(double hot_fraction, double hot_probability) {
+  if (hot_fraction <= 0 || hot_fraction > 1 || hot_probability < 0 || hot_probability > 1) {
+    return EXIT_FAILURE;
+  }
+  gHotFraction = hot_fraction;
+  gHotProbability = hot_probability;
+  return EXIT_SUCCESS;
+}
 
+int workload_set_mode(int new_mode) {
+  if (new_mode < WORKLOAD_SEQ || new_mode > WORKLOAD_TRACE) {
+    return EXIT_FAILURE;
+  }
+  if (new_mode == WORKLOAD_TRACE && gTraceOffsets == NULL) {
+    fprintf(stderr, "workload file has no timestamps to replay\n");
+    return EXIT_FAILURE;
+  }
+  if (new_mode == WORKLOAD_ZIPF && gZipfCdf == NULL && workload_set_zipf(1.0) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+  mode = new_mode;
   return EXIT_SUCCESS;
 }
 
+int workload_set_distribution(const char *spec) {
+  double a, b;
+
+  if (strcmp(spec, "seq") == 0) {
+    return workload_set_mode(WORKLOAD_SEQ);
+  }
+  if (strcmp(spec, "rnd") == 0) {
+    return workload_set_mode(WORKLOAD_RND);
+  }
+  if (strcmp(spec, "trace") == 0) {
+    return workload_set_mode(WORKLOAD_TRACE);
+  }
+  if (strcmp(spec, "zipf") == 0) {
+    return workload_set_mode(WORKLOAD_ZIPF);
+  }
+  if (sscanf(spec, "zipf:%lf", &a) == 1) {
+    if (workload_set_zipf(a) != EXIT_SUCCESS) {
+      return EXIT_FAILURE;
+    }
+    return workload_set_mode(WORKLOAD_ZIPF);
+  }
+  if (sscanf(spec, "hotspot:%lf:%lf", &a, &b) == 2) {
+    if (workload_set_hotspot(a, b) != EXIT_SUCCESS) {
+      return EXIT_FAILURE;
+    }
+    return workload_set_mode(WORKLOAD_HOTSPOT);
+  }
+  if (strcmp(spec, "hotspot") == 0) {
+    return workload_set_mode(WORKLOAD_HOTSPOT);
+  }
+  return EXIT_FAILURE;
+}
+
+void workload_set_seed(unsigned long seed) {
+  gSeed = seed;
+}
+
 unsigned short int workload_num_unique_paths(){
+  return gUniqueWorkloadPaths > USHRT_MAX ? USHRT_MAX : gUniqueWorkloadPaths;
+}
+
+size_t workload_num_paths() {
   return gUniqueWorkloadPaths;
 }
 
-char* workload_get_path(){
-  int entry;
+int workload_is_trace() {
+  return gTraceOffsets != NULL;
+}
 
-  if(mode == WORKLOAD_RND)
-    return gWorkloadPathArray[(int)(1.0 * gUniqueWorkloadPaths * rand()/(RAND_MAX+1.0))];
+// Smallest index whose cumulative probability reaches u
+static size_t zipfIndex(double u) {
+  size_t lo = 0, hi = gUniqueWorkloadPaths - 1;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (gZipfCdf[mid] < u) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
 
-  entry = __sync_fetch_and_add(&counter, 1);
+static size_t hotspotIndex(workload_thread_t *state) {
+  size_t hot = (size_t)ceil(gHotFraction * gUniqueWorkloadPaths);
+  if (hot == 0) {
+    hot = 1;
+  }
+  if (hot == gUniqueWorkloadPaths || uniform(state) < gHotProbability) {
+    return (size_t)(uniform(state) * hot);
+  }
+  return hot + (size_t)(uniform(state) * (gUniqueWorkloadPaths - hot));
+}
+
+char* workload_get_request(unsigned long *offset_ns) {
+  size_t entry;
+
+  if (offset_ns != NULL) {
+    *offset_ns = 0;
+  }
+  if (gUniqueWorkloadPaths == 0) {
+    return NULL;
+  }
+
+  workload_thread_t *state = threadState();
+  switch (mode) {
+    case WORKLOAD_RND:
+      entry = (size_t)(uniform(state) * gUniqueWorkloadPaths);
+      break;
+    case WORKLOAD_ZIPF:
+      entry = zipfIndex(uniform(state));
+      break;
+    case WORKLOAD_HOTSPOT:
+      entry = hotspotIndex(state);
+      break;
+    case WORKLOAD_TRACE:
+      entry = claimEntry(state);
+      if (offset_ns != NULL) {
+        *offset_ns = (entry / gUniqueWorkloadPaths) * gTraceSpan + gTraceOffsets[entry % gUniqueWorkloadPaths];
+      }
+      break;
+    default:
+      entry = claimEntry(state);
+      break;
+  }
 
   return gWorkloadPathArray[entry % gUniqueWorkloadPaths];
+}
 
+char* workload_get_path(){
+  return workload_get_request(NULL);
 }
 
 void workload_destroy(void) {
-  for (unsigned index = 0; index < gUniqueWorkloadPaths; index++) {
-    free(gWorkloadPathArray[index]);
-    gWorkloadPathArray[index] = NULL;
+  free(gWorkloadPathArray);
+  gWorkloadPathArray = NULL;
+  free(gTraceOffsets);
+  gTraceOffsets = NULL;
+  free(gZipfCdf);
+  gZipfCdf = NULL;
+  free(gTail);
+  gTail = NULL;
+  if (gMap != NULL) {
+    munmap(gMap, gMapLen);
+    gMap = NULL;
   }
   gUniqueWorkloadPaths = 0;
+  gCursor = 0;
 }
@@ -1,12 +1,20 @@
 #ifndef __WORKLOAD_H__
 #define __WORKLOAD_H__
 
+#include <stddef.h>
+
 #define WORKLOAD_SEQ 0
 #define WORKLOAD_RND 1
+#define WORKLOAD_ZIPF 2
+#define WORKLOAD_HOTSPOT 3
+#define WORKLOAD_TRACE 4
 
-/* 
+/*
  * Opens the file associated with the input argument
- * and reads in a list of paths to request. 
+ * and reads in a list of paths to request. The file is
+ * memory-mapped, so it can hold millions of paths. If every
+ * line is "<seconds> <path>" it is a trace, and the
+ * timestamps can be replayed with WORKLOAD_TRACE.
  */
 int workload_init(char *workload_path);
 
@@ -14,14 +22,53 @@ int workload_init(char *workload_path);
  * Sets the mode.  If WORKLOAD_SEQ, then workload getpath will
  * return the paths in sequence.  If WORKLOAD_RND, then
  * the paths will be chosen uniformly at random with replacement.
+ * WORKLOAD_ZIPF and WORKLOAD_HOTSPOT use the parameters set with
+ * workload_set_zipf and workload_set_hotspot, and WORKLOAD_TRACE
+ * replays the trace in order. Must be called before any thread
+ * asks for a path.
  */
 int workload_set_mode(int mode);
 
+/*
+ * Zipf(s): the i-th path of the file is requested with probability
+ * proportional to 1 / i^s, so the first path is the most popular.
+ */
+int workload_set_zipf(double s);
+
+/*
+ * The first hot_fraction of the paths get hot_probability of the
+ * requests, spread uniformly, and the rest share what's left.
+ */
+int workload_set_hotspot(double hot_fraction, double hot_probability);
+
+/*
+ * Sets the mode from a spec like "seq", "rnd", "zipf:0.99",
+ * "hotspot:0.2:0.8" or "trace".
+ */
+int workload_set_distribution(const char *spec);
+
+/*
+ * Seeds the per-thread random number generators, so runs can
+ * be repeated.
+ */
+void workload_set_seed(unsigned long seed);
+
 /*
  * Returns the number of unique paths in the workload
+ * (at most USHRT_MAX, see workload_num_paths).
  */
 unsigned short int workload_num_unique_paths();
 
+/*
+ * Returns the number of unique paths in the workload.
+ */
+size_t workload_num_paths();
+
+/*
+ * Returns whether the workload file had timestamps.
+ */
+int workload_is_trace();
+
 /*
  * Returns a path from the workload.  Whether this is
  * done sequentially, randomly or by some other method
@@ -29,6 +76,14 @@ unsigned short int workload_num_unique_paths();
  */
 char* workload_get_path();
 
+/*
+ * Like workload_get_path, but also sets offset_ns to when the
+ * request should be sent, relative to the start of the trace.
+ * Once the trace runs out it starts over, later. Outside
+ * WORKLOAD_TRACE the offset is always 0.
+ */
+char* workload_get_request(unsigned long *offset_ns);
+
 /*
  * Cleans up the workload package.
  */
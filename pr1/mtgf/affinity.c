@@ -0,0 +1,224 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "affinity.h"
+
+#define SYSFS_CPU "/sys/devices/system/cpu/cpu%d"
+
+typedef struct{
+	int cpu;
+	int node, package, core;
+	int thread;		/* which hyperthread of its core, 0 for the first */
+	int corerank;	/* which core of its socket, counting from 0 */
+} cpuinfo_t;
+
+struct affinity_t{
+	size_t ncpus;
+	int cpus[];
+};
+
+static int _readint(int cpu, const char *file, int fallback){
+	char path[128];
+	FILE *f;
+	int value;
+
+	snprintf(path, sizeof path, SYSFS_CPU "/topology/%s", cpu, file);
+	if(NULL == (f = fopen(path, "r")))
+		return fallback;
+	if(fscanf(f, "%d", &value) != 1)
+		value = fallback;
+	fclose(f);
+	return value;
+}
+
+int affinity_node(int cpu){
+	char path[64];
+	struct dirent *entry;
+	DIR *dir;
+	int node = 0;
+
+	/* The CPU's directory links to its node as nodeN */
+	snprintf(path, sizeof path, SYSFS_CPU, cpu);
+	if(NULL == (dir = opendir(path)))
+		return 0;
+	while(NULL != (entry = readdir(dir)))
+		if(sscanf(entry->d_name, "node%d", &node) == 1)
+			break;
+	closedir(dir);
+	return node;
+}
+
+/* Fills info with the CPUs we may run on and returns how many there are */
+static size_t _topology(cpuinfo_t *info){
+	cpu_set_t allowed;
+	size_t n = 0, i, j;
+
+	if(sched_getaffinity(0, sizeof allowed, &allowed) != 0)
+		return 0;
+	for(i = 0; i < CPU_SETSIZE; i++){
+		if(!CPU_ISSET(i, &allowed))
+			continue;
+		info[n].cpu = i;
+		info[n].node = affinity_node(i);
+		info[n].package = _readint(i, "physical_package_id", 0);
+		info[n].core = _readint(i, "core_id", i);
+		n++;
+	}
+
+	/* Both ranks by CPU number, which is how the kernel lists them. A core is
+	 * ranked by its first hyperthread and the others take the same rank. */
+	for(i = 0; i < n; i++){
+		info[i].thread = 0;
+		for(j = 0; j < i; j++)
+			if(info[j].package == info[i].package && info[j].core == info[i].core)
+				info[i].thread++;
+	}
+	for(i = 0; i < n; i++){
+		if(info[i].thread != 0)
+			continue;
+		info[i].corerank = 0;
+		for(j = 0; j < i; j++)
+			if(info[j].thread == 0 && info[j].node == info[i].node && info[j].package == info[i].package)
+				info[i].corerank++;
+	}
+	for(i = 0; i < n; i++)
+		for(j = 0; j < i && info[i].thread != 0; j++)
+			if(info[j].thread == 0 && info[j].package == info[i].package && info[j].core == info[i].core)
+				info[i].corerank = info[j].corerank;
+	return n;
+}
+
+#define _CMP(a, b) if((a) != (b)) return (a) < (b) ? -1 : 1
+
+static int _compact(const void *a, const void *b){
+	const cpuinfo_t *x = a, *y = b;
+	_CMP(x->node, y->node);
+	_CMP(x->package, y->package);
+	_CMP(x->corerank, y->corerank);
+	_CMP(x->thread, y->thread);
+	return x->cpu - y->cpu;
+}
+
+static int _scatter(const void *a, const void *b){
+	const cpuinfo_t *x = a, *y = b;
+	_CMP(x->thread, y->thread);
+	_CMP(x->corerank, y->corerank);
+	_CMP(x->node, y->node);
+	_CMP(x->package, y->package);
+	return x->cpu - y->cpu;
+}
+
+static affinity_t *_fromlist(const char *list, const cpuinfo_t *info, size_t n){
+	affinity_t *affinity;
+	const char *p = list;
+	char *end;
+	long first, last, cpu;
+	size_t i;
+
+	if(NULL == (affinity = malloc(sizeof(affinity_t) + CPU_SETSIZE * sizeof(int))))
+		return NULL;
+	affinity->ncpus = 0;
+	while(*p != '\0'){
+		first = last = strtol(p, &end, 10);
+		if(end == p)
+			goto invalid;
+		if(*end == '-'){
+			p = end + 1;
+			last = strtol(p, &end, 10);
+			if(end == p || last < first)
+				goto invalid;
+		}
+		for(cpu = first; cpu <= last; cpu++){
+			for(i = 0; i < n && info[i].cpu != cpu; i++)
+				;
+			if(i == n){
+				fprintf(stderr, "affinity: CPU %ld is not available\n", cpu);
+				free(affinity);
+				return NULL;
+			}
+			if(affinity->ncpus < CPU_SETSIZE)
+				affinity->cpus[affinity->ncpus++] = cpu;
+		}
+		p = end;
+		if(*p == ',')
+			p++;
+		else if(*p != '\0')
+			goto invalid;
+	}
+	if(affinity->ncpus > 0)
+		return affinity;
+
+invalid:
+	fprintf(stderr, "affinity: can't read CPU list \"%s\"\n", list);
+	free(affinity);
+	return NULL;
+}
+
+affinity_t *affinity_create(const char *policy){
+	cpuinfo_t *info;
+	affinity_t *affinity = NULL;
+	size_t n, i;
+
+	if(NULL == (info = malloc(CPU_SETSIZE * sizeof(cpuinfo_t))))
+		return NULL;
+	if(0 == (n = _topology(info))){
+		fprintf(stderr, "affinity: no CPUs to run on\n");
+		free(info);
+		return NULL;
+	}
+
+	if(strcmp(policy, "compact") == 0 || strcmp(policy, "scatter") == 0){
+		qsort(info, n, sizeof(cpuinfo_t), policy[0] == 'c' ? _compact : _scatter);
+		if(NULL != (affinity = malloc(sizeof(affinity_t) + n * sizeof(int)))){
+			affinity->ncpus = n;
+			for(i = 0; i < n; i++)
+				affinity->cpus[i] = info[i].cpu;
+		}
+	} else {
+		affinity = _fromlist(policy, info, n);
+	}
+	free(info);
+	return affinity;
+}
+
+int affinity_cpu(const affinity_t *affinity, size_t index){
+	return affinity->cpus[index % affinity->ncpus];
+}
+
+int affinity_pin(const affinity_t *affinity, size_t index){
+	cpu_set_t set;
+	int cpu;
+
+	if(affinity == NULL)
+		return -1;
+	cpu = affinity_cpu(affinity, index);
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if(pthread_setaffinity_np(pthread_self(), sizeof set, &set) != 0)
+		return -1;
+	return cpu;
+}
+
+void affinity_describe(const affinity_t *affinity, size_t count, char *buf, size_t len){
+	size_t i, used = 0;
+	int n;
+
+	if(len > 0)
+		buf[0] = '\0';
+	for(i = 0; i < count && used < len; i++){
+		n = snprintf(buf + used, len - used, i ? " %d" : "%d", affinity_cpu(affinity, i));
+		if(n < 0)
+			break;
+		used += n;
+	}
+}
+
+void affinity_destroy(affinity_t *affinity){
+	free(affinity);
+}
@@ -0,0 +1,57 @@
+#ifndef __AFFINITY_H__
+#define __AFFINITY_H__
+
+#include <stddef.h>
+
+/*
+ * Places threads on CPUs by a policy, reading the machine's layout
+ * (NUMA node, socket, core and hyperthread of every CPU) from sysfs.
+ * Only the CPUs the process may run on are used.
+ *
+ *   compact   fill a node first, a core's hyperthreads next to each
+ *             other, so threads share caches and memory
+ *   scatter   spread consecutive threads over nodes, then cores, and
+ *             use hyperthreads last, so each gets the most cache and
+ *             memory bandwidth
+ *   0,2,4-7   exactly these CPUs, in this order
+ *
+ * Thread i gets the i-th CPU of the order, wrapping around when there
+ * are more threads than CPUs.
+ *
+ * Memory is placed on the node of the thread that first writes it, so
+ * a thread that is pinned before it allocates anything keeps its stack,
+ * its buffers and its malloc arena on its own node.
+ */
+typedef struct affinity_t affinity_t;
+
+/*
+ * Returns the placement for policy, or NULL (with a message on stderr)
+ * if the policy can't be understood or names no usable CPU.
+ */
+affinity_t *affinity_create(const char *policy);
+
+/*
+ * Returns the CPU for thread index.
+ */
+int affinity_cpu(const affinity_t *affinity, size_t index);
+
+/*
+ * Pins the calling thread to the CPU for index. Does nothing for a
+ * NULL affinity. Returns the CPU, or -1 if it wasn't pinned.
+ */
+int affinity_pin(const affinity_t *affinity, size_t index);
+
+/*
+ * Returns the NUMA node of cpu, 0 if the machine doesn't say.
+ */
+int affinity_node(int cpu);
+
+/*
+ * Writes the first count CPUs of the order into buf as a list like
+ * "0 1 2 3", for logging where threads went.
+ */
+void affinity_describe(const affinity_t *affinity, size_t count, char *buf, size_t len);
+
+void affinity_destroy(affinity_t *affinity);
+
+#endif
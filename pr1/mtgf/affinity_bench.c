@@ -0,0 +1,121 @@
+/*
+ * Shows what placement costs two threads that work on the same data, like a
+ * delegate picking up a request the boss wrote: a cache line bounced between
+ * them, and a buffer one of them wrote read by the other. Each policy places
+ * the two threads as it would place the first two delegates, so compact puts
+ * them on one core or socket and scatter on different sockets (or nodes)
+ * where there are any.
+ *
+ * usage: affinity_bench [policy ...]   (Default: none compact scatter)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "affinity.h"
+
+#define ROUNDS 100000
+#define BUFFER_SIZE (64 << 20)
+#define SPINS 1000
+
+static affinity_t *affinity;
+static int turn __attribute__((aligned(64)));
+static char *buffer;
+static pthread_barrier_t ready;
+
+static double now(){
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* Waits for turn to be mine, yielding now and then so it also works on one CPU */
+static void wait_turn(int mine){
+	int spins = 0;
+	while(__atomic_load_n(&turn, __ATOMIC_ACQUIRE) != mine){
+		if(++spins == SPINS){
+			sched_yield();
+			spins = 0;
+		}
+	}
+}
+
+static void *writer(void *arg){
+	affinity_pin(affinity, 0);
+	// Written from here, so the pages are on this thread's node
+	memset(buffer, 1, BUFFER_SIZE);
+	pthread_barrier_wait(&ready);
+
+	for(int i = 0; i < ROUNDS; i++){
+		wait_turn(0);
+		__atomic_store_n(&turn, 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+static void *reader(void *arg){
+	double *result = arg;
+	unsigned long sum = 0;
+
+	affinity_pin(affinity, 1);
+	pthread_barrier_wait(&ready);
+
+	double t = now();
+	for(int i = 0; i < ROUNDS; i++){
+		wait_turn(1);
+		__atomic_store_n(&turn, 0, __ATOMIC_RELEASE);
+	}
+	result[0] = (now() - t) / ROUNDS * 1e9;
+
+	t = now();
+	for(size_t i = 0; i < BUFFER_SIZE; i += sizeof(unsigned long))
+		sum += *(volatile unsigned long *)(buffer + i);
+	result[1] = BUFFER_SIZE / (now() - t) / 1e9;
+	return (void *)(uintptr_t)(sum == 0);
+}
+
+int main(int argc, char **argv){
+	char *defaults[] = { "none", "compact", "scatter" };
+	char **policies = argc > 1 ? argv + 1 : defaults;
+	int npolicies = argc > 1 ? argc - 1 : 3;
+
+	if(NULL == (buffer = malloc(BUFFER_SIZE))){
+		perror("affinity_bench: malloc");
+		return EXIT_FAILURE;
+	}
+
+	printf("%d CPUs, %d round trips, %d MB read\n", (int) sysconf(_SC_NPROCESSORS_ONLN), ROUNDS, BUFFER_SIZE >> 20);
+	printf("%-10s %8s %10s %14s %10s\n", "policy", "cpus", "nodes", "round trip ns", "read GB/s");
+	for(int p = 0; p < npolicies; p++){
+		pthread_t threads[2];
+		double result[2];
+		char cpus[32] = "-", nodes[32] = "-";
+
+		affinity = NULL;
+		if(strcmp(policies[p], "none") != 0){
+			if(NULL == (affinity = affinity_create(policies[p])))
+				return EXIT_FAILURE;
+			affinity_describe(affinity, 2, cpus, sizeof cpus);
+			snprintf(nodes, sizeof nodes, "%d %d", affinity_node(affinity_cpu(affinity, 0)),
+					 affinity_node(affinity_cpu(affinity, 1)));
+		}
+
+		turn = 0;
+		pthread_barrier_init(&ready, NULL, 2);
+		pthread_create(&threads[0], NULL, writer, NULL);
+		pthread_create(&threads[1], NULL, reader, result);
+		pthread_join(threads[0], NULL);
+		pthread_join(threads[1], NULL);
+		pthread_barrier_destroy(&ready);
+		affinity_destroy(affinity);
+
+		printf("%-10s %8s %10s %14.0f %10.2f\n", policies[p], cpus, nodes, result[0], result[1]);
+	}
+	free(buffer);
+	return EXIT_SUCCESS;
+}
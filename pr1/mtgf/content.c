@@ -2,93 +2,697 @@
 #include <sys/stat.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/inotify.h>
+
+#include "content.h"
 
 #define MAX_KEYLEN 512
 
+/*
+ * Every key lives in one arena, NUL-terminated, and is found through an
+ * open-addressing table with linear probing. A slot keeps the upper half of
+ * the key's hash next to the entry number, so a probe only touches the entry
+ * (and the arena) when the tags match.
+ */
 typedef struct{
-	int fildes;
-	char key[MAX_KEYLEN];
+	uint64_t hash;
+	uint32_t keyoff;
+	uint32_t keylen;
+	int value;
+} entry_t;
+
+typedef struct{
+	uint32_t tag;
+	uint32_t entry;		/* entry index + 1, 0 is an empty slot */
+} slot_t;
+
+struct content_index_t{
+	char *arena;
+	size_t arenalen, arenacap;
+	entry_t *entries;
+	size_t nentries, entrycap;
+	slot_t *slots;
+	size_t mask;
+};
+
+static content_index_t *index_ = NULL;
+
+/*
+ * content_init only records the paths. A file is opened the first time it is
+ * asked for and stays open while anybody holds a reference. Open files nobody
+ * is using sit on an LRU list and the oldest are closed once more than
+ * maxopen files are open.
+ *
+ * Once content_watch has started the watcher, an item's size and mtime are
+ * kept after the first fstat and the file is watched with inotify. Any change
+ * drops them, bumps the version and closes the descriptor (or marks it stale
+ * if it's in use), so the next request sees the new file. The next acquire of
+ * a stale item detaches its descriptor, which its holders close when they are
+ * done with it, and opens the file again.
+ */
+typedef struct{
+	size_t pathoff;		/* into the paths arena */
+	int fildes;			/* -1 while closed */
+	int refs;
+	int prev, next;		/* LRU list of open, unreferenced items */
+	int stale;			/* fildes is for a file that changed since */
+	int metavalid;
+	size_t size;
+	time_t mtime;
+	unsigned long version;
+	int wd;				/* inotify watch, -1 if none */
+	int wdnext;			/* next item with the same watch (same inode) */
 } item_t;
 
-static int nitems;
-static item_t *items;
+static item_t *items = NULL;
+static size_t nitems, itemcap;
+static char *paths = NULL;
+static size_t pathslen, pathscap;
+
+/* Descriptors taken off stale items, still held by earlier requests */
+typedef struct{
+	int fildes;
+	int refs;
+} detached_t;
+
+static detached_t *detached = NULL;
+static size_t ndetached, detachedcap;
+
+static pthread_mutex_t fdlock = PTHREAD_MUTEX_INITIALIZER;
+static int lruhead = -1, lrutail = -1;	/* most and least recently released */
+static size_t nopen, maxopen;
+static unsigned long hits, misses, evictions;
+
+#define WATCH_MASK (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF)
+
+static int inotifyfd = -1;			/* -1 until content_watch, then metadata is cached */
+static int *wdhead = NULL;			/* first item per watch descriptor */
+static size_t wdcap;
+static void (*changehandler)(const char *key) = NULL;
+static unsigned long metahits, metamisses, changes;
+
+/* Hashes the key eight bytes at a time, FNV-style with a final mix so the
+ * low bits (the slot) depend on every byte. Also measures the key. */
+static uint64_t _hashkey(const char *key, size_t *len){
+	uint64_t hash = 14695981039346656037ULL;
+	uint64_t word;
+	size_t n = strlen(key), i;
+
+	for(i = 0; i + 8 <= n; i += 8){
+		memcpy(&word, key + i, 8);
+		hash = (hash ^ word) * 1099511628211ULL;
+	}
+	word = 0;
+	memcpy(&word, key + i, n - i);
+	hash = (hash ^ word ^ n) * 1099511628211ULL;
+
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	*len = n;
+	return hash;
+}
+
+content_index_t *content_index_create(size_t capacity){
+	content_index_t *index = calloc(1, sizeof(content_index_t));
+	if(index == NULL)
+		return NULL;
+
+	index->entrycap = capacity > 16 ? capacity : 16;
+	index->arenacap = index->entrycap * 32;
+	index->entries = malloc(index->entrycap * sizeof(entry_t));
+	index->arena = malloc(index->arenacap);
+	if(index->entries == NULL || index->arena == NULL){
+		content_index_destroy(index);
+		return NULL;
+	}
+	return index;
+}
+
+static const entry_t *_lookup(const content_index_t *index, const char *key, uint64_t hash, size_t len){
+	uint32_t tag = hash >> 32;
+	size_t i;
+
+	for(i = hash & index->mask; index->slots[i].entry != 0; i = (i + 1) & index->mask){
+		const entry_t *entry = &index->entries[index->slots[i].entry - 1];
+		if(index->slots[i].tag == tag && entry->keylen == len
+		   && memcmp(index->arena + entry->keyoff, key, len) == 0)
+			return entry;
+	}
+	return NULL;
+}
+
+/* Rebuilds the table for twice as many slots as entries, at least */
+static int _rehash(content_index_t *index, size_t nslots){
+	slot_t *slots = calloc(nslots, sizeof(slot_t));
+	size_t e, i;
+
+	if(slots == NULL)
+		return -1;
+
+	free(index->slots);
+	index->slots = slots;
+	index->mask = nslots - 1;
+	for(e = 0; e < index->nentries; e++){
+		for(i = index->entries[e].hash & index->mask; slots[i].entry != 0; i = (i + 1) & index->mask)
+			;
+		slots[i].tag = index->entries[e].hash >> 32;
+		slots[i].entry = e + 1;
+	}
+	return 0;
+}
+
+int content_index_add(content_index_t *index, const char *key, int value){
+	size_t len;
+	uint64_t hash = _hashkey(key, &len);
+
+	if(index->slots != NULL && _lookup(index, key, hash, len) != NULL)
+		return 1;
+
+	if(index->nentries == index->entrycap){
+		entry_t *entries = realloc(index->entries, 2 * index->entrycap * sizeof(entry_t));
+		if(entries == NULL)
+			return -1;
+		index->entries = entries;
+		index->entrycap *= 2;
+	}
+	while(index->arenalen + len + 1 > index->arenacap){
+		char *arena = realloc(index->arena, 2 * index->arenacap);
+		if(arena == NULL)
+			return -1;
+		index->arena = arena;
+		index->arenacap *= 2;
+	}
+
+	entry_t *entry = &index->entries[index->nentries++];
+	entry->hash = hash;
+	entry->keyoff = index->arenalen;
+	entry->keylen = len;
+	entry->value = value;
+	memcpy(index->arena + index->arenalen, key, len + 1);
+	index->arenalen += len + 1;
+
+	/* keep the load factor at or below one half */
+	if(index->slots == NULL || 2 * index->nentries > index->mask + 1){
+		size_t nslots = index->slots == NULL ? 32 : 2 * (index->mask + 1);
+		while(nslots < 2 * index->nentries)
+			nslots *= 2;
+		if(_rehash(index, nslots) < 0){
+			index->nentries--;
+			index->arenalen -= len + 1;
+			return -1;
+		}
+		return 0;
+	}
+
+	size_t i;
+	for(i = hash & index->mask; index->slots[i].entry != 0; i = (i + 1) & index->mask)
+		;
+	index->slots[i].tag = hash >> 32;
+	index->slots[i].entry = index->nentries;
+	return 0;
+}
+
+int content_index_get(const content_index_t *index, const char *key){
+	size_t len;
+	uint64_t hash = _hashkey(key, &len);
+	const entry_t *entry;
+
+	if(index->slots == NULL)
+		return -1;
+
+	entry = _lookup(index, key, hash, len);
+	return entry != NULL ? entry->value : -1;
+}
+
+size_t content_index_size(const content_index_t *index){
+	return index->nentries;
+}
+
+int content_index_value(const content_index_t *index, size_t i){
+	return index->entries[i].value;
+}
+
+void content_index_destroy(content_index_t *index){
+	if(index == NULL)
+		return;
+	free(index->slots);
+	free(index->entries);
+	free(index->arena);
+	free(index);
+}
+
+/* Called with fdlock held */
+static void _lruremove(int i){
+	if(items[i].prev >= 0) items[items[i].prev].next = items[i].next;
+	else lruhead = items[i].next;
+	if(items[i].next >= 0) items[items[i].next].prev = items[i].prev;
+	else lrutail = items[i].prev;
+	items[i].prev = items[i].next = -1;
+}
+
+static void _lrupush(int i){
+	items[i].prev = -1;
+	items[i].next = lruhead;
+	if(lruhead >= 0) items[lruhead].prev = i;
+	else lrutail = i;
+	lruhead = i;
+}
+
+/* Called with fdlock held. Leaves the item's descriptor to the requests that
+ * hold it, so the item can be opened again. */
+static int _detach(int i){
+	if(ndetached == detachedcap){
+		size_t cap = detachedcap ? 2 * detachedcap : 16;
+		detached_t *grown = realloc(detached, cap * sizeof(detached_t));
+		if(grown == NULL)
+			return -1;
+		detached = grown;
+		detachedcap = cap;
+	}
+	detached[ndetached].fildes = items[i].fildes;
+	detached[ndetached].refs = items[i].refs;
+	ndetached++;
+	items[i].fildes = -1;
+	items[i].refs = 0;
+	items[i].stale = 0;
+	return 0;
+}
+
+/* Closes idle files until we're back under the limit */
+static void _evict(){
+	while(nopen > maxopen && lrutail >= 0){
+		int victim = lrutail;
+		_lruremove(victim);
+		close(items[victim].fildes);
+		items[victim].fildes = -1;
+		nopen--;
+		evictions++;
+	}
+}
+
+static int _additem(const char *path){
+	size_t len = strlen(path) + 1;
+
+	if(nitems == itemcap){
+		size_t cap = itemcap ? 2 * itemcap : 16;
+		item_t *grown = realloc(items, cap * sizeof(item_t));
+		if(grown == NULL)
+			return -1;
+		items = grown;
+		itemcap = cap;
+	}
+	while(pathslen + len > pathscap){
+		size_t cap = pathscap ? 2 * pathscap : 4096;
+		char *grown = realloc(paths, cap);
+		if(grown == NULL)
+			return -1;
+		paths = grown;
+		pathscap = cap;
+	}
+
+	items[nitems].pathoff = pathslen;
+	items[nitems].fildes = -1;
+	items[nitems].refs = 0;
+	items[nitems].prev = items[nitems].next = -1;
+	items[nitems].stale = 0;
+	items[nitems].metavalid = 0;
+	items[nitems].version = 0;
+	items[nitems].wd = items[nitems].wdnext = -1;
+	memcpy(paths + pathslen, path, len);
+	pathslen += len;
+	return nitems++;
+}
 
-static int _itemcmp(const void *a, const void *b){
-	return strcmp(((item_t*) a)->key,((item_t*) b)->key);
+void content_set_max_open(size_t limit){
+	maxopen = limit > 0 ? limit : 1;
 }
 
 int content_init(const char *filename){
 	FILE *filelist;
-	int capacity = 16;
-	char *path, *ptr;
+	char line[MAX_KEYLEN];
+	char *key, *path, *ptr;
+	int item;
 
 	if( NULL == (filelist = fopen(filename, "r"))){
 		fprintf(stderr, "Unable to open file in content_init.\n");
 		exit(EXIT_FAILURE);
 	}
 
-	items = (item_t*) malloc(capacity * sizeof(item_t));
-	nitems = 0;
-	while(fgets(items[nitems].key, MAX_KEYLEN, filelist)){
+	if( NULL == (index_ = content_index_create(16))){
+		fprintf(stderr, "Unable to allocate the content index.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* Unless told otherwise keep half of our descriptors for connections */
+	if(maxopen == 0){
+		struct rlimit rl;
+		maxopen = 512;
+		if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+			maxopen = rl.rlim_cur / 2;
+		if(maxopen < 16)
+			maxopen = 16;
+	}
+
+	while(fgets(line, MAX_KEYLEN, filelist)){
 		/*Taking out EOL character*/
-		items[nitems].key[strlen(items[nitems].key)-1] = '\0';
+		line[strlen(line)-1] = '\0';
 
 		/* Using space delimiter to sep key and path*/
-		ptr = items[nitems].key;
-		strsep(&ptr, " \t"); 		/* The key is first */
+		ptr = line;
+		key = strsep(&ptr, " \t"); 	/* The key is first */
 		path = strsep(&ptr, " \t"); /* The path second */
 
-		if( 0 > (items[nitems].fildes = open(path, O_RDONLY))){
-			fprintf(stderr, "Unable to open file %s.\n", path);
+		if(path == NULL){
+			fprintf(stderr, "No path for %s in %s.\n", key, filename);
 			exit(EXIT_FAILURE);
 		}
-		nitems++;
 
-		if(nitems == capacity){
-			capacity *= 2;
-			items = realloc(items, capacity * sizeof(item_t));
+		if( 0 > (item = _additem(path))){
+			fprintf(stderr, "Unable to add %s to the content index.\n", key);
+			exit(EXIT_FAILURE);
 		}
 
+		switch(content_index_add(index_, key, item)){
+			case 0:
+				break;
+			case 1: /* The first mapping of a key wins */
+				nitems--;
+				pathslen = items[item].pathoff;
+				break;
+			default:
+				fprintf(stderr, "Unable to add %s to the content index.\n", key);
+				exit(EXIT_FAILURE);
+		}
 	}
 
 	fclose(filelist);
 
-	qsort(items, nitems, sizeof(item_t), _itemcmp);
-
 	return EXIT_SUCCESS;
 }
 
 unsigned long int content_delay = 0;
 
-int content_get(const char *key){
-	int lo = 0;
-	int hi = nitems - 1;
-	int mid, cmp;
+int content_acquire(const char *key, int *item){
+	int i, fildes;
 
 	if (content_delay > 0) {
 		usleep(content_delay);
 	}
 
-	while (lo <= hi) {
-		// Key is in items[lo..hi] or not present.
-		mid = lo + (hi - lo) / 2;
-		cmp = strcmp(key,items[mid].key);
-		if ( cmp < 0) hi = mid - 1;
-		else if (cmp > 0) lo = mid + 1;
-		else{
-			return items[mid].fildes;
-		} 
+	if(0 > (i = content_index_get(index_, key)))
+		return -1;
+
+	pthread_mutex_lock(&fdlock);
+	/* If we can't detach it we serve the old file, as before it changed */
+	if(items[i].stale)
+		_detach(i);
+	if(items[i].fildes >= 0){
+		if(items[i].refs++ == 0)
+			_lruremove(i);
+		hits++;
+		fildes = items[i].fildes;
+		pthread_mutex_unlock(&fdlock);
+		*item = i;
+		return fildes;
+	}
+	misses++;
+	pthread_mutex_unlock(&fdlock);
+
+	/* Open without the lock, the arena doesn't move after content_init */
+	if( 0 > (fildes = open(paths + items[i].pathoff, O_RDONLY)))
+		return -1;
+
+	pthread_mutex_lock(&fdlock);
+	if(items[i].stale)
+		_detach(i);
+	if(items[i].fildes >= 0){
+		/* somebody opened it while we did */
+		close(fildes);
+		if(items[i].refs++ == 0)
+			_lruremove(i);
+	} else {
+		items[i].fildes = fildes;
+		items[i].refs = 1;
+		nopen++;
+		_evict();
+	}
+	fildes = items[i].fildes;
+	pthread_mutex_unlock(&fdlock);
+
+	*item = i;
+	return fildes;
+}
+
+void content_release(int item, int fildes){
+	size_t j;
+
+	pthread_mutex_lock(&fdlock);
+	if(fildes != items[item].fildes){
+		/* Detached since it was acquired. An open descriptor's number is
+		 * unique, so it can't be mistaken for the item's new one. */
+		for(j = 0; j < ndetached && detached[j].fildes != fildes; j++)
+			;
+		if(j < ndetached && --detached[j].refs == 0){
+			close(fildes);
+			nopen--;
+			detached[j] = detached[--ndetached];
+		}
+	} else if(--items[item].refs == 0){
+		if(items[item].stale){
+			close(items[item].fildes);
+			items[item].fildes = -1;
+			items[item].stale = 0;
+			nopen--;
+		} else {
+			_lrupush(item);
+			_evict();
+		}
+	}
+	pthread_mutex_unlock(&fdlock);
+}
+
+/* Called with fdlock held. Forgets what we know about the file and lets go of
+ * its descriptor, which may now be for an unlinked or replaced file. */
+static void _changed(int i, int notify){
+	items[i].metavalid = 0;
+	items[i].version++;
+	changes++;
+	if(items[i].fildes >= 0){
+		if(items[i].refs == 0){
+			_lruremove(i);
+			close(items[i].fildes);
+			items[i].fildes = -1;
+			nopen--;
+		} else {
+			items[i].stale = 1;
+		}
+	}
+	if(notify && changehandler != NULL)
+		changehandler(index_->arena + index_->entries[i].keyoff);
+}
+
+/* Called with fdlock held */
+static int _watch(int i, int wd){
+	if((size_t) wd >= wdcap){
+		size_t cap = wdcap ? wdcap : 64, j;
+		int *grown;
+		while(cap <= (size_t) wd)
+			cap *= 2;
+		if(NULL == (grown = realloc(wdhead, cap * sizeof(int))))
+			return -1;
+		for(j = wdcap; j < cap; j++)
+			grown[j] = -1;
+		wdhead = grown;
+		wdcap = cap;
+	}
+	items[i].wd = wd;
+	items[i].wdnext = wdhead[wd];
+	wdhead[wd] = i;
+	return 0;
+}
+
+int content_stat(int item, int fildes, size_t *size, time_t *mtime, unsigned long *version){
+	struct stat st;
+	unsigned long seen;
+	int wd = -1, current;
+
+	pthread_mutex_lock(&fdlock);
+	/* What's cached describes the item's current descriptor only */
+	current = fildes == items[item].fildes && !items[item].stale;
+	if(current && items[item].metavalid){
+		*size = items[item].size;
+		*mtime = items[item].mtime;
+		*version = items[item].version;
+		metahits++;
+		pthread_mutex_unlock(&fdlock);
+		return 0;
+	}
+	metamisses++;
+	seen = items[item].version;
+	pthread_mutex_unlock(&fdlock);
+
+	/* Watch before the fstat, so a change right after it can't go unnoticed */
+	if(inotifyfd >= 0 && items[item].wd < 0)
+		wd = inotify_add_watch(inotifyfd, paths + items[item].pathoff, WATCH_MASK);
+	if(fstat(fildes, &st) == -1)
+		return -1;
+
+	pthread_mutex_lock(&fdlock);
+	if(wd >= 0 && items[item].wd < 0)
+		_watch(item, wd);
+	/* Only keep it if it's watched and nothing changed since we looked */
+	current = fildes == items[item].fildes && !items[item].stale;
+	if(current && items[item].wd >= 0 && items[item].version == seen){
+		items[item].size = st.st_size;
+		items[item].mtime = st.st_mtime;
+		items[item].metavalid = 1;
+	}
+	/* An old file is never current, so nothing derived from it is kept.
+	 * It only went stale through a change, so the version is above 0. */
+	*version = current ? items[item].version : items[item].version - 1;
+	pthread_mutex_unlock(&fdlock);
+
+	*size = st.st_size;
+	*mtime = st.st_mtime;
+	return 0;
+}
+
+int content_peek_size(const char *key, size_t *size){
+	int i, valid;
+
+	if(0 > (i = content_index_get(index_, key)))
+		return -1;
+
+	pthread_mutex_lock(&fdlock);
+	if((valid = items[i].metavalid))
+		*size = items[i].size;
+	pthread_mutex_unlock(&fdlock);
+	return valid ? 0 : -1;
+}
+
+unsigned long content_version(int item){
+	unsigned long version;
+
+	pthread_mutex_lock(&fdlock);
+	version = items[item].version;
+	pthread_mutex_unlock(&fdlock);
+	return version;
+}
+
+void content_invalidate(int item){
+	pthread_mutex_lock(&fdlock);
+	items[item].metavalid = 0;
+	items[item].version++;
+	pthread_mutex_unlock(&fdlock);
+}
+
+static void *_watcher(void *arg){
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *event;
+	ssize_t len;
+	char *ptr;
+	int i, next;
+	size_t j;
+
+	for(;;){
+		if(0 >= (len = read(inotifyfd, buf, sizeof buf)))
+			continue;
+
+		pthread_mutex_lock(&fdlock);
+		for(ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + event->len){
+			event = (const struct inotify_event *) ptr;
+
+			if(event->mask & IN_Q_OVERFLOW){
+				/* We lost events, so nothing we know can be trusted */
+				for(j = 0; j < nitems; j++)
+					_changed(j, 0);
+				if(changehandler != NULL)
+					changehandler(NULL);
+				continue;
+			}
+			if(event->wd < 0 || (size_t) event->wd >= wdcap)
+				continue;
+
+			for(i = wdhead[event->wd]; i >= 0; i = next){
+				next = items[i].wdnext;
+				_changed(i, 1);
+				if(event->mask & IN_IGNORED)
+					items[i].wd = items[i].wdnext = -1;
+			}
+			if(event->mask & IN_IGNORED)
+				wdhead[event->wd] = -1;
+		}
+		pthread_mutex_unlock(&fdlock);
+	}
+	return NULL;
+}
+
+int content_watch(void (*handler)(const char *key)){
+	pthread_t thread;
+
+	changehandler = handler;
+	if(0 > (inotifyfd = inotify_init1(IN_CLOEXEC))){
+		perror("content_watch: inotify_init1");
+		return -1;
 	}
-	return -1;
+	if(0 != pthread_create(&thread, NULL, _watcher, NULL)){
+		close(inotifyfd);
+		inotifyfd = -1;
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
+
+void content_meta_stats(unsigned long *nhits, unsigned long *nmisses, unsigned long *nchanges){
+	pthread_mutex_lock(&fdlock);
+	*nhits = metahits;
+	*nmisses = metamisses;
+	*nchanges = changes;
+	pthread_mutex_unlock(&fdlock);
+}
+
+int content_get(const char *key){
+	int item;
+
+	/* Callers of the old interface never release, so the file stays open */
+	return content_acquire(key, &item);
+}
+
+void content_stats(unsigned long *nhits, unsigned long *nmisses, unsigned long *nevictions, size_t *nopened){
+	pthread_mutex_lock(&fdlock);
+	*nhits = hits;
+	*nmisses = misses;
+	*nevictions = evictions;
+	*nopened = nopen;
+	pthread_mutex_unlock(&fdlock);
 }
 
 void content_destroy(){
-	int i;
+	size_t i;
 	for(i = 0; i < nitems; i++)
-		close(items[i].fildes);
-	
+		if(items[i].fildes >= 0)
+			close(items[i].fildes);
+	for(i = 0; i < ndetached; i++)
+		close(detached[i].fildes);
+
 	free(items);
+	free(detached);
+	detached = NULL;
+	ndetached = detachedcap = 0;
+	free(paths);
+	items = NULL;
+	paths = NULL;
+	nitems = itemcap = pathslen = pathscap = 0;
+	nopen = 0;
+	lruhead = lrutail = -1;
+	content_index_destroy(index_);
+	index_ = NULL;
 }
@@ -1,6 +1,9 @@
 #ifndef __CONTENT_H__
 #define __CONTENT_H__
 
+#include <stddef.h>
+#include <time.h>
+
 /* 
  * Initializes the content library given the information from
  * the provided file.  Each row of the file is assumed
@@ -16,13 +19,125 @@ int content_init(const char *filename);
 /* 
  * Returns the file descriptor associated with the input key.
  * Returns -1 if the the key is not found
+ *
+ * Files are opened on first use. The descriptor returned here
+ * is never closed before content_destroy; use content_acquire
+ * to let idle files be closed again.
  */
 int content_get(const char *key);
 
+/*
+ * Like content_get, but holds a reference on the open file and
+ * sets item for content_release. While referenced the file is
+ * never closed. Returns -1 if the key is not found or the file
+ * can't be opened.
+ */
+int content_acquire(const char *key, int *item);
+
+/*
+ * Drops a reference taken by content_acquire, which returned
+ * fildes. Once unreferenced the file may be closed to stay under
+ * the open file limit. If the file was replaced meanwhile, fildes
+ * is the old one's and is closed when its last holder is done.
+ */
+void content_release(int item, int fildes);
+
+/*
+ * Sets size and mtime for an acquired item, read through the
+ * fildes content_acquire returned, and the version of the file
+ * they describe. Once content_watch is running they are cached,
+ * so this only calls fstat the first time and after the file
+ * changed. If fildes is for a file that was replaced since, the
+ * version is one content_version no longer returns. Returns -1 if
+ * fstat fails.
+ */
+int content_stat(int item, int fildes, size_t *size, time_t *mtime, unsigned long *version);
+
+/*
+ * Sets size to what content_stat last cached for key, without
+ * opening the file or waiting for it. Returns -1 if nothing is
+ * cached, e.g. before the first request or after a change.
+ */
+int content_peek_size(const char *key, size_t *size);
+
+/*
+ * Returns the item's version. It goes up whenever the file is
+ * seen to change, so anything derived from the file (like a
+ * cached copy) is current if the version didn't move meanwhile.
+ */
+unsigned long content_version(int item);
+
+/*
+ * Drops the cached size and mtime, for when the caller found the
+ * file isn't what content_stat said (e.g. a short read).
+ */
+void content_invalidate(int item);
+
+/*
+ * Starts a thread that watches every file content_stat looked at
+ * with inotify and forgets what it knew about them when they
+ * change. handler, if not NULL, is called on that thread with the
+ * key of each changed file, or with NULL if events were lost and
+ * any file may have changed. Without this content_stat always
+ * calls fstat. Returns -1 if inotify isn't available.
+ */
+int content_watch(void (*handler)(const char *key));
+
+/*
+ * Reports how often content_stat was answered from the cache,
+ * how often it had to call fstat, and how many changes were seen.
+ */
+void content_meta_stats(unsigned long *hits, unsigned long *misses, unsigned long *changes);
+
+/*
+ * Sets how many files may stay open. Files in use are never
+ * closed, so the limit can be exceeded while they are. The
+ * default is half of RLIMIT_NOFILE.
+ */
+void content_set_max_open(size_t limit);
+
+/*
+ * Reports how often an acquired file was already open (hits) or
+ * had to be opened (misses), how many idle files were closed to
+ * make room, and how many are open right now.
+ */
+void content_stats(unsigned long *hits, unsigned long *misses, unsigned long *evictions, size_t *open);
+
 /* 
  * Frees all memory and closes all file descriptors
  * associated with the cache.
  */
 void content_destroy();
 
+/*
+ * The hash index behind content_get: keys are copied into one
+ * arena and looked up through an open-addressing table. It is
+ * exposed so it can be measured on its own (see content_bench).
+ */
+typedef struct content_index_t content_index_t;
+
+/*
+ * Returns an empty index sized for about capacity keys, or NULL.
+ */
+content_index_t *content_index_create(size_t capacity);
+
+/*
+ * Maps key to value. Returns 0 on success, 1 if the key is
+ * already there (the old value is kept) and -1 if out of memory.
+ */
+int content_index_add(content_index_t *index, const char *key, int value);
+
+/*
+ * Returns the value for key, or -1 if it isn't there.
+ */
+int content_index_get(const content_index_t *index, const char *key);
+
+/*
+ * Returns the number of keys, and the value of the i-th key added.
+ */
+size_t content_index_size(const content_index_t *index);
+int content_index_value(const content_index_t *index, size_t i);
+
+void content_index_destroy(content_index_t *index);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,145 @@
+/*
+ * Compares content_get's hash index with the sorted array and strcmp binary
+ * search it replaced, on synthetic catalogs.
+ *
+ * usage: content_bench [entries ...]   (Default: 1000 100000 10000000)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "content.h"
+
+#define MAX_KEYLEN 512
+#define NQUERIES 1000000
+#define QUERY_KEYLEN 64
+
+/* The old record layout: one inline 512-byte key per item */
+typedef struct{
+	int fildes;
+	char key[MAX_KEYLEN];
+} item_t;
+
+static double now(){
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void makeKey(char *buf, size_t len, size_t i){
+	snprintf(buf, len, "/courses/ud923/filecorpus/%03zu/file-%09zu.html", i % 997, i);
+}
+
+static int _itemcmp(const void *a, const void *b){
+	return strcmp(((item_t*) a)->key,((item_t*) b)->key);
+}
+
+static int bsearchGet(item_t *items, int nitems, const char *key){
+	int lo = 0;
+	int hi = nitems - 1;
+	int mid, cmp;
+
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		cmp = strcmp(key,items[mid].key);
+		if ( cmp < 0) hi = mid - 1;
+		else if (cmp > 0) lo = mid + 1;
+		else return items[mid].fildes;
+	}
+	return -1;
+}
+
+static void benchSorted(size_t n, const char *queries){
+	double need = (double) n * sizeof(item_t);
+	double avail = (double) sysconf(_SC_AVPHYS_PAGES) * sysconf(_SC_PAGESIZE);
+	if (need > avail * 0.8) {
+		printf("%10zu  bsearch  skipped, needs %.1f GB of records\n", n, need / 1e9);
+		return;
+	}
+
+	item_t *items = malloc(n * sizeof(item_t));
+	if (items == NULL) {
+		printf("%10zu  bsearch  skipped, out of memory\n", n);
+		return;
+	}
+
+	double t = now();
+	for (size_t i = 0; i < n; i++) {
+		makeKey(items[i].key, MAX_KEYLEN, i);
+		items[i].fildes = i;
+	}
+	qsort(items, n, sizeof(item_t), _itemcmp);
+	double build = now() - t;
+
+	long found = 0;
+	t = now();
+	for (size_t q = 0; q < NQUERIES; q++)
+		found += bsearchGet(items, n, queries + q * QUERY_KEYLEN) >= 0;
+	double lookup = now() - t;
+
+	printf("%10zu  bsearch  build %7.3fs  %7.1f ns/lookup  %8.1f MB  (%ld found)\n", n, build,
+	       lookup * 1e9 / NQUERIES, need / 1e6, found);
+	free(items);
+}
+
+static void benchIndex(size_t n, const char *queries){
+	char key[QUERY_KEYLEN];
+
+	double t = now();
+	content_index_t *index = content_index_create(n);
+	if (index == NULL) {
+		printf("%10zu  hash     skipped, out of memory\n", n);
+		return;
+	}
+	for (size_t i = 0; i < n; i++) {
+		makeKey(key, sizeof key, i);
+		if (content_index_add(index, key, i) < 0) {
+			printf("%10zu  hash     skipped, out of memory\n", n);
+			content_index_destroy(index);
+			return;
+		}
+	}
+	double build = now() - t;
+
+	long found = 0;
+	t = now();
+	for (size_t q = 0; q < NQUERIES; q++)
+		found += content_index_get(index, queries + q * QUERY_KEYLEN) >= 0;
+	double lookup = now() - t;
+
+	printf("%10zu  hash     build %7.3fs  %7.1f ns/lookup  (%ld found)\n", n, build,
+	       lookup * 1e9 / NQUERIES, found);
+	content_index_destroy(index);
+}
+
+int main(int argc, char **argv){
+	size_t defaults[] = { 1000, 100000, 10000000 };
+	size_t nsizes = argc > 1 ? (size_t)(argc - 1) : sizeof defaults / sizeof defaults[0];
+	char *queries = malloc((size_t) NQUERIES * QUERY_KEYLEN);
+
+	if (queries == NULL) {
+		perror("content_bench: malloc");
+		return EXIT_FAILURE;
+	}
+
+	srand(1);
+	for (size_t s = 0; s < nsizes; s++) {
+		size_t n = argc > 1 ? strtoul(argv[s + 1], NULL, 10) : defaults[s];
+		if (n == 0)
+			continue;
+
+		/* one in eight queries misses */
+		for (size_t q = 0; q < NQUERIES; q++) {
+			size_t i = ((size_t) rand() * RAND_MAX + rand()) % n;
+			makeKey(queries + q * QUERY_KEYLEN, QUERY_KEYLEN, q % 8 == 7 ? n + i : i);
+		}
+
+		benchSorted(n, queries);
+		benchIndex(n, queries);
+	}
+
+	free(queries);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,122 @@
+/*
+ * Measures the boss -> delegate hand-off alone: one producer submits items
+ * as fast as it can and N consumers take them and spin for a little while,
+ * through either the old single steque behind a mutex and condition
+ * variable or the per-delegate work-stealing queues.
+ *
+ * usage: dispatch_bench [items] [work_ns]   (Default: 1000000 500)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "steque.h"
+#include "workqueue.h"
+
+#define STOP ((void *) 1)
+
+static size_t nitems;
+static unsigned long workns;
+
+/* The old delegate pool */
+static steque_t queue;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t notempty = PTHREAD_COND_INITIALIZER;
+
+static workqueue_t *wq;
+
+static double now(){
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void work(){
+	double until = now() + workns / 1e9;
+	while (now() < until)
+		;
+}
+
+static void *steque_consumer(void *arg){
+	for (;;) {
+		pthread_mutex_lock(&lock);
+		while (steque_isempty(&queue))
+			pthread_cond_wait(&notempty, &lock);
+		void *item = steque_pop(&queue);
+		pthread_mutex_unlock(&lock);
+		if (item == STOP)
+			return NULL;
+		work();
+	}
+}
+
+static void *workqueue_consumer(void *arg){
+	size_t self = (uintptr_t) arg;
+	for (;;) {
+		if (workqueue_take(wq, self) == STOP)
+			return NULL;
+		work();
+	}
+}
+
+static void steque_put(void *item){
+	pthread_mutex_lock(&lock);
+	steque_enqueue(&queue, item);
+	pthread_cond_signal(&notempty);
+	pthread_mutex_unlock(&lock);
+}
+
+static void workqueue_put(void *item){
+	while (workqueue_submit(wq, item) != 0)
+		sched_yield();
+}
+
+static double run(size_t nthreads, void *(*consumer)(void *), void (*put)(void *)){
+	pthread_t threads[WORKQUEUE_MAX_WORKERS];
+	size_t i;
+
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&threads[i], NULL, consumer, (void *)(uintptr_t) i);
+
+	double t = now();
+	for (i = 0; i < nitems; i++)
+		put((void *)(uintptr_t)(i + 2));
+	for (i = 0; i < nthreads; i++)
+		put(STOP);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	return nitems / (now() - t);
+}
+
+int main(int argc, char **argv){
+	size_t counts[] = { 1, 2, 4, 8, 16, 32, 64 };
+
+	nitems = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+	workns = argc > 2 ? strtoul(argv[2], NULL, 10) : 500;
+
+	printf("%d CPUs, %zu items, %lu ns of work each\n", (int) sysconf(_SC_NPROCESSORS_ONLN), nitems, workns);
+	printf("%8s %16s %16s %10s %10s\n", "threads", "steque items/s", "stealing items/s", "steals", "parks");
+	for (size_t c = 0; c < sizeof counts / sizeof counts[0]; c++) {
+		size_t n = counts[c];
+		unsigned long steals, parks;
+
+		steque_init(&queue);
+		double old = run(n, steque_consumer, steque_put);
+		steque_destroy(&queue);
+
+		if (NULL == (wq = workqueue_create(n, 1024))) {
+			perror("dispatch_bench: workqueue_create");
+			return EXIT_FAILURE;
+		}
+		double stealing = run(n, workqueue_consumer, workqueue_put);
+		workqueue_stats(wq, &steals, &parks);
+		workqueue_destroy(wq);
+
+		printf("%8zu %16.0f %16.0f %10lu %10lu\n", n, old, stealing, steals, parks);
+	}
+	return EXIT_SUCCESS;
+}
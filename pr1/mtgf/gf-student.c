@@ -3,3 +3,322 @@
  */
 
 #include "gf-student.h"
+
+// One cache per pool per thread. Objects stay here until the thread has more
+// than GF_POOL_CACHE_SIZE of them.
+typedef struct {
+    gf_pool_obj_t *head;
+    size_t count;
+} gf_pool_cache_t;
+
+static __thread gf_pool_cache_t poolCaches[GF_POOL_MAX_POOLS];
+static int poolCount = 0;
+
+static gf_pool_cache_t *threadCache(gf_pool_t *pool) {
+    if (pool->id == 0) {
+        // Pools are statically initialized, so the first user hands out the slot
+        pthread_mutex_lock(&pool->lock);
+        if (pool->id == 0) {
+            int id = __sync_add_and_fetch(&poolCount, 1);
+            if (id > GF_POOL_MAX_POOLS) {
+                fprintf(stderr, "gf_pool: more than %d pools\n", GF_POOL_MAX_POOLS);
+                abort();
+            }
+            pool->id = id;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return &poolCaches[pool->id - 1];
+}
+
+void *gf_pool_get(gf_pool_t *pool) {
+    gf_pool_cache_t *cache = threadCache(pool);
+
+    if (cache->head == NULL && pool->nfree > 0) { // unlocked peek, a stale value only costs a malloc
+        // Take half a cache worth at once so the next few gets don't need the lock
+        pthread_mutex_lock(&pool->lock);
+        while (pool->freeList != NULL && cache->count < GF_POOL_CACHE_SIZE / 2) {
+            gf_pool_obj_t *obj = pool->freeList;
+            pool->freeList = obj->next;
+            pool->nfree--;
+            obj->next = cache->head;
+            cache->head = obj;
+            cache->count++;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    gf_pool_obj_t *obj = cache->head;
+    if (obj != NULL) {
+        cache->head = obj->next;
+        cache->count--;
+        __sync_fetch_and_add(&pool->hits, 1);
+        return obj;
+    }
+
+    __sync_fetch_and_add(&pool->misses, 1);
+    return malloc(pool->objSize);
+}
+
+// Moves all but keep of the cache's objects to the shared list. Whatever doesn't
+// fit goes back to the heap.
+static void spillCache(gf_pool_t *pool, gf_pool_cache_t *cache, size_t keep) {
+    gf_pool_obj_t *spill = NULL;
+    pthread_mutex_lock(&pool->lock);
+    while (cache->count > keep) {
+        gf_pool_obj_t *next = cache->head;
+        cache->head = next->next;
+        cache->count--;
+        if (pool->nfree < pool->maxFree) {
+            next->next = pool->freeList;
+            pool->freeList = next;
+            pool->nfree++;
+        } else {
+            next->next = spill;
+            spill = next;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    while (spill != NULL) {
+        gf_pool_obj_t *next = spill->next;
+        free(spill);
+        spill = next;
+    }
+}
+
+void gf_pool_put(gf_pool_t *pool, void *obj) {
+    if (obj == NULL) {
+        return;
+    }
+
+    gf_pool_cache_t *cache = threadCache(pool);
+    gf_pool_obj_t *freed = obj;
+    freed->next = cache->head;
+    cache->head = freed;
+    cache->count++;
+    if (cache->count <= GF_POOL_CACHE_SIZE) {
+        return;
+    }
+
+    // Hand half of the cache to the shared list, e.g. a delegate that only ever frees
+    // what the boss thread allocated
+    spillCache(pool, cache, GF_POOL_CACHE_SIZE / 2);
+}
+
+void gf_pool_flush(gf_pool_t *pool) {
+    spillCache(pool, threadCache(pool), 0);
+}
+
+void gf_pool_stats(gf_pool_t *pool, unsigned long *hits, unsigned long *misses) {
+    *hits = __sync_fetch_and_add(&pool->hits, 0);
+    *misses = __sync_fetch_and_add(&pool->misses, 0);
+}
+
+// Every thread that records anything gets one of these. They are pushed onto a
+// list the first time the thread records and never freed, so the report keeps
+// counting requests of threads that exited.
+typedef struct gf_stats_block_t {
+    gf_hist_t phases[GF_PHASE_COUNT];
+    unsigned long counters[GF_STAT_COUNT];
+    struct gf_stats_block_t *next;
+} gf_stats_block_t;
+
+static const char *phaseNames[GF_PHASE_COUNT] = { "header", "handler", "queue", "io_queue", "content", "send", "total" };
+static const char *counterNames[GF_STAT_COUNT] = { "ok", "file_not_found", "error", "invalid", "bytes_sent", "shed", "expired" };
+static const char *gaugeNames[GF_GAUGE_COUNT] = { "connections", "queue_depth", "io_queue_depth" };
+
+static __thread gf_stats_block_t *threadStats = NULL;
+static gf_stats_block_t *statsBlocks = NULL;
+static long gauges[GF_GAUGE_COUNT];
+static long gaugePeaks[GF_GAUGE_COUNT];
+
+unsigned long gf_now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long) now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+static gf_stats_block_t *statsBlock() {
+    if (threadStats == NULL) {
+        gf_stats_block_t *block = calloc(1, sizeof(gf_stats_block_t));
+        if (block == NULL) {
+            return NULL;
+        }
+        block->next = __atomic_load_n(&statsBlocks, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&statsBlocks, &block->next, block, 0,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+        threadStats = block;
+    }
+    return threadStats;
+}
+
+// Only the owning thread writes a block, so a relaxed load and store is enough for
+// the reader to see whole values, and there's no lock prefix on the hot path.
+static void bump(unsigned long *value, unsigned long n) {
+    __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static int histBucket(unsigned long value) {
+    if (value < (1UL << GF_HIST_SUB_BITS)) {
+        return value;
+    }
+    int shift = 63 - __builtin_clzl(value) - GF_HIST_SUB_BITS;
+    return ((shift + 1) << GF_HIST_SUB_BITS) + ((value >> shift) & ((1UL << GF_HIST_SUB_BITS) - 1));
+}
+
+// The highest value that lands in the bucket
+static unsigned long histBucketMax(int bucket) {
+    if (bucket < (1 << GF_HIST_SUB_BITS)) {
+        return bucket;
+    }
+    int shift = (bucket >> GF_HIST_SUB_BITS) - 1;
+    unsigned long mantissa = (bucket & ((1 << GF_HIST_SUB_BITS) - 1)) | (1UL << GF_HIST_SUB_BITS);
+    return ((mantissa + 1) << shift) - 1;
+}
+
+void gf_stats_record(gf_phase_t phase, unsigned long ns) {
+    gf_stats_block_t *block = statsBlock();
+    if (block == NULL) {
+        return;
+    }
+    gf_hist_t *hist = &block->phases[phase];
+    bump(&hist->counts[histBucket(ns)], 1);
+    bump(&hist->total, 1);
+    bump(&hist->sum, ns);
+    if (ns > __atomic_load_n(&hist->max, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&hist->max, ns, __ATOMIC_RELAXED);
+    }
+}
+
+void gf_stats_count(gf_counter_t counter, unsigned long n) {
+    gf_stats_block_t *block = statsBlock();
+    if (block != NULL) {
+        bump(&block->counters[counter], n);
+    }
+}
+
+static void raisePeak(gf_gauge_t gauge, long value) {
+    long peak = __atomic_load_n(&gaugePeaks[gauge], __ATOMIC_RELAXED);
+    while (value > peak && !__atomic_compare_exchange_n(&gaugePeaks[gauge], &peak, value, 0,
+                                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void gf_stats_gauge_add(gf_gauge_t gauge, long delta) {
+    raisePeak(gauge, __atomic_add_fetch(&gauges[gauge], delta, __ATOMIC_RELAXED));
+}
+
+void gf_stats_gauge_set(gf_gauge_t gauge, long value) {
+    __atomic_store_n(&gauges[gauge], value, __ATOMIC_RELAXED);
+    raisePeak(gauge, value);
+}
+
+// Value below which the given fraction of the recorded values fall
+static unsigned long histPercentile(const gf_hist_t *hist, double fraction) {
+    unsigned long rank = (unsigned long)(hist->total * fraction);
+    unsigned long seen = 0;
+    for (int i = 0; i < GF_HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen > rank) {
+            unsigned long value = histBucketMax(i);
+            return value < hist->max ? value : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+size_t gf_stats_format(char *buf, size_t len) {
+    // Summing into one block keeps the report consistent enough for a live view,
+    // threads keep recording while we read
+    gf_stats_block_t *sum = calloc(1, sizeof(gf_stats_block_t));
+    if (sum == NULL || len == 0) {
+        free(sum);
+        return 0;
+    }
+    for (gf_stats_block_t *block = __atomic_load_n(&statsBlocks, __ATOMIC_ACQUIRE); block != NULL; block = block->next) {
+        for (int p = 0; p < GF_PHASE_COUNT; p++) {
+            for (int i = 0; i < GF_HIST_BUCKETS; i++) {
+                sum->phases[p].counts[i] += __atomic_load_n(&block->phases[p].counts[i], __ATOMIC_RELAXED);
+            }
+            sum->phases[p].total += __atomic_load_n(&block->phases[p].total, __ATOMIC_RELAXED);
+            sum->phases[p].sum += __atomic_load_n(&block->phases[p].sum, __ATOMIC_RELAXED);
+            unsigned long max = __atomic_load_n(&block->phases[p].max, __ATOMIC_RELAXED);
+            if (max > sum->phases[p].max) {
+                sum->phases[p].max = max;
+            }
+        }
+        for (int c = 0; c < GF_STAT_COUNT; c++) {
+            sum->counters[c] += __atomic_load_n(&block->counters[c], __ATOMIC_RELAXED);
+        }
+    }
+
+    size_t used = 0;
+#define APPEND(...) \
+    do { \
+        if (used < len) { \
+            int n = snprintf(buf + used, len - used, __VA_ARGS__); \
+            used += n > 0 ? (size_t) n : 0; \
+        } \
+    } while (0)
+
+    APPEND("%-8s %10s %10s %10s %10s %10s %10s %10s\n", "phase", "count", "mean_us", "p50_us", "p90_us", "p99_us", "p999_us", "max_us");
+    for (int p = 0; p < GF_PHASE_COUNT; p++) {
+        const gf_hist_t *hist = &sum->phases[p];
+        if (hist->total == 0) {
+            continue;
+        }
+        APPEND("%-8s %10lu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", phaseNames[p], hist->total,
+               hist->sum / 1e3 / hist->total, histPercentile(hist, 0.5) / 1e3, histPercentile(hist, 0.9) / 1e3,
+               histPercentile(hist, 0.99) / 1e3, histPercentile(hist, 0.999) / 1e3, hist->max / 1e3);
+    }
+    for (int c = 0; c < GF_STAT_COUNT; c++) {
+        APPEND("%s %lu\n", counterNames[c], sum->counters[c]);
+    }
+    for (int g = 0; g < GF_GAUGE_COUNT; g++) {
+        APPEND("%s %ld (peak %ld)\n", gaugeNames[g], __atomic_load_n(&gauges[g], __ATOMIC_RELAXED),
+               __atomic_load_n(&gaugePeaks[g], __ATOMIC_RELAXED));
+    }
+#undef APPEND
+
+    free(sum);
+    return used < len ? used : len - 1;
+}
+
+void gf_stats_dump(FILE *out) {
+    char report[4096];
+    size_t len = gf_stats_format(report, sizeof report);
+    fwrite(report, 1, len, out);
+}
+
+static void *signalDumper(void *arg) {
+    sigset_t *set = arg;
+    for (;;) {
+        int signo;
+        if (sigwait(set, &signo) == 0) {
+            gf_stats_dump(stderr);
+        }
+    }
+    return NULL;
+}
+
+int gf_stats_start_signal_dumper() {
+    static sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    int err = pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if (err != 0) {
+        fprintf(stderr, "gf_stats: pthread_sigmask: %s\n", strerror(err));
+        return -1;
+    }
+
+    pthread_t thread;
+    err = pthread_create(&thread, NULL, signalDumper, &set);
+    if (err != 0) {
+        fprintf(stderr, "gf_stats: pthread_create: %s\n", strerror(err));
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
@@ -4,6 +4,9 @@
 #ifndef __GF_CLIENT_STUDENT_H__
 #define __GF_CLIENT_STUDENT_H__
 
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include "workload.h"
 #include "gfclient.h"
 #include "gf-student.h"
@@ -11,6 +14,44 @@
 
 #define MAX_DELEGATES 64
 
+// Size of the write-behind buffer used by the pwrite sink. Kept a multiple of
+// the page size so every flush lands on a page-aligned file offset.
+#define SINK_BATCH_SIZE (1 << 20)
+
+// Number of buckets in the boss thread's cache of directories already created
+#define DIR_CACHE_BUCKETS 256
+
+/**
+ * The sink decides what happens to the bytes of a download. stdio is the
+ * original fwrite path; pwrite preallocates the file with fallocate and
+ * flushes page-aligned batches; mmap maps the preallocated file and copies
+ * straight into it. null and checksum keep no file at all (checksum folds the
+ * body into an FNV-1a hash), which is handy for benchmarking the network
+ * path on its own.
+ */
+typedef enum {
+    SINK_STDIO,
+    SINK_PWRITE,
+    SINK_MMAP,
+    SINK_NULL,
+    SINK_CHECKSUM
+} sink_kind_t;
+
+typedef struct {
+    sink_kind_t kind;           // which of the writers above to use
+    int fd;                     // backing file (-1 for the null and checksum sinks)
+    FILE *file;                 // stdio stream for the stdio sink
+    char *path;                 // local path so a failed download can be removed
+    size_t filelen;             // length promised by the response header
+    size_t offset;              // file offset of the next byte to persist
+    char *batch;                // page-aligned write-behind buffer (pwrite sink)
+    size_t batchCap;            // capacity of the batch buffer
+    size_t batchLen;            // bytes currently buffered
+    char *map;                  // mapping of the preallocated file (mmap sink)
+    uint64_t checksum;          // FNV-1a of the body (checksum sink)
+    int failed;                 // set once a write could not be completed
+} download_sink_t;
+
 typedef struct {
     pthread_t pool[MAX_DELEGATES];          // Defines the thread pool
     steque_t q_request;                     // Defines the request queue
@@ -50,6 +91,35 @@ typedef struct {
 } delegation_request_t;
 
 
+/**
+ * Parses a sink name (stdio, pwrite, mmap, null, checksum). Returns -1 if
+ * unknown.
+ */
+int sink_parse_kind(const char *name);
+
+/**
+ * Creates the sink for a download, creating any missing parent directories
+ * of path first. Returns NULL if the file can't be opened.
+ */
+download_sink_t* sink_open(sink_kind_t kind, char *path);
+
+/**
+ * Header callback: picks up the file length from the response header and
+ * preallocates (and for the mmap sink maps) the file before the body arrives.
+ */
+void sink_header(void *header, size_t header_len, void *arg);
+
+/**
+ * Write callback for every chunk of the body.
+ */
+void sink_write(void *data, size_t data_len, void *arg);
+
+/**
+ * Flushes and closes the sink. If keep is zero, or any write failed, the
+ * partially written file is removed. Returns 0 when the file was kept intact.
+ */
+int sink_close(download_sink_t **sink, int keep);
+
 /**
  * This function creates a sentinel delegation request, it's used by the delegates
  * to know that there aren't any more requests left.
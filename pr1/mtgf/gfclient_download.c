@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // for fallocate()
 #include <stdlib.h>
 #include <pthread.h>
 #include "gfclient-student.h"
@@ -21,7 +22,11 @@ delegate_tracker_t tracker;
   "  -p [server_port]    Server port (Default: 18968)\n"                  \
   "  -w [workload_path]  Path to workload file (Default: workload.txt)\n" \
   "  -t [nthreads]       Number of threads (Default 8 Max: 1024)\n"       \
-  "  -n [num_requests]   Request download total (Default: 16)\n"
+  "  -n [num_requests]   Request download total (Default: 16)\n"         \
+  "  -o [sink]           Download sink: stdio, pwrite, mmap, null or\n"   \
+  "                      checksum (Default: pwrite)\n"                  \
+  "  -D [distribution]   Paths in order (seq) or drawn with rnd, zipf:S or\n" \
+  "                      hotspot:FRACTION:PROBABILITY (Default: seq)\n"
 
 /* OPTIONS DESCRIPTOR ====================================================== */
 static struct option gLongOptions[] = {
@@ -31,6 +36,8 @@ static struct option gLongOptions[] = {
     {"workload", required_argument, NULL, 'w'},
     {"nthreads", required_argument, NULL, 't'},
     {"nrequests", required_argument, NULL, 'n'},
+    {"sink", required_argument, NULL, 'o'},
+    {"distribution", required_argument, NULL, 'D'},
     {NULL, 0, NULL, 0}};
 
 static void Usage() { fprintf(stderr, "%s", USAGE); }
@@ -41,11 +48,52 @@ static void localPath(char *req_path, char *local_path) {
   sprintf(local_path, "%s-%06d", &req_path[1], counter++);
 }
 
-static FILE *openFile(char *path) {
+typedef struct dir_entry_t {
+  char *path;
+  struct dir_entry_t *next;
+} dir_entry_t;
+
+// Directories we've already created. Only the boss thread opens files so this
+// needs no lock.
+static dir_entry_t *dirCache[DIR_CACHE_BUCKETS];
+
+static unsigned int hashPath(const char *path, size_t len) {
+  unsigned int hash = 5381;
+  for (size_t i = 0; i < len; i++) {
+    hash = hash * 33 + (unsigned char)path[i];
+  }
+  return hash % DIR_CACHE_BUCKETS;
+}
+
+static void freeDirCache() {
+  for (int i = 0; i < DIR_CACHE_BUCKETS; i++) {
+    while (dirCache[i] != NULL) {
+      dir_entry_t *entry = dirCache[i];
+      dirCache[i] = entry->next;
+      free(entry->path);
+      free(entry);
+    }
+  }
+}
+
+/* Make the parent directories of path if they aren't there. Once a parent
+ * has been created all of its ancestors exist too, so only the full parent
+ * is cached and a hit skips every mkdir for the request. */
+static void makeParentDirs(char *path) {
   char *cur, *prev;
-  FILE *ans;
+  char *last = strrchr(path, '/');
+  if (last == NULL || last == path) {
+    return;
+  }
+
+  size_t len = last - path;
+  unsigned int bucket = hashPath(path, len);
+  for (dir_entry_t *entry = dirCache[bucket]; entry != NULL; entry = entry->next) {
+    if (strlen(entry->path) == len && memcmp(entry->path, path, len) == 0) {
+      return;
+    }
+  }
 
-  /* Make the directory if it isn't there */
   prev = path;
   while (NULL != (cur = strchr(prev + 1, '/'))) {
     *cur = '\0';
@@ -61,21 +109,234 @@ static FILE *openFile(char *path) {
     prev = cur;
   }
 
-  if (NULL == (ans = fopen(&path[0], "w"))) {
+  dir_entry_t *entry = malloc(sizeof(dir_entry_t));
+  if (entry != NULL && (entry->path = strndup(path, len)) != NULL) {
+    entry->next = dirCache[bucket];
+    dirCache[bucket] = entry;
+  } else {
+    free(entry);
+  }
+}
+
+/* Sinks ============================================================= */
+int sink_parse_kind(const char *name) {
+  if (strcmp(name, "stdio") == 0) return SINK_STDIO;
+  if (strcmp(name, "pwrite") == 0) return SINK_PWRITE;
+  if (strcmp(name, "mmap") == 0) return SINK_MMAP;
+  if (strcmp(name, "null") == 0) return SINK_NULL;
+  if (strcmp(name, "checksum") == 0) return SINK_CHECKSUM;
+  return -1;
+}
+
+download_sink_t* sink_open(sink_kind_t kind, char *path) {
+  download_sink_t *sink = calloc(1, sizeof(download_sink_t));
+  if (sink == NULL) {
+    return NULL;
+  }
+  sink->kind = kind;
+  sink->fd = -1;
+  sink->checksum = 14695981039346656037ULL;
+
+  if (kind == SINK_NULL || kind == SINK_CHECKSUM) {
+    return sink;
+  }
+
+  if (NULL == (sink->path = strdup(path))) {
+    free(sink);
+    return NULL;
+  }
+
+  makeParentDirs(path);
+
+  if (kind == SINK_STDIO) {
+    sink->file = fopen(path, "w");
+  } else {
+    // the mmap sink needs read access for a shared mapping
+    sink->fd = open(path, (kind == SINK_MMAP ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC, 0644);
+  }
+
+  if (sink->file == NULL && sink->fd < 0) {
     perror("Unable to open file");
-    exit(EXIT_FAILURE);
+    free(sink->path);
+    free(sink);
+    return NULL;
   }
+  return sink;
+}
 
-  return ans;
+/* Reserve the whole file up front so the filesystem can lay it out in one
+ * go. Not every filesystem supports fallocate; a plain ftruncate is enough
+ * for the mmap sink and the pwrite sink works without either. */
+static int preallocate(download_sink_t *sink) {
+  if (fallocate(sink->fd, 0, 0, sink->filelen) == 0) {
+    return 0;
+  }
+  if (sink->kind == SINK_MMAP) {
+    return ftruncate(sink->fd, sink->filelen);
+  }
+  return 0;
 }
 
-/* Callbacks ========================================================= */
-static void writecb(void *data, size_t data_len, void *arg) {
-  FILE *file = (FILE *)arg;
-  fwrite(data, 1, data_len, file);
+void sink_header(void *header, size_t header_len, void *arg) {
+  download_sink_t *sink = (download_sink_t *)arg;
+  char status[16];
+  unsigned long long filelen;
+  char buffer[64];
+
+  if (sink->fd < 0) {
+    return;
+  }
+
+  size_t n = header_len < sizeof(buffer) - 1 ? header_len : sizeof(buffer) - 1;
+  memcpy(buffer, header, n);
+  buffer[n] = '\0';
+  if (sscanf(buffer, "GETFILE %15s %llu", status, &filelen) != 2
+      || strcmp(status, "OK") != 0 || filelen == 0) {
+    return;
+  }
+  sink->filelen = filelen;
+
+  if (preallocate(sink) != 0) {
+    perror("client: failed to preallocate download");
+    sink->failed = 1;
+    return;
+  }
+
+  if (sink->kind == SINK_MMAP) {
+    sink->map = mmap(NULL, sink->filelen, PROT_WRITE, MAP_SHARED, sink->fd, 0);
+    if (sink->map == MAP_FAILED) {
+      perror("client: failed to map download");
+      sink->map = NULL;
+      sink->failed = 1;
+    }
+    return;
+  }
+
+  // Small files only need a buffer as big as themselves
+  size_t pagesize = sysconf(_SC_PAGESIZE);
+  sink->batchCap = sink->filelen < SINK_BATCH_SIZE ? sink->filelen : SINK_BATCH_SIZE;
+  sink->batchCap = (sink->batchCap + pagesize - 1) & ~(pagesize - 1);
+  if (posix_memalign((void **)&sink->batch, pagesize, sink->batchCap) != 0) {
+    sink->batch = NULL;
+    sink->batchCap = 0;
+  }
 }
 
-;
+static int writeAll(download_sink_t *sink, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = pwrite(sink->fd, data, len, sink->offset);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("client: failed to write download");
+      sink->failed = 1;
+      return -1;
+    }
+    data += n;
+    len -= n;
+    sink->offset += n;
+  }
+  return 0;
+}
+
+static void flushBatch(download_sink_t *sink) {
+  if (sink->batchLen > 0) {
+    writeAll(sink, sink->batch, sink->batchLen);
+    sink->batchLen = 0;
+  }
+}
+
+void sink_write(void *data, size_t data_len, void *arg) {
+  download_sink_t *sink = (download_sink_t *)arg;
+  const char *bytes = (const char *)data;
+
+  if (sink->failed) {
+    return;
+  }
+
+  switch (sink->kind) {
+    case SINK_STDIO:
+      fwrite(data, 1, data_len, sink->file);
+      break;
+
+    case SINK_NULL:
+      sink->offset += data_len;
+      break;
+
+    case SINK_CHECKSUM:
+      for (size_t i = 0; i < data_len; i++) {
+        sink->checksum = (sink->checksum ^ (unsigned char)bytes[i]) * 1099511628211ULL;
+      }
+      sink->offset += data_len;
+      break;
+
+    case SINK_MMAP:
+      if (sink->map != NULL && sink->offset + data_len <= sink->filelen) {
+        memcpy(sink->map + sink->offset, data, data_len);
+        sink->offset += data_len;
+      } else {
+        // the server sent more than it promised (or no length at all)
+        writeAll(sink, bytes, data_len);
+      }
+      break;
+
+    case SINK_PWRITE:
+      if (sink->batch == NULL) {
+        writeAll(sink, bytes, data_len);
+        break;
+      }
+      while (data_len > 0 && !sink->failed) {
+        size_t n = sink->batchCap - sink->batchLen;
+        if (n > data_len) {
+          n = data_len;
+        }
+        memcpy(sink->batch + sink->batchLen, bytes, n);
+        sink->batchLen += n;
+        bytes += n;
+        data_len -= n;
+        if (sink->batchLen == sink->batchCap) {
+          flushBatch(sink);
+        }
+      }
+      break;
+  }
+}
+
+int sink_close(download_sink_t **sink, int keep) {
+  if (sink == NULL || *sink == NULL) {
+    return -1;
+  }
+  download_sink_t *s = *sink;
+
+  if (s->kind == SINK_PWRITE) {
+    flushBatch(s);
+  }
+  if (s->map != NULL) {
+    munmap(s->map, s->filelen);
+  }
+  if (s->file != NULL) {
+    fclose(s->file);
+  }
+  if (s->fd >= 0) {
+    // drop any preallocated tail the server never filled in
+    if (keep && !s->failed && s->offset < s->filelen && ftruncate(s->fd, s->offset) != 0) {
+      s->failed = 1;
+    }
+    close(s->fd);
+  }
+
+  int ok = keep && !s->failed;
+  if (!ok && s->path != NULL && 0 > unlink(s->path)) {
+    fprintf(stderr, "warning: unlink failed on %s\n", s->path);
+  }
+
+  free(s->batch);
+  free(s->path);
+  free(s);
+  *sink = NULL;
+  return ok ? 0 : -1;
+}
 
 /* Main ========================================================= */
 int main(int argc, char **argv) {
@@ -93,12 +354,14 @@ int main(int argc, char **argv) {
   char local_path[PATH_BUFFER_SIZE];
 
   // gfcrequest_t *gfr = NULL;
-  FILE *file = NULL;
+  download_sink_t *sink = NULL;
+  int sinkKind = SINK_PWRITE;
+  char *distribution = "seq";
 
   setbuf(stdout, NULL);  // disable caching
 
   // Parse and set command line arguments
-  while ((option_char = getopt_long(argc, argv, "p:n:hs:t:r:w:", gLongOptions,
+  while ((option_char = getopt_long(argc, argv, "p:n:hs:t:r:w:o:D:", gLongOptions,
                                     NULL)) != -1) {
     switch (option_char) {
 
@@ -118,6 +381,16 @@ int main(int argc, char **argv) {
       case 'p':  // port
         port = atoi(optarg);
         break;
+      case 'D':  // distribution
+        distribution = optarg;
+        break;
+      case 'o':  // sink
+        if (0 > (sinkKind = sink_parse_kind(optarg))) {
+          fprintf(stderr, "Unknown sink %s\n", optarg);
+          Usage();
+          exit(1);
+        }
+        break;
       default:
         Usage();
         exit(1);
@@ -133,6 +406,10 @@ int main(int argc, char **argv) {
     fprintf(stderr, "Unable to load workload file %s.\n", workload_path);
     exit(EXIT_FAILURE);
   }
+  if (EXIT_SUCCESS != workload_set_distribution(distribution)) {
+    fprintf(stderr, "Invalid distribution %s\n", distribution);
+    exit(EXIT_FAILURE);
+  }
   if (port > 65331) {
     fprintf(stderr, "Invalid port number\n");
     exit(EXIT_FAILURE);
@@ -185,9 +462,11 @@ int main(int argc, char **argv) {
 
     localPath(req_path, local_path);
 
-    file = openFile(local_path);
+    if (NULL == (sink = sink_open(sinkKind, local_path))) {
+      exit(EXIT_FAILURE);
+    }
 
-    delegation_request_t *req = create_delegation_request(req_path, local_path, server, port, file, writecb);
+    delegation_request_t *req = create_delegation_request(req_path, local_path, server, port, sink, sink_write);
     if (req == NULL) {
       perror("client: failed to create the delegation request struct.");
       gfc_global_cleanup();
@@ -238,6 +517,8 @@ int main(int argc, char **argv) {
   gfc_global_cleanup();  /* use for any global cleanup for AFTER your thread
                           pool has terminated. */
   // printf("Completed gfc_global_cleanup!\n");
+  freeDirCache();
+  workload_destroy();
 
   return 0;
 }
@@ -287,6 +568,8 @@ void* delegate_function(void *arg) {
     gfc_set_server(&gfr, req->server);
     gfc_set_writearg(&gfr, req->writearg);
     gfc_set_writefunc(&gfr, req->writefunc);
+    gfc_set_headerarg(&gfr, req->writearg);
+    gfc_set_headerfunc(&gfr, sink_header);
 
     // fprintf(stdout, "Requesting %s%s\n", req->server, req->path);
 
@@ -294,18 +577,13 @@ void* delegate_function(void *arg) {
     // printf("Thread %lu is processing request for path: %s\n", (unsigned long)thread_id, req->path);
     if (0 > (returncode = gfc_perform(&gfr))) {
       fprintf(stdout, "gfc_perform returned an error %d\n", returncode);
-      fclose(req->writearg);
-      if (0 > unlink(req->local_path))
-        fprintf(stderr, "warning: unlink failed on %s\n", req->local_path);
-    } else {
-      fclose(req->writearg);
     }
 
-    if (gfc_get_status(&gfr) != GF_OK) {
-      if (0 > unlink(req->local_path)) {
-        fprintf(stderr, "warning: unlink failed on %s\n", req->local_path);
-      }
+    download_sink_t *sink = (download_sink_t *)req->writearg;
+    if (sink->kind == SINK_CHECKSUM) {
+      fprintf(stdout, "Checksum: %016llx\n", (unsigned long long)sink->checksum);
     }
+    sink_close(&sink, returncode >= 0 && gfc_get_status(&gfr) == GF_OK);
 
     fprintf(stdout, "Status: %s\n", gfc_strstatus(gfc_get_status(&gfr)));
     fprintf(stdout, "Received %zu of %zu bytes\n", gfc_get_bytesreceived(&gfr),
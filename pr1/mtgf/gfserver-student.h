@@ -7,25 +7,75 @@
 #include "gf-student.h"
 #include "gfserver.h"
 #include "content.h"
+#include "hotcache.h"
+#include "workqueue.h"
+#include "affinity.h"
 #include "steque.h"
 #include <pthread.h>
 
-#define MAX_DELEGATES 64
+#define MAX_DELEGATES WORKQUEUE_MAX_WORKERS
+#define DELEGATE_QUEUE_CAPACITY 1024           // requests each delegate's queue can hold
+
+// The pool controller looks at the delegates every POOL_SAMPLE_MS. It grows the pool by
+// half when requests wait or the delegates are busy for POOL_GROW_SAMPLES samples
+// in a row, and shrinks it by one when both are low for POOL_SHRINK_SAMPLES.
+#define POOL_SAMPLE_MS 250
+#define POOL_GROW_WAIT_US 1000.0
+#define POOL_GROW_UTILISATION 0.85
+#define POOL_GROW_SAMPLES 2
+#define POOL_SHRINK_WAIT_US 100.0
+#define POOL_SHRINK_UTILISATION 0.30
+#define POOL_SHRINK_SAMPLES 8
+#define POOL_COOLDOWN_SAMPLES 2
+#define MAX_IO_THREADS 256
 #define CHUNK_SIZE 4096
+#define REQUEST_PATH_MAX 4096 // max length in a linux file system is 4096 bytes
 
 /**
  * This Global Data Structure defines all the necessary data structures
  * That our Delegator and Delegates need to concurrently perform
  * their work.
  */
+/**
+ * What each delegate adds up for the pool controller, in its own cache line.
+ */
+typedef struct {
+    unsigned long busyNs;                       // time spent serving requests
+    unsigned long waitNs;                       // time the requests it took had waited in the queue
+    unsigned long requests;
+} __attribute__((aligned(64))) delegate_stats_t;
+
 typedef struct {
     size_t pool_size;                           // This keeps track of the pool size
+    size_t min_size, max_size;                  // The controller's bounds, equal if it's off
     pthread_t delegate_pool[MAX_DELEGATES];     // This data structure contains our delegates in the pool
-    steque_t request_q;                         // This queue contains the requests published by the Delegator
-    pthread_mutex_t q_lock;                     // This is the lock for our queue
-    pthread_cond_t q_not_empty;                 // This signal is to communicate between Delegator and Delegate when queue is not empty
+    workqueue_t *queue;                         // A queue per delegate; idle delegates steal from the others
+    delegate_stats_t stats[MAX_DELEGATES];
+    workqueue_t *bulk;                          // The bulk lane, for files of bulk_threshold bytes or more
+    size_t bulk_size;                           // Delegates reserved for the bulk lane, fixed
+    size_t bulk_threshold;
+    pthread_t bulk_pool[MAX_DELEGATES];
+    unsigned long bulk_requests;                // Requests that went to the bulk lane
+    affinity_t *affinity;                       // Where delegates run, NULL leaves it to the scheduler
 } gfserver_delegate_pool_t;
 
+/**
+ * The I/O stage. Delegates hand it the requests they can't answer from
+ * the hot cache, so a slow content_get() blocks one of these threads
+ * instead of a delegate. Its threads look the file up and give the
+ * request back to the delegates, ready to send.
+ */
+typedef struct {
+    size_t pool_size;                           // 0 means the delegates do their own I/O
+    pthread_t io_pool[MAX_IO_THREADS];
+    steque_t request_q;                         // requests waiting for storage
+    pthread_mutex_t q_lock;
+    pthread_cond_t q_not_empty;
+} gfserver_io_pool_t;
+
+#define REQUEST_NEW 0       // just received
+#define REQUEST_LOADED 1    // looked up, only the send is left
+
 
 /**
  * This struct acts as a wrapper that contains the necessary objects
@@ -34,8 +84,15 @@ typedef struct {
  * consume those request.
  */
 typedef struct {
-    gfcontext_t *ctx;   // The ctx is the context passed by the Delegator
-    char *path;         // The path is the path being retrieved
+    gfcontext_t *ctx;               // The ctx is the context passed by the Delegator
+    char path[REQUEST_PATH_MAX];    // The path is the path being retrieved
+    unsigned long receivedAt;       // When the boss got the request, from gf_now_ns()
+    unsigned long enqueuedAt;       // When the boss put it on the queue
+    int stage;                      // REQUEST_NEW or REQUEST_LOADED
+    int fd;                         // Once loaded: the file, or -1 if it's cached or failed
+    int item;                       // The content item to release after sending fd
+    size_t fileSize;
+    hotcache_obj_t *cached;         // Once loaded: the cached body, if there is one
 } request_t;
 
 
@@ -43,20 +100,93 @@ void init_threads(size_t numthreads);
 void cleanup_threads();
 
 /**
- * This function initializes the delegate pool which includes the
- * queue, queue mutex, and queue conditional variable.
+ * This function initializes the delegate pool and its queues. The pool
+ * starts with numOfDelegates and the controller keeps it between
+ * minDelegates and maxDelegates (0 for MAX_DELEGATES).
  */
-int init_delegate_pool(size_t numOfDelegates);
+int init_delegate_pool(size_t numOfDelegates, size_t minDelegates, size_t maxDelegates);
+
+/**
+ * This function starts the thread that resizes the delegate pool, unless
+ * its bounds leave it nothing to do. Call it after init_threads.
+ */
+int start_pool_controller();
+
+/**
+ * This function is the controller's loop. Every POOL_SAMPLE_MS it works out
+ * how long requests waited for a delegate and how busy the delegates were,
+ * and grows or shrinks the pool, logging each change to stderr.
+ */
+void* pool_controller(void *args);
+
+/**
+ * This function starts or retires delegates until there are size of them.
+ * Retired delegates finish their queued requests first. Returns whether
+ * the size changed.
+ */
+int resizeDelegatePool(size_t size);
 
 /**
  * This function handles the delegate's work. Each delegate in the pool 
- * will have the same task. 
+ * will have the same task. args is the delegate's index.
  */
 void* delegate_function(void *args);
 
+/**
+ * This function hands a request to the delegates, from the boss or an
+ * I/O thread, waiting while every delegate's queue is full. Requests for
+ * files we know to be large go to the bulk lane if there is one.
+ */
+void dispatchRequest(request_t *request);
+
+/**
+ * This function starts numOfDelegates delegates that only serve requests
+ * for files of threshold bytes or more, so small files never wait behind
+ * a large transfer and large ones only wait behind each other. With none
+ * every request goes to the one pool.
+ */
+int init_bulk_lane(size_t numOfDelegates, size_t threshold);
+
+/**
+ * This function is the bulk lane delegates' loop. args is the delegate's
+ * index in the lane.
+ */
+void* bulk_function(void *args);
+
+/**
+ * This function does a delegate's part of one request that it picked up at
+ * pickedAt: answer it, or hand it to the I/O stage.
+ */
+void serveRequest(request_t *request, unsigned long pickedAt);
+
+/**
+ * This function starts numOfThreads I/O threads (at most MAX_IO_THREADS).
+ * With none the delegates call content_get() themselves. Call it before
+ * init_threads.
+ */
+int init_io_pool(size_t numOfThreads);
+
+/**
+ * This function is the I/O threads' loop: loadContent() and back to the
+ * delegates.
+ */
+void* io_function(void *args);
+
+/**
+ * This function looks the request's file up and fills in fd, item,
+ * fileSize and cached. It is where a slow storage delay is paid.
+ */
+void loadContent(request_t *request);
+
+/**
+ * This function sends the response for a loaded request and destroys it.
+ */
+void finishRequest(request_t *request);
+
 /**
  * This method allows us to create the request which acts as a wrapper
- * object for our context and path.
+ * object for our context and path. Requests are recycled through a pool
+ * since the boss creates one per request and a delegate destroys it.
  */
 request_t* create_request(gfcontext_t **ctx, const char *path);
 
@@ -66,8 +196,66 @@ request_t* create_request(gfcontext_t **ctx, const char *path);
 void destory_request(request_t *request);
 
 /**
- * This function will be in charge of sending the entire file to the client
+ * This function reserves a path for the server's stats. The boss answers
+ * requests for it with the gf_stats_format() report instead of queueing them.
+ * NULL (the default) disables it.
+ */
+void set_stats_path(const char *path);
+
+/**
+ * This function bounds the requests the server holds at once, from the boss
+ * taking one to its answer going out. Past limit the boss answers new requests
+ * with GF_ERROR right away, or with block it stops accepting until there's
+ * room. 0 (the default) doesn't bound them.
+ */
+void set_queue_limit(size_t limit, int block);
+
+/**
+ * This function drops requests that waited longer than ms since the boss got
+ * them, answering GF_ERROR instead of reading the file. 0 (the default)
+ * never drops them.
+ */
+void set_queue_deadline(unsigned long ms);
+
+/**
+ * This function pins every delegate to its CPU under affinity as it starts,
+ * the bulk lane's after the pool's MAX size. Call it before init_threads.
+ * NULL (the default) leaves them to the scheduler.
+ */
+void set_delegate_affinity(affinity_t *affinity);
+
+/**
+ * This function applies the queue limit to a new request on the boss thread.
+ * Returns 0 if it should be turned away, it may wait for room first.
+ */
+int admitRequest();
+
+/**
+ * This function answers request with GF_ERROR and frees it if it is past the
+ * deadline at now. Returns whether it did.
+ */
+int dropIfExpired(request_t *request, unsigned long now);
+
+/**
+ * This function answers a request for the stats path on the boss thread.
+ */
+gfh_error_t sendStats(gfcontext_t **ctx);
+
+/**
+ * This method prints how often a request came from the pool instead of the heap.
+ */
+void printPoolStats();
+
+/**
+ * This function will be in charge of sending the entire file to the client.
+ * It uses gfs_sendfile when the gfserver library provides it.
+ */
+int sendFileContents(request_t *request, int filefd, size_t fileSize);
+
+/**
+ * This function sends a file held by the hot cache and finishes the
+ * request: it drops the cache reference and destroys the request.
  */
-int sendFileContents(request_t *request, int filefd);
+void finishFromCache(request_t *request, hotcache_obj_t *cached, unsigned long sendStart);
 
 #endif // __GF_SERVER_STUDENT_H__
@@ -83,6 +83,14 @@ void gfs_abort(gfcontext_t **ctx);
  */
 ssize_t gfs_send(gfcontext_t **ctx, const void *data, size_t size);
 
+/*
+ * Sends len bytes of the file fd starting at offset to the client without
+ * copying them through user space. The file position of fd is not changed
+ * and fd may be closed as soon as this returns. Like gfs_send, this function
+ * should only be called from within a callback registered with
+ * gfserver_set_handler.
+ */
+ssize_t gfs_sendfile(gfcontext_t **ctx, int fd, off_t offset, size_t len);
 
 /*
  * this routine is used to handle the getfile request
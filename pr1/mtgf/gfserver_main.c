@@ -10,6 +10,19 @@
   "  -t [nthreads]       Number of threads (Default: 16)\n"                                       \
   "  -m [content_file]   Content file mapping keys to content files (Default: content.txt\n"      \
   "  -p [listen_port]    Listen port (Default: 18968)\n"                                          \
+  "  -s [stats_path]     Answer requests for this path with the server's stats (Default: off)\n"  \
+  "  -f [max_files]      Content files kept open at once (Default: half the fd limit)\n"         \
+  "  -c [cache_mb]       Memory for caching hot files, 0 disables it (Default: 64)\n"             \
+  "  -i [io_threads]     Threads for slow storage, 0 does it on the delegates (Default: 32)\n"    \
+  "  -a [min:max]        Resize the delegate pool within these, from -t (Default: off)\n"         \
+  "  -q [max_requests]   Requests held at once before refusing more, 0 for no limit "             \
+  "(Default: 4096)\n"                                                                             \
+  "  -b                  Stop accepting past -q instead of refusing requests\n"                   \
+  "  -e [deadline_ms]    Drop requests that waited longer, 0 never does (Default: 0)\n"           \
+  "  -l [bulk_threads]   Delegates kept for large files, 0 for none (Default: 4)\n"               \
+  "  -L [bulk_kb]        Files at least this large go to those delegates (Default: 256)\n"        \
+  "  -A [policy]         Pin delegates: compact, scatter or CPUs like 0,2-5 (Default: off)\n"     \
+  "  -B [policy]         Pin the boss to the first CPU of a policy like -A's (Default: off)\n"    \
   "  -d [delay]          Delay in content_get, default 0, range 0-5000000 "                       \
   "(microseconds)\n "
 
@@ -19,6 +32,18 @@ static struct option gLongOptions[] = {
     {"port", required_argument, NULL, 'p'},
     {"nthreads", required_argument, NULL, 't'},
     {"delay", required_argument, NULL, 'd'},
+    {"stats", required_argument, NULL, 's'},
+    {"files", required_argument, NULL, 'f'},
+    {"cache", required_argument, NULL, 'c'},
+    {"io-threads", required_argument, NULL, 'i'},
+    {"autoscale", required_argument, NULL, 'a'},
+    {"queue-limit", required_argument, NULL, 'q'},
+    {"backpressure", no_argument, NULL, 'b'},
+    {"deadline", required_argument, NULL, 'e'},
+    {"bulk-threads", required_argument, NULL, 'l'},
+    {"bulk-size", required_argument, NULL, 'L'},
+    {"affinity", required_argument, NULL, 'A'},
+    {"boss-affinity", required_argument, NULL, 'B'},
     {"help", no_argument, NULL, 'h'},
     {NULL, 0, NULL, 0}};
 
@@ -38,10 +63,20 @@ int main(int argc, char **argv) {
   unsigned short port = 18968;
   gfserver_t *gfs = NULL;
   int nthreads = 16;
+  size_t cache_mb = 64;
+  int io_threads = 32;
+  size_t min_threads = 0, max_threads = 0;
+  size_t queue_limit = 4096;
+  int backpressure = 0;
+  size_t bulk_threads = 4, bulk_kb = 256;
+  affinity_t *delegate_affinity = NULL, *boss_affinity = NULL;
   int option_char = 0;
 
   setbuf(stdout, NULL);
 
+  // Report the request pool on the way out, exit() from the signal handler runs it
+  atexit(printPoolStats);
+
   if (SIG_ERR == signal(SIGINT, _sig_handler)) {
     fprintf(stderr, "Can't catch SIGINT...exiting.\n");
     exit(EXIT_FAILURE);
@@ -53,7 +88,7 @@ int main(int argc, char **argv) {
   }
 
   // Parse and set command line arguments
-  while ((option_char = getopt_long(argc, argv, "p:d:rhm:t:", gLongOptions,
+  while ((option_char = getopt_long(argc, argv, "p:d:rhm:t:s:f:c:i:a:q:be:l:L:A:B:", gLongOptions,
                                     NULL)) != -1) {
     switch (option_char) {
       case 'h':  /* help */
@@ -72,6 +107,48 @@ int main(int argc, char **argv) {
       case 'm':  /* file-path */
         content_map = optarg;
         break;
+      case 's':  /* stats */
+        set_stats_path(optarg);
+        break;
+      case 'f':  /* files */
+        content_set_max_open(atoi(optarg));
+        break;
+      case 'c':  /* cache */
+        cache_mb = strtoul(optarg, NULL, 10);
+        break;
+      case 'i':  /* io-threads */
+        io_threads = atoi(optarg);
+        break;
+      case 'a':  /* autoscale */
+        if (sscanf(optarg, "%zu:%zu", &min_threads, &max_threads) != 2) {
+          min_threads = max_threads = 0;
+        }
+        break;
+      case 'q':  /* queue-limit */
+        queue_limit = strtoul(optarg, NULL, 10);
+        break;
+      case 'b':  /* backpressure */
+        backpressure = 1;
+        break;
+      case 'e':  /* deadline */
+        set_queue_deadline(strtoul(optarg, NULL, 10));
+        break;
+      case 'l':  /* bulk-threads */
+        bulk_threads = strtoul(optarg, NULL, 10);
+        break;
+      case 'L':  /* bulk-size */
+        bulk_kb = strtoul(optarg, NULL, 10);
+        break;
+      case 'A':  /* affinity */
+        if (NULL == (delegate_affinity = affinity_create(optarg))) {
+          exit(1);
+        }
+        break;
+      case 'B':  /* boss-affinity */
+        if (NULL == (boss_affinity = affinity_create(optarg))) {
+          exit(1);
+        }
+        break;
       default:
         fprintf(stderr, "%s", USAGE);
         exit(1);
@@ -90,17 +167,53 @@ int main(int argc, char **argv) {
     exit(__LINE__);
   }
 
+  set_queue_limit(queue_limit, backpressure);
   content_init(content_map);
+  hotcache_init(cache_mb << 20);
+
+  // kill -USR1 dumps the stats to stderr. The delegates inherit our signal mask,
+  // so this has to happen before they start.
+  gf_stats_start_signal_dumper();
+
+  // Without inotify every request just calls fstat again
+  if (content_watch(hotcache_invalidate) != 0) {
+    fprintf(stderr, "server: not caching file metadata\n");
+  }
+
+  // Without -a (or with 0) the pool stays at -t delegates
+  if (min_threads == 0 || max_threads == 0) {
+    min_threads = max_threads = nthreads;
+  }
 
   /* Initialize thread management */
   int err;
-  err = init_delegate_pool(nthreads);
+  err = init_delegate_pool(nthreads, min_threads, max_threads);
   if (err != 0) {
     perror("server: failed to initialize the delegate pool");
     exit(1);
   }
   
+  // The delegates decide whether to hand off by the I/O pool's size, so it goes first
+  if (io_threads > 0 && init_io_pool(io_threads) != 0) {
+    exit(1);
+  }
+  set_delegate_affinity(delegate_affinity);
   init_threads(nthreads);
+  start_pool_controller();
+  if (init_bulk_lane(bulk_threads, bulk_kb << 10) != 0) {
+    exit(1);
+  }
+
+  if (delegate_affinity != NULL) {
+    char cpus[256];
+    affinity_describe(delegate_affinity, nthreads, cpus, sizeof cpus);
+    fprintf(stderr, "server: delegates pinned to CPUs %s\n", cpus);
+  }
+  // Last, since every thread started from here on would inherit it. The boss
+  // accepts and reads requests, so its buffers follow it to its node too.
+  if (boss_affinity != NULL) {
+    fprintf(stderr, "server: boss pinned to CPU %d\n", affinity_pin(boss_affinity, 0));
+  }
 
   /*Initializing server*/
   gfs = gfserver_create();
@@ -2,31 +2,69 @@
 #include "gfserver.h"
 #include "workload.h"
 #include "content.h"
+#include "hotcache.h"
 #include <stdlib.h>
+#include <sched.h>
+#include <stdint.h>
 
 gfserver_delegate_pool_t delegate_pool;
+gfserver_io_pool_t io_pool;
 
+static const char *statsPath = NULL;
+
+// Admission control. inFlight counts the requests we took and haven't answered yet.
+// Past queueLimit the boss either turns new ones away or, with queueBlocks, stops
+// taking them until there's room, and anything older than deadlineNs by the time
+// a thread gets to it is dropped instead of served.
+static size_t queueLimit = 0;
+static int queueBlocks = 0;
+static unsigned long deadlineNs = 0;
+static size_t inFlight = 0;
+static int roomWaiters = 0;
+static pthread_mutex_t roomLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t roomCond = PTHREAD_COND_INITIALIZER;
+
+// Set on the bulk lane's delegates, which keep whatever they pick up
+static __thread int onBulkLane = 0;
+
+// The prebuilt gfserver.o may not provide gfs_sendfile yet. Binding it weakly lets us
+// take the zero-copy path when the library has it and keep the pread loop otherwise.
+#pragma weak gfs_sendfile
+
+
+// The boss thread takes a request from here and the delegate that served it gives it
+// back, so the pool's thread caches and shared list do the hand-off without malloc.
+static gf_pool_t requestPool = GF_POOL_INITIALIZER(request_t, 1024);
 
 request_t* create_request(gfcontext_t **ctx, const char *path) {
 	//printf("boss: Attempting to create request object...\n");
-	request_t *request = malloc(sizeof(request_t));
+	size_t pathLen = strlen(path);
+	if (pathLen >= REQUEST_PATH_MAX) {
+		fprintf(stderr, "server: path is longer than %d bytes\n", REQUEST_PATH_MAX);
+		return NULL;
+	}
+
+	request_t *request = gf_pool_get(&requestPool);
 	if (request == NULL) {
 		perror("server: failed to allocate memory for the request_t");
 		return NULL;
 	}
 
+	__atomic_add_fetch(&inFlight, 1, __ATOMIC_SEQ_CST);
+
 	request->ctx = *ctx;
+	request->receivedAt = 0;
+	request->enqueuedAt = 0;
+	request->stage = REQUEST_NEW;
+	request->fd = -1;
+	request->item = -1;
+	request->fileSize = 0;
+	request->cached = NULL;
 
 	// this ensures we keep the exact copy that we received
 	// since it's possible that this address itself can get
 	// used by another object
-	request->path = strdup(path);
-
-	if (request->path == NULL) {
-		perror("server: failed to allocate memory for path");
-		free(request);
-		return NULL;
-	} 
+	memcpy(request->path, path, pathLen + 1);
 
 	//printf("boss: Handler successfully created request\n");
 	return request;
@@ -38,13 +76,151 @@ void destory_request(request_t *request) {
 		return;
 	}
 
-	if (request->path != NULL) {
-		free(request->path);
+	gf_pool_put(&requestPool, request);
+
+	// Pairs with admitRequest, which registers as a waiter before it looks at inFlight
+	if (__atomic_sub_fetch(&inFlight, 1, __ATOMIC_SEQ_CST) < queueLimit &&
+		__atomic_load_n(&roomWaiters, __ATOMIC_SEQ_CST) > 0) {
+		pthread_mutex_lock(&roomLock);
+		pthread_cond_signal(&roomCond);
+		pthread_mutex_unlock(&roomLock);
 	}
-	free(request);
 	//printf("Successfully destroyed request!\n");
 }
 
+void set_queue_limit(size_t limit, int block) {
+	queueLimit = limit;
+	queueBlocks = block;
+}
+
+void set_delegate_affinity(affinity_t *affinity) {
+	delegate_pool.affinity = affinity;
+}
+
+void set_queue_deadline(unsigned long ms) {
+	deadlineNs = ms * 1000000UL;
+}
+
+int admitRequest() {
+	if (queueLimit == 0 || __atomic_load_n(&inFlight, __ATOMIC_SEQ_CST) < queueLimit) {
+		return 1;
+	}
+	if (!queueBlocks) {
+		gf_stats_count(GF_STAT_SHED, 1);
+		return 0;
+	}
+
+	// While the boss waits here nobody accepts, so new clients queue up in the
+	// listen backlog instead of in our memory
+	pthread_mutex_lock(&roomLock);
+	__atomic_add_fetch(&roomWaiters, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&inFlight, __ATOMIC_SEQ_CST) >= queueLimit) {
+		pthread_cond_wait(&roomCond, &roomLock);
+	}
+	__atomic_sub_fetch(&roomWaiters, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&roomLock);
+	return 1;
+}
+
+int dropIfExpired(request_t *request, unsigned long now) {
+	if (deadlineNs == 0 || now - request->receivedAt <= deadlineNs) {
+		return 0;
+	}
+	// The client has likely given up by now, so don't spend a file read on it
+	gfs_sendheader(&request->ctx, GF_ERROR, 0);
+	gf_stats_count(GF_STAT_ERROR, 1);
+	gf_stats_count(GF_STAT_EXPIRED, 1);
+	destory_request(request);
+	return 1;
+}
+
+void set_stats_path(const char *path) {
+	statsPath = path;
+}
+
+gfh_error_t sendStats(gfcontext_t **ctx) {
+	char report[4096];
+	unsigned long hits, misses, evictions;
+	size_t open;
+	size_t len = gf_stats_format(report, sizeof report);
+
+	content_stats(&hits, &misses, &evictions, &open);
+	int n = snprintf(report + len, sizeof report - len, "fd_cache hits %lu misses %lu evictions %lu open %zu\n",
+					 hits, misses, evictions, open);
+	if (n > 0) {
+		len += (size_t) n < sizeof report - len ? (size_t) n : sizeof report - len - 1;
+	}
+
+	unsigned long changes;
+	content_meta_stats(&hits, &misses, &changes);
+	n = snprintf(report + len, sizeof report - len, "meta_cache hits %lu misses %lu changes %lu\n", hits, misses, changes);
+	if (n > 0) {
+		len += (size_t) n < sizeof report - len ? (size_t) n : sizeof report - len - 1;
+	}
+
+	unsigned long steals, parks;
+	workqueue_stats(delegate_pool.queue, &steals, &parks);
+	n = snprintf(report + len, sizeof report - len, "delegates %zu (min %zu max %zu) steals %lu parks %lu\n",
+				 workqueue_workers(delegate_pool.queue), delegate_pool.min_size, delegate_pool.max_size, steals, parks);
+	if (n > 0) {
+		len += (size_t) n < sizeof report - len ? (size_t) n : sizeof report - len - 1;
+	}
+
+	n = snprintf(report + len, sizeof report - len, "bulk_lane delegates %zu threshold %zu requests %lu\n",
+				 delegate_pool.bulk_size, delegate_pool.bulk_threshold,
+				 __atomic_load_n(&delegate_pool.bulk_requests, __ATOMIC_RELAXED));
+	if (n > 0) {
+		len += (size_t) n < sizeof report - len ? (size_t) n : sizeof report - len - 1;
+	}
+
+	size_t bytes, objects, budget;
+	hotcache_stats(&hits, &misses, &evictions, &bytes, &objects, &budget);
+	n = snprintf(report + len, sizeof report - len,
+				 "hot_cache hits %lu misses %lu hit_ratio %.3f evictions %lu objects %zu bytes %zu budget %zu\n",
+				 hits, misses, hits + misses ? (double) hits / (hits + misses) : 0.0, evictions, objects, bytes, budget);
+	if (n > 0) {
+		len += (size_t) n < sizeof report - len ? (size_t) n : sizeof report - len - 1;
+	}
+	if (gfs_sendheader(ctx, GF_OK, len) == -1 || gfs_send(ctx, report, len) == -1) {
+		perror("server: failed to send the stats");
+	}
+	// The library closes the connection once the whole body went out, so like the
+	// delegates we must not touch the ctx again
+	*ctx = NULL;
+	return GF_OK;
+}
+
+void printPoolStats() {
+	unsigned long hits, misses;
+	gf_pool_stats(&requestPool, &hits, &misses);
+	fprintf(stderr, "server: request pool hits: %lu misses: %lu\n", hits, misses);
+
+	unsigned long evictions;
+	size_t open;
+	content_stats(&hits, &misses, &evictions, &open);
+	fprintf(stderr, "server: fd cache hits: %lu misses: %lu evictions: %lu open: %zu\n", hits, misses, evictions, open);
+
+	unsigned long changes;
+	content_meta_stats(&hits, &misses, &changes);
+	fprintf(stderr, "server: metadata cache hits: %lu misses: %lu changes: %lu\n", hits, misses, changes);
+
+	if (delegate_pool.queue != NULL) {
+		unsigned long steals, parks;
+		workqueue_stats(delegate_pool.queue, &steals, &parks);
+		fprintf(stderr, "server: delegates: %zu steals: %lu parks: %lu\n",
+				workqueue_workers(delegate_pool.queue), steals, parks);
+	}
+	if (delegate_pool.bulk != NULL) {
+		fprintf(stderr, "server: bulk lane delegates: %zu requests: %lu\n",
+				delegate_pool.bulk_size, __atomic_load_n(&delegate_pool.bulk_requests, __ATOMIC_RELAXED));
+	}
+
+	size_t bytes, objects, budget;
+	hotcache_stats(&hits, &misses, &evictions, &bytes, &objects, &budget);
+	fprintf(stderr, "server: hot cache hits: %lu misses: %lu hit ratio: %.3f evictions: %lu objects: %zu bytes: %zu of %zu\n",
+			hits, misses, hits + misses ? (double) hits / (hits + misses) : 0.0, evictions, objects, bytes, budget);
+}
+
 //
 //  The purpose of this function is to handle a get request
 //
@@ -65,104 +241,342 @@ gfh_error_t gfs_handler(gfcontext_t **ctx, const char *path, void* arg){
 		return GF_ERROR;
 	}
 
+	if (statsPath != NULL && strcmp(path, statsPath) == 0) {
+		return sendStats(ctx);
+	}
+
+	unsigned long receivedAt = gf_now_ns();
+	if (!admitRequest()) {
+		// Answered on the spot, and like a delegate's error the library closes it after
+		gfs_sendheader(ctx, GF_ERROR, 0);
+		gf_stats_count(GF_STAT_ERROR, 1);
+		*ctx = NULL;
+		return GF_OK;
+	}
+
 	request_t *request = create_request(ctx, path);
 	if (request == NULL) {
 		perror("server: failed to create a request wrapper");
 		return GF_ERROR;
 	}
 
-	// pseudocode:
-	// 	lock(pool.m)
-	// 	q.add(*ctx)
-	// 	send_signal(pool.queue_is_not_empty); // let's delegates that there are tasks
-	// 	unlock(pool.m)
+	request->receivedAt = receivedAt;
+	request->enqueuedAt = gf_now_ns();
+	gf_stats_record(GF_PHASE_HANDLER, request->enqueuedAt - receivedAt);
 
-	pthread_mutex_lock(&delegate_pool.q_lock);
-	steque_enqueue(&delegate_pool.request_q, request);
-	pthread_cond_signal(&delegate_pool.q_not_empty);
-	pthread_mutex_unlock(&delegate_pool.q_lock);
+	dispatchRequest(request);
 
 	*ctx = NULL; // This is required to avoid dangling pointer from getting reassigned or accessed
 	return GF_OK;
 }
 
+// Whether request is for a large file, going by the best size we have. A new
+// request has only what the metadata cache remembers, so the first request for
+// a file may be taken for a small one until it's loaded.
+static int isBulk(request_t *request) {
+	size_t size;
+
+	if (delegate_pool.bulk == NULL) {
+		return 0;
+	}
+	if (request->cached != NULL) {
+		size = hotcache_size(request->cached);
+	} else if (request->stage == REQUEST_LOADED) {
+		size = request->fileSize;
+	} else if (content_peek_size(request->path, &size) != 0) {
+		return 0;
+	}
+	return size >= delegate_pool.bulk_threshold;
+}
+
+// Called by a delegate that is about to send: moves a large file it didn't
+// know about in time to the bulk lane instead
+static int moveToBulkLane(request_t *request) {
+	if (onBulkLane || !isBulk(request)) {
+		return 0;
+	}
+	request->enqueuedAt = gf_now_ns();
+	dispatchRequest(request);
+	return 1;
+}
+
+void dispatchRequest(request_t *request) {
+	workqueue_t *queue = delegate_pool.queue;
+
+	if (isBulk(request)) {
+		queue = delegate_pool.bulk;
+		__atomic_add_fetch(&delegate_pool.bulk_requests, 1, __ATOMIC_RELAXED);
+	}
+	gf_stats_gauge_add(GF_GAUGE_QUEUE_DEPTH, 1);
+	// Every delegate's queue being full means they are far behind, so just
+	// give them a moment instead of growing without bound
+	while (workqueue_submit(queue, request) != 0) {
+		sched_yield();
+	}
+}
+
 void* delegate_function(void *args){
+	size_t self = (uintptr_t) args;
+	delegate_stats_t *stats = &delegate_pool.stats[self];
+
+	// Before anything is allocated, so the stack and our buffers land on our node
+	affinity_pin(delegate_pool.affinity, self);
+
 	//printf("Thread starting up delegate function.\n");
 	for (;;) {
-		pthread_mutex_lock(&delegate_pool.q_lock); // Get the mutex so that we can safely add ourselves to the waiting queue
+		// Our own queue first, then the other delegates', then park until woken.
+		// NULL means the pool shrank and this delegate is done.
+		request_t *request = (request_t *) workqueue_take(delegate_pool.queue, self);
+		if (request == NULL) {
+			break;
+		}
+		gf_stats_gauge_add(GF_GAUGE_QUEUE_DEPTH, -1);
+
+		// What the pool controller samples: how long requests waited for us and how
+		// much of the time we were working
+		unsigned long pickedAt = gf_now_ns();
+		__atomic_add_fetch(&stats->waitNs, pickedAt - request->enqueuedAt, __ATOMIC_RELAXED);
+		serveRequest(request, pickedAt);
+		__atomic_add_fetch(&stats->busyNs, gf_now_ns() - pickedAt, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&stats->requests, 1, __ATOMIC_RELAXED);
+	}
+	// The requests we freed would otherwise leave with our thread cache
+	gf_pool_flush(&requestPool);
+	return NULL;
+}
+
+void* bulk_function(void *args){
+	size_t self = (uintptr_t) args;
+
+	affinity_pin(delegate_pool.affinity, delegate_pool.max_size + self);
+	onBulkLane = 1;
+	for (;;) {
+		request_t *request = (request_t *) workqueue_take(delegate_pool.bulk, self);
+		gf_stats_gauge_add(GF_GAUGE_QUEUE_DEPTH, -1);
+		serveRequest(request, gf_now_ns());
+	}
+	return NULL;
+}
 
-		while(steque_isempty(&delegate_pool.request_q)) {
-			// we need to wait in the wait queue and release the queue lock
-			//printf("Thread adding itself to the worker queue and releasing lock.\n");
-			pthread_cond_wait(&delegate_pool.q_not_empty, &delegate_pool.q_lock);
+void serveRequest(request_t *request, unsigned long pickedAt) {
+	if (request->ctx == NULL) {
+		//printf("Warning: ctx is NULL. It may have been freed by gfserver.c.\n");
+		destory_request(request);
+		return;
+	}
+
+	// Requests coming back from the I/O stage only need to be sent
+	if (request->stage == REQUEST_LOADED) {
+		finishRequest(request);
+		return;
+	}
+
+	gf_stats_record(GF_PHASE_QUEUE, pickedAt - request->enqueuedAt);
+	if (dropIfExpired(request, pickedAt)) {
+		return;
+	}
+
+	// Hot files are served from memory without touching the file at all
+	request->cached = hotcache_get(request->path);
+	if (request->cached != NULL) {
+		request->stage = REQUEST_LOADED;
+		gf_stats_record(GF_PHASE_CONTENT, gf_now_ns() - pickedAt);
+		if (!moveToBulkLane(request)) {
+			finishRequest(request);
 		}
+		return;
+	}
 
-		//printf("Thread woke up and picking up request from queue.\n");
-		request_t *request = (request_t *) steque_pop(&delegate_pool.request_q);
-		pthread_mutex_unlock(&delegate_pool.q_lock); // unlock the mutex so that others can continue their flow
+	// Storage may be slow, so leave it to the I/O stage and go serve something else
+	if (io_pool.pool_size > 0) {
+		request->enqueuedAt = gf_now_ns();
+		pthread_mutex_lock(&io_pool.q_lock);
+		steque_enqueue(&io_pool.request_q, request);
+		gf_stats_gauge_set(GF_GAUGE_IO_QUEUE_DEPTH, steque_size(&io_pool.request_q));
+		pthread_cond_signal(&io_pool.q_not_empty);
+		pthread_mutex_unlock(&io_pool.q_lock);
+		return;
+	}
 
-		if (request->ctx == NULL) {
-            //printf("Warning: ctx is NULL. It may have been freed by gfserver.c.\n");
-            destory_request(request);
-            continue;
-        }
+	loadContent(request);
+	if (!moveToBulkLane(request)) {
+		finishRequest(request);
+	}
+}
 
-		// Initially I though this was not thread safe so I put a lock here
-		// However, wrapping content_get with a mutex was not fully using the
-		// power of multithreading
-		int fd = content_get(request->path);
+void* io_function(void *args){
+	for (;;) {
+		pthread_mutex_lock(&io_pool.q_lock);
+		while(steque_isempty(&io_pool.request_q)) {
+			pthread_cond_wait(&io_pool.q_not_empty, &io_pool.q_lock);
+		}
+		request_t *request = (request_t *) steque_pop(&io_pool.request_q);
+		gf_stats_gauge_set(GF_GAUGE_IO_QUEUE_DEPTH, steque_size(&io_pool.request_q));
+		pthread_mutex_unlock(&io_pool.q_lock);
 
-		if (fd == -1) {
-			perror("server: failed to get file descriptor for the path requested");
-			gfs_sendheader(&request->ctx, GF_ERROR, 0);
-			destory_request(request);
+		unsigned long pickedAt = gf_now_ns();
+		gf_stats_record(GF_PHASE_IO_QUEUE, pickedAt - request->enqueuedAt);
+		if (dropIfExpired(request, pickedAt)) {
 			continue;
 		}
-		struct stat f_stats;
-		int err = fstat(fd, &f_stats);
-		if (err == -1) {
+		loadContent(request);
+
+		request->enqueuedAt = gf_now_ns();
+		dispatchRequest(request);
+	}
+	return NULL;
+}
+
+void loadContent(request_t *request) {
+	unsigned long start = gf_now_ns();
+
+	request->stage = REQUEST_LOADED;
+
+	// Initially I though this was not thread safe so I put a lock here
+	// However, wrapping content_get with a mutex was not fully using the
+	// power of multithreading
+	request->fd = content_acquire(request->path, &request->item);
+	if (request->fd == -1) {
+		perror("server: failed to get file descriptor for the path requested");
+		return;
+	}
+
+	// Usually answered from the metadata cache without a syscall
+	time_t mtime;
+	unsigned long version;
+	if (content_stat(request->item, request->fd, &request->fileSize, &mtime, &version) == -1) {
+		perror("server: failed to fstat the file descriptor");
+		content_release(request->item, request->fd);
+		request->fd = -1;
+		return;
+	}
+
+	if (hotcache_admits(request->fileSize)) {
+		request->cached = hotcache_put(request->path, request->fd, request->fileSize);
+		if (request->cached != NULL) {
+			// It may have changed while we read it. Our copy still matches the
+			// length we'll send, but must not be served to anybody else.
+			if (content_version(request->item) != version) {
+				hotcache_invalidate(request->path);
+			}
+			content_release(request->item, request->fd);
+			request->fd = -1;
+		} else {
+			// A short read means the size we had was stale, so ask the file again
+			content_invalidate(request->item);
+		}
+		if (request->cached == NULL && content_stat(request->item, request->fd, &request->fileSize, &mtime, &version) == -1) {
 			perror("server: failed to fstat the file descriptor");
-			gfs_sendheader(&request->ctx, GF_ERROR, 0);
-			destory_request(request);
-			continue;
+			content_release(request->item, request->fd);
+			request->fd = -1;
+			return;
 		}
+	}
+	gf_stats_record(GF_PHASE_CONTENT, gf_now_ns() - start);
+}
 
-		size_t fileSize = f_stats.st_size;
-		gfs_sendheader(&request->ctx, GF_OK, fileSize);
-		err = sendFileContents(request, fd);
-		if (err == -1) {
-			perror("server: failed to sendFileContents");
-		}
+void finishRequest(request_t *request) {
+	if (request->cached != NULL) {
+		finishFromCache(request, request->cached, gf_now_ns());
+		return;
+	}
 
+	if (request->fd == -1) {
+		gfs_sendheader(&request->ctx, GF_ERROR, 0);
+		gf_stats_count(GF_STAT_ERROR, 1);
 		destory_request(request);
+		return;
 	}
-	return NULL;
+
+	unsigned long sendStart = gf_now_ns();
+	gfs_sendheader(&request->ctx, GF_OK, request->fileSize);
+	gf_stats_count(GF_STAT_OK, 1);
+	int err = sendFileContents(request, request->fd, request->fileSize);
+	if (err == -1) {
+		// If the file shrank under us the next request must not trust the old size
+		content_invalidate(request->item);
+	}
+	// The send is done with the file, so it may be closed from here on
+	content_release(request->item, request->fd);
+	if (err == -1) {
+		perror("server: failed to sendFileContents");
+	} else {
+		gf_stats_count(GF_STAT_BYTES_SENT, request->fileSize);
+	}
+
+	unsigned long sent = gf_now_ns();
+	gf_stats_record(GF_PHASE_SEND, sent - sendStart);
+	gf_stats_record(GF_PHASE_TOTAL, sent - request->receivedAt);
+	destory_request(request);
 }
 
-int init_delegate_pool(size_t numOfDelegates) {
-	int err = 0;
-	steque_init(&delegate_pool.request_q); // init our queue for the request queue within our delegate pool object
-	err = pthread_mutex_init(&delegate_pool.q_lock, NULL); // we must init our lock for the queue
-	if (err != 0) {
-		perror("serverv: failed to initialize q_lock mutex");
-		return -1;
+void finishFromCache(request_t *request, hotcache_obj_t *cached, unsigned long sendStart) {
+	size_t size = hotcache_size(cached);
+	const char *data = hotcache_data(cached);
+
+	gfs_sendheader(&request->ctx, GF_OK, size);
+	gf_stats_count(GF_STAT_OK, 1);
+	// The whole body goes to the library in one call instead of a chunk per pread
+	while (size > 0) {
+		ssize_t bytesSent = gfs_send(&request->ctx, data, size);
+		if (bytesSent <= 0) {
+			perror("server: failed to send the cached file");
+			break;
+		}
+		data += bytesSent;
+		size -= bytesSent;
+	}
+	if (size == 0) {
+		gf_stats_count(GF_STAT_BYTES_SENT, hotcache_size(cached));
 	}
+	hotcache_release(cached);
 
-	err = pthread_cond_init(&delegate_pool.q_not_empty, NULL); // we must init our conditional variable 
-	if (err != 0) {
-		perror("server: failed to initialize q_not_empty condition variable");
+	unsigned long sent = gf_now_ns();
+	gf_stats_record(GF_PHASE_SEND, sent - sendStart);
+	gf_stats_record(GF_PHASE_TOTAL, sent - request->receivedAt);
+	destory_request(request);
+}
+
+int init_delegate_pool(size_t numOfDelegates, size_t minDelegates, size_t maxDelegates) {
+	if (maxDelegates == 0 || maxDelegates > MAX_DELEGATES) {
+		maxDelegates = MAX_DELEGATES;
+	}
+	if (minDelegates == 0) {
+		minDelegates = 1;
+	}
+	if (minDelegates > maxDelegates) {
+		minDelegates = maxDelegates;
+	}
+	if (numOfDelegates < minDelegates) {
+		numOfDelegates = minDelegates;
+	}
+	if (numOfDelegates > maxDelegates) {
+		numOfDelegates = maxDelegates;
+	}
+
+	// A queue for every delegate we may ever have, only the running ones get work
+	delegate_pool.queue = workqueue_create(maxDelegates, DELEGATE_QUEUE_CAPACITY);
+	if (delegate_pool.queue == NULL) {
+		perror("server: failed to create the delegate queues");
 		return -1;
 	}
+	workqueue_set_workers(delegate_pool.queue, numOfDelegates);
 	delegate_pool.pool_size = numOfDelegates;
+	delegate_pool.min_size = minDelegates;
+	delegate_pool.max_size = maxDelegates;
 
 	//printf("successfully initialized delegate pool\n");
 	return 0;
 }
 
 void init_threads(size_t numthreads) {
+	if (numthreads > delegate_pool.pool_size) {
+		numthreads = delegate_pool.pool_size;
+	}
 	for (int i = 0; i < numthreads; i++) {
-		// we want the delegate threads to be joinable to the delegator thread
-		int err = pthread_create(&delegate_pool.delegate_pool[i], NULL, delegate_function, NULL);
+		// we want the delegate threads to be joinable to the delegator thread,
+		// and each one needs to know which queue is its own
+		int err = pthread_create(&delegate_pool.delegate_pool[i], NULL, delegate_function, (void *)(uintptr_t) i);
 		if (err != 0) {
 			perror("server: pthread_create failed to create delegate thread");
 			return;
@@ -172,18 +586,184 @@ void init_threads(size_t numthreads) {
 }
 
 
+// Sums every delegate slot's counters, including those of delegates that have exited
+static void sumDelegateStats(delegate_stats_t *sum) {
+	memset(sum, 0, sizeof *sum);
+	for (size_t i = 0; i < MAX_DELEGATES; i++) {
+		sum->busyNs += __atomic_load_n(&delegate_pool.stats[i].busyNs, __ATOMIC_RELAXED);
+		sum->waitNs += __atomic_load_n(&delegate_pool.stats[i].waitNs, __ATOMIC_RELAXED);
+		sum->requests += __atomic_load_n(&delegate_pool.stats[i].requests, __ATOMIC_RELAXED);
+	}
+}
+
+int resizeDelegatePool(size_t size) {
+	size_t old = delegate_pool.pool_size;
+
+	if (size > old) {
+		// Make the new delegates' queues live first, or they would retire on the spot
+		workqueue_set_workers(delegate_pool.queue, size);
+		for (size_t i = old; i < size; i++) {
+			if (pthread_create(&delegate_pool.delegate_pool[i], NULL, delegate_function, (void *)(uintptr_t) i) != 0) {
+				perror("server: pthread_create failed to grow the delegate pool");
+				workqueue_set_workers(delegate_pool.queue, i);
+				size = i;
+				break;
+			}
+		}
+	} else if (size < old) {
+		// The retired delegates finish what they have queued and return
+		workqueue_set_workers(delegate_pool.queue, size);
+		for (size_t i = size; i < old; i++) {
+			pthread_join(delegate_pool.delegate_pool[i], NULL);
+		}
+	}
+	delegate_pool.pool_size = size;
+	return size == old ? 0 : 1;
+}
+
+void* pool_controller(void *args) {
+	delegate_stats_t last, now;
+	int hot = 0, cold = 0, cooldown = 0;
+
+	sumDelegateStats(&last);
+	for (;;) {
+		usleep(POOL_SAMPLE_MS * 1000);
+
+		sumDelegateStats(&now);
+		size_t size = delegate_pool.pool_size;
+		unsigned long requests = now.requests - last.requests;
+		double waitUs = requests ? (now.waitNs - last.waitNs) / 1e3 / requests : 0;
+		double utilisation = (now.busyNs - last.busyNs) / (POOL_SAMPLE_MS * 1e6 * size);
+		last = now;
+
+		if (cooldown > 0) {
+			// Let the last change show up in the numbers before judging it
+			cooldown--;
+			continue;
+		}
+
+		// Separate thresholds to grow and to shrink, and a few samples in a row
+		// for each, so the pool doesn't flap around one value
+		hot = (waitUs > POOL_GROW_WAIT_US || utilisation > POOL_GROW_UTILISATION) ? hot + 1 : 0;
+		cold = (waitUs < POOL_SHRINK_WAIT_US && utilisation < POOL_SHRINK_UTILISATION) ? cold + 1 : 0;
+
+		size_t target = size;
+		if (hot >= POOL_GROW_SAMPLES && size < delegate_pool.max_size) {
+			target = size + (size / 2 > 1 ? size / 2 : 1);
+			if (target > delegate_pool.max_size) {
+				target = delegate_pool.max_size;
+			}
+		} else if (cold >= POOL_SHRINK_SAMPLES && size > delegate_pool.min_size) {
+			target = size - 1;
+		}
+		if (target == size) {
+			continue;
+		}
+
+		fprintf(stderr, "server: delegates %zu -> %zu (queue wait %.0f us, utilisation %.0f%%, %lu requests)\n",
+				size, target, waitUs, utilisation * 100, requests);
+		resizeDelegatePool(target);
+		hot = cold = 0;
+		cooldown = POOL_COOLDOWN_SAMPLES;
+	}
+	return NULL;
+}
+
+int init_bulk_lane(size_t numOfDelegates, size_t threshold) {
+	if (numOfDelegates == 0) {
+		return 0;
+	}
+	if (numOfDelegates > MAX_DELEGATES) {
+		numOfDelegates = MAX_DELEGATES;
+	}
+	workqueue_t *bulk = workqueue_create(numOfDelegates, DELEGATE_QUEUE_CAPACITY);
+	if (bulk == NULL) {
+		perror("server: failed to create the bulk lane's queues");
+		return -1;
+	}
+	delegate_pool.bulk_threshold = threshold;
+	// The lane's delegates take from it as soon as they start. Nothing is
+	// routed to it yet, since the boss isn't accepting requests.
+	delegate_pool.bulk = bulk;
+	for (size_t i = 0; i < numOfDelegates; i++) {
+		if (pthread_create(&delegate_pool.bulk_pool[i], NULL, bulk_function, (void *)(uintptr_t) i) != 0) {
+			perror("server: pthread_create failed to create a bulk lane delegate");
+			break;
+		}
+		delegate_pool.bulk_size = i + 1;
+	}
+	if (delegate_pool.bulk_size > 0) {
+		workqueue_set_workers(bulk, delegate_pool.bulk_size);
+	} else {
+		// Nobody serves the lane, so don't route to it
+		delegate_pool.bulk = NULL;
+		workqueue_destroy(bulk);
+	}
+	return 0;
+}
+
+int start_pool_controller() {
+	pthread_t thread;
+
+	if (delegate_pool.min_size == delegate_pool.max_size) {
+		return 0;
+	}
+	if (pthread_create(&thread, NULL, pool_controller, NULL) != 0) {
+		perror("server: failed to start the delegate pool controller");
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
+
+int init_io_pool(size_t numOfThreads) {
+	if (numOfThreads > MAX_IO_THREADS) {
+		numOfThreads = MAX_IO_THREADS;
+	}
+	steque_init(&io_pool.request_q);
+	if (pthread_mutex_init(&io_pool.q_lock, NULL) != 0 || pthread_cond_init(&io_pool.q_not_empty, NULL) != 0) {
+		perror("server: failed to initialize the I/O queue");
+		return -1;
+	}
+
+	for (size_t i = 0; i < numOfThreads; i++) {
+		int err = pthread_create(&io_pool.io_pool[i], NULL, io_function, NULL);
+		if (err != 0) {
+			perror("server: pthread_create failed to create I/O thread");
+			break;
+		}
+		// Only count the threads that started, the delegates go inline without any
+		io_pool.pool_size = i + 1;
+	}
+	return 0;
+}
+
 void cleanup_threads() {
-	steque_destroy(&(delegate_pool.request_q));
-	pthread_mutex_destroy(&delegate_pool.q_lock);
-	pthread_cond_destroy(&delegate_pool.q_not_empty);
+	workqueue_destroy(delegate_pool.queue);
+	delegate_pool.queue = NULL;
+	workqueue_destroy(delegate_pool.bulk);
+	delegate_pool.bulk = NULL;
+	steque_destroy(&io_pool.request_q);
+	pthread_mutex_destroy(&io_pool.q_lock);
+	pthread_cond_destroy(&io_pool.q_not_empty);
 }
 
 
 // This method writes the file's content based on the file's file descriptor and writes them into the
 // connection's file descriptor in chunks. It's possible we cannot fit all the contents of the file
 // in one network transaction so we need keep sending chunks until we've sent all the file's contents.
-int sendFileContents(request_t *request, int filefd) {
+int sendFileContents(request_t *request, int filefd, size_t fileSize) {
 	//printf("Attempting to send file conents to the client.\n");
+	if (gfs_sendfile != NULL) {
+		// Let the kernel move the file straight into the socket instead of
+		// bouncing every chunk through our stack buffer.
+		if (gfs_sendfile(&request->ctx, filefd, 0, fileSize) != fileSize) {
+			perror("server: gfs_sendfile");
+			return -1;
+		}
+		return 0;
+	}
+
     char buff[CHUNK_SIZE];
     memset(&buff, 0, CHUNK_SIZE);
 	off_t offset = 0; 
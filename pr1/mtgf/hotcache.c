@@ -0,0 +1,313 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "hotcache.h"
+
+#define HOTCACHE_SHARDS 16		/* a power of two */
+#define HOTCACHE_MIN_BUCKETS 64
+
+/*
+ * Each shard has a chained hash table and a CLOCK ring of the same objects.
+ * A hit only sets the object's referenced bit. To make room the hand sweeps
+ * the ring, clearing referenced bits, and evicts the first object it finds
+ * without one. An evicted object leaves the table at once but its memory is
+ * only freed once the last sender releases it.
+ */
+struct hotcache_obj_t{
+	hotcache_obj_t *chain;			/* next in the bucket */
+	hotcache_obj_t *prev, *next;	/* CLOCK ring */
+	uint64_t hash;
+	size_t size;
+	size_t charge;					/* what it counts against the budget */
+	int refs;
+	int referenced;
+	int cached;						/* still in the shard */
+	char *data;
+	char key[];						/* followed by the body */
+};
+
+typedef struct{
+	pthread_mutex_t lock;
+	hotcache_obj_t **buckets;
+	size_t nbuckets, nobjects;
+	hotcache_obj_t *hand;
+	size_t bytes;
+	unsigned long hits, misses, evictions;
+} __attribute__((aligned(64))) shard_t;
+
+static shard_t shards[HOTCACHE_SHARDS];
+static size_t budget, shardbudget;
+
+/* FNV-1a with a final mix, the top bits pick the shard and the low bits the bucket */
+static uint64_t _hashkey(const char *key, size_t *len){
+	uint64_t hash = 14695981039346656037ULL;
+	const char *c;
+
+	for(c = key; *c; c++)
+		hash = (hash ^ (unsigned char) *c) * 1099511628211ULL;
+	*len = c - key;
+	hash ^= hash >> 32;
+	hash *= 0xd6e8feb86659fd93ULL;
+	return hash ^ (hash >> 32);
+}
+
+static shard_t *_shard(uint64_t hash){
+	return &shards[(hash >> 60) & (HOTCACHE_SHARDS - 1)];
+}
+
+void hotcache_init(size_t bytes){
+	int i;
+
+	budget = bytes;
+	shardbudget = bytes / HOTCACHE_SHARDS;
+	for(i = 0; i < HOTCACHE_SHARDS; i++)
+		pthread_mutex_init(&shards[i].lock, NULL);
+}
+
+int hotcache_admits(size_t size){
+	return budget > 0 && size <= shardbudget / 8;
+}
+
+/* Called with the shard locked */
+static hotcache_obj_t *_lookup(shard_t *shard, const char *key, uint64_t hash){
+	hotcache_obj_t *obj;
+
+	if(shard->buckets == NULL)
+		return NULL;
+	for(obj = shard->buckets[hash & (shard->nbuckets - 1)]; obj != NULL; obj = obj->chain)
+		if(obj->hash == hash && strcmp(obj->key, key) == 0)
+			return obj;
+	return NULL;
+}
+
+static int _grow(shard_t *shard){
+	size_t nbuckets = shard->nbuckets ? shard->nbuckets * 2 : HOTCACHE_MIN_BUCKETS;
+	hotcache_obj_t **buckets = calloc(nbuckets, sizeof(hotcache_obj_t*));
+	hotcache_obj_t *obj, *next;
+	size_t i;
+
+	if(buckets == NULL)
+		return -1;
+	for(i = 0; i < shard->nbuckets; i++){
+		for(obj = shard->buckets[i]; obj != NULL; obj = next){
+			next = obj->chain;
+			obj->chain = buckets[obj->hash & (nbuckets - 1)];
+			buckets[obj->hash & (nbuckets - 1)] = obj;
+		}
+	}
+	free(shard->buckets);
+	shard->buckets = buckets;
+	shard->nbuckets = nbuckets;
+	return 0;
+}
+
+/* Takes obj out of the table and the ring, and frees it unless it's being sent */
+static void _remove(shard_t *shard, hotcache_obj_t *obj){
+	hotcache_obj_t **link = &shard->buckets[obj->hash & (shard->nbuckets - 1)];
+
+	while(*link != obj)
+		link = &(*link)->chain;
+	*link = obj->chain;
+
+	if(obj->next == obj){
+		shard->hand = NULL;
+	} else {
+		obj->prev->next = obj->next;
+		obj->next->prev = obj->prev;
+		if(shard->hand == obj)
+			shard->hand = obj->next;
+	}
+
+	shard->bytes -= obj->charge;
+	shard->nobjects--;
+	obj->cached = 0;
+	if(obj->refs == 0)
+		free(obj);
+}
+
+static void _evict(shard_t *shard){
+	while(shard->bytes > shardbudget && shard->hand != NULL){
+		hotcache_obj_t *obj = shard->hand;
+		if(obj->referenced){
+			obj->referenced = 0;
+			shard->hand = obj->next;
+			continue;
+		}
+		_remove(shard, obj);
+		shard->evictions++;
+	}
+}
+
+hotcache_obj_t *hotcache_get(const char *key){
+	size_t len;
+	uint64_t hash;
+	shard_t *shard;
+	hotcache_obj_t *obj;
+
+	if(budget == 0)
+		return NULL;
+
+	hash = _hashkey(key, &len);
+	shard = _shard(hash);
+	pthread_mutex_lock(&shard->lock);
+	if(NULL != (obj = _lookup(shard, key, hash))){
+		obj->refs++;
+		obj->referenced = 1;
+		shard->hits++;
+	} else {
+		shard->misses++;
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return obj;
+}
+
+hotcache_obj_t *hotcache_put(const char *key, int fd, size_t size){
+	size_t len, done = 0;
+	ssize_t n;
+	uint64_t hash;
+	shard_t *shard;
+	hotcache_obj_t *obj, *existing;
+
+	if(!hotcache_admits(size))
+		return NULL;
+
+	hash = _hashkey(key, &len);
+	if(NULL == (obj = malloc(sizeof(hotcache_obj_t) + len + 1 + size)))
+		return NULL;
+	memcpy(obj->key, key, len + 1);
+	obj->data = obj->key + len + 1;
+	obj->hash = hash;
+	obj->size = size;
+	obj->charge = sizeof(hotcache_obj_t) + len + 1 + size;
+	obj->refs = 1;
+	obj->referenced = 0;
+	obj->cached = 1;
+
+	// Read it before taking the lock, the file may be on a slow disk
+	while(done < size){
+		n = pread(fd, obj->data + done, size - done, done);
+		if(n <= 0){
+			free(obj);
+			return NULL;
+		}
+		done += n;
+	}
+
+	shard = _shard(hash);
+	pthread_mutex_lock(&shard->lock);
+	if(NULL != (existing = _lookup(shard, key, hash))){
+		// another sender missed on it too and got here first
+		existing->refs++;
+		existing->referenced = 1;
+		pthread_mutex_unlock(&shard->lock);
+		free(obj);
+		return existing;
+	}
+	if(shard->nobjects >= shard->nbuckets && _grow(shard) < 0){
+		pthread_mutex_unlock(&shard->lock);
+		free(obj);
+		return NULL;
+	}
+
+	obj->chain = shard->buckets[hash & (shard->nbuckets - 1)];
+	shard->buckets[hash & (shard->nbuckets - 1)] = obj;
+	// New objects go just behind the hand, the last place it will look
+	if(shard->hand == NULL){
+		obj->prev = obj->next = obj;
+		shard->hand = obj;
+	} else {
+		obj->next = shard->hand;
+		obj->prev = shard->hand->prev;
+		shard->hand->prev->next = obj;
+		shard->hand->prev = obj;
+	}
+	shard->bytes += obj->charge;
+	shard->nobjects++;
+	_evict(shard);
+	pthread_mutex_unlock(&shard->lock);
+	return obj;
+}
+
+void hotcache_invalidate(const char *key){
+	size_t len;
+	uint64_t hash;
+	shard_t *shard;
+	hotcache_obj_t *obj;
+	int i;
+
+	if(budget == 0)
+		return;
+
+	if(key == NULL){
+		for(i = 0; i < HOTCACHE_SHARDS; i++){
+			pthread_mutex_lock(&shards[i].lock);
+			while(shards[i].hand != NULL)
+				_remove(&shards[i], shards[i].hand);
+			pthread_mutex_unlock(&shards[i].lock);
+		}
+		return;
+	}
+
+	hash = _hashkey(key, &len);
+	shard = _shard(hash);
+	pthread_mutex_lock(&shard->lock);
+	if(NULL != (obj = _lookup(shard, key, hash)))
+		_remove(shard, obj);
+	pthread_mutex_unlock(&shard->lock);
+}
+
+const void *hotcache_data(const hotcache_obj_t *obj){
+	return obj->data;
+}
+
+size_t hotcache_size(const hotcache_obj_t *obj){
+	return obj->size;
+}
+
+void hotcache_release(hotcache_obj_t *obj){
+	shard_t *shard = _shard(obj->hash);
+	int unused;
+
+	pthread_mutex_lock(&shard->lock);
+	unused = --obj->refs == 0 && !obj->cached;
+	pthread_mutex_unlock(&shard->lock);
+	if(unused)
+		free(obj);
+}
+
+void hotcache_stats(unsigned long *nhits, unsigned long *nmisses, unsigned long *nevictions,
+					size_t *nbytes, size_t *nobjects, size_t *nbudget){
+	int i;
+
+	*nhits = *nmisses = *nevictions = 0;
+	*nbytes = *nobjects = 0;
+	for(i = 0; i < HOTCACHE_SHARDS; i++){
+		pthread_mutex_lock(&shards[i].lock);
+		*nhits += shards[i].hits;
+		*nmisses += shards[i].misses;
+		*nevictions += shards[i].evictions;
+		*nbytes += shards[i].bytes;
+		*nobjects += shards[i].nobjects;
+		pthread_mutex_unlock(&shards[i].lock);
+	}
+	*nbudget = budget;
+}
+
+void hotcache_destroy(){
+	int i;
+
+	for(i = 0; i < HOTCACHE_SHARDS; i++){
+		pthread_mutex_lock(&shards[i].lock);
+		while(shards[i].hand != NULL)
+			_remove(&shards[i], shards[i].hand);
+		free(shards[i].buckets);
+		shards[i].buckets = NULL;
+		shards[i].nbuckets = 0;
+		pthread_mutex_unlock(&shards[i].lock);
+	}
+}
@@ -0,0 +1,75 @@
+#ifndef __HOTCACHE_H__
+#define __HOTCACHE_H__
+
+#include <stddef.h>
+
+/*
+ * An in-memory cache of whole file bodies keyed by path, so hot
+ * files are sent from memory instead of being read again for
+ * every request. It is split into shards, each with its own lock
+ * and CLOCK eviction, and bounded by a byte budget that counts
+ * the bodies, the keys and the bookkeeping.
+ */
+typedef struct hotcache_obj_t hotcache_obj_t;
+
+/*
+ * Sets the byte budget, shared evenly by the shards. A budget of
+ * 0 (the default) disables the cache: hotcache_get always misses
+ * and hotcache_put never stores anything. Call before any thread
+ * uses the cache.
+ */
+void hotcache_init(size_t budget);
+
+/*
+ * Returns the cached object for key with a reference held, or
+ * NULL on a miss. The object stays valid until hotcache_release
+ * even if it is evicted meanwhile.
+ */
+hotcache_obj_t *hotcache_get(const char *key);
+
+/*
+ * Whether a body of size bytes would be cached at all. Objects
+ * bigger than an eighth of a shard are not, so one large file
+ * can't flush everything else.
+ */
+int hotcache_admits(size_t size);
+
+/*
+ * Caches size bytes of the file fd under key, read with pread.
+ * Returns the object with a reference held (another thread's copy
+ * if it got there first), or NULL if it wasn't admitted or could
+ * not be read.
+ */
+hotcache_obj_t *hotcache_put(const char *key, int fd, size_t size);
+
+/*
+ * Drops the object for key, if any, so the next hotcache_get
+ * misses. Senders holding it keep their copy until they release
+ * it. Called with NULL it drops everything.
+ */
+void hotcache_invalidate(const char *key);
+
+/*
+ * The cached body and its length.
+ */
+const void *hotcache_data(const hotcache_obj_t *obj);
+size_t hotcache_size(const hotcache_obj_t *obj);
+
+/*
+ * Drops a reference taken by hotcache_get or hotcache_put.
+ */
+void hotcache_release(hotcache_obj_t *obj);
+
+/*
+ * Reports lookups that hit and missed, objects evicted, and the
+ * bytes and objects cached right now out of budget.
+ */
+void hotcache_stats(unsigned long *hits, unsigned long *misses, unsigned long *evictions,
+					size_t *bytes, size_t *objects, size_t *budget);
+
+/*
+ * Frees every cached object nobody is using.
+ */
+void hotcache_destroy();
+
+#endif
@@ -0,0 +1,292 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sched.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "workqueue.h"
+
+#define WORKQUEUE_SPINS 4
+
+/*
+ * Each worker's queue is a bounded ring in the style of Dmitry Vyukov's MPMC
+ * queue: a cell's sequence number says whether it is ready to be written
+ * (seq == pos) or read (seq == pos + 1), so producers and consumers only
+ * race on a compare-and-swap of the tail or the head. The owner and thieves
+ * both take from the head, so stolen work is the oldest.
+ *
+ * A worker about to park sets its bit in sleepers and then looks at every
+ * queue once more; a producer publishes its item and then reads sleepers.
+ * Both sides go through a full fence in between, so either the worker sees
+ * the item or the producer sees the bit and wakes it.
+ */
+typedef struct{
+	size_t seq;
+	void *data;
+} cell_t;
+
+typedef struct{
+	size_t head __attribute__((aligned(64)));
+	size_t tail __attribute__((aligned(64)));
+	int futexword __attribute__((aligned(64)));	/* 1 once woken */
+	int busy;									/* between take and the next take */
+	unsigned long steals, parks;
+	cell_t *cells;
+	size_t mask;
+} worker_t;
+
+struct workqueue_t{
+	worker_t workers[WORKQUEUE_MAX_WORKERS];
+	size_t nworkers;
+	size_t active;								/* work is only placed on the first active */
+	uint64_t sleepers __attribute__((aligned(64)));	/* bit per parked worker */
+	unsigned long next;									/* where the next placement starts */
+};
+
+static long _futex(int *word, int op, int val){
+	return syscall(SYS_futex, word, op, val, NULL, NULL, 0);
+}
+
+workqueue_t *workqueue_create(size_t nworkers, size_t capacity){
+	workqueue_t *wq;
+	size_t cap = 2, i, j;
+
+	if(nworkers == 0 || nworkers > WORKQUEUE_MAX_WORKERS)
+		return NULL;
+	while(cap < capacity)
+		cap *= 2;
+
+	if(0 != posix_memalign((void **) &wq, 64, sizeof(workqueue_t)))
+		return NULL;
+	wq->nworkers = nworkers;
+	wq->active = nworkers;
+	wq->sleepers = 0;
+	wq->next = 0;
+	for(i = 0; i < nworkers; i++){
+		worker_t *w = &wq->workers[i];
+		w->head = w->tail = 0;
+		w->futexword = 0;
+		w->busy = 0;
+		w->steals = w->parks = 0;
+		w->mask = cap - 1;
+		if(NULL == (w->cells = malloc(cap * sizeof(cell_t)))){
+			while(i-- > 0)
+				free(wq->workers[i].cells);
+			free(wq);
+			return NULL;
+		}
+		for(j = 0; j < cap; j++)
+			w->cells[j].seq = j;
+	}
+	return wq;
+}
+
+static int _push(worker_t *w, void *item){
+	size_t pos = __atomic_load_n(&w->tail, __ATOMIC_RELAXED);
+	cell_t *cell;
+
+	for(;;){
+		cell = &w->cells[pos & w->mask];
+		intptr_t diff = (intptr_t) __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (intptr_t) pos;
+		if(diff == 0){
+			if(__atomic_compare_exchange_n(&w->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if(diff < 0){
+			return -1;		/* full */
+		} else {
+			pos = __atomic_load_n(&w->tail, __ATOMIC_RELAXED);
+		}
+	}
+	cell->data = item;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static void *_pop(worker_t *w){
+	size_t pos = __atomic_load_n(&w->head, __ATOMIC_RELAXED);
+	cell_t *cell;
+	void *item;
+
+	for(;;){
+		cell = &w->cells[pos & w->mask];
+		intptr_t diff = (intptr_t) __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (intptr_t) (pos + 1);
+		if(diff == 0){
+			if(__atomic_compare_exchange_n(&w->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if(diff < 0){
+			return NULL;	/* empty */
+		} else {
+			pos = __atomic_load_n(&w->head, __ATOMIC_RELAXED);
+		}
+	}
+	item = cell->data;
+	__atomic_store_n(&cell->seq, pos + w->mask + 1, __ATOMIC_RELEASE);
+	return item;
+}
+
+static size_t _load(worker_t *w){
+	size_t tail = __atomic_load_n(&w->tail, __ATOMIC_RELAXED);
+	size_t head = __atomic_load_n(&w->head, __ATOMIC_RELAXED);
+	return tail > head ? tail - head : 0;
+}
+
+/* Wakes worker i if it is parked. Returns whether it was. */
+static int _wake(workqueue_t *wq, size_t i){
+	uint64_t bit = 1ULL << i;
+
+	if(!(__atomic_fetch_and(&wq->sleepers, ~bit, __ATOMIC_SEQ_CST) & bit))
+		return 0;
+	__atomic_store_n(&wq->workers[i].futexword, 1, __ATOMIC_SEQ_CST);
+	_futex(&wq->workers[i].futexword, FUTEX_WAKE_PRIVATE, 1);
+	return 1;
+}
+
+/* Twice the backlog, plus two if it's working on something and one if it is
+ * parked: an idle worker that is awake beats waking one up, which beats
+ * queueing behind a busy one */
+static size_t _score(workqueue_t *wq, size_t i, uint64_t sleepers){
+	worker_t *w = &wq->workers[i];
+	return 2 * _load(w) + 2 * __atomic_load_n(&w->busy, __ATOMIC_RELAXED) + (sleepers >> i & 1);
+}
+
+int workqueue_submit(workqueue_t *wq, void *item){
+	size_t n = __atomic_load_n(&wq->active, __ATOMIC_RELAXED);
+	size_t first = __atomic_fetch_add(&wq->next, 1, __ATOMIC_RELAXED) % n;
+	size_t second = (first + 1) % n;
+	size_t target, i;
+	int busy;
+	uint64_t sleepers = __atomic_load_n(&wq->sleepers, __ATOMIC_RELAXED);
+
+	/* The better of two neighbours, which spreads work about as well as
+	 * looking at every queue for a fraction of the cost */
+	target = _score(wq, second, sleepers) < _score(wq, first, sleepers) ? second : first;
+	for(i = 0; _push(&wq->workers[target], item) != 0; i++){
+		if(i == n)
+			return -1;
+		target = (target + 1) % n;
+	}
+
+	/* Pairs with the fence of a worker that is parking or retiring */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	busy = __atomic_load_n(&wq->workers[target].busy, __ATOMIC_SEQ_CST) || _load(&wq->workers[target]) > 1;
+	sleepers = __atomic_load_n(&wq->sleepers, __ATOMIC_SEQ_CST);
+	if(sleepers == 0)
+		return 0;
+	if((sleepers >> target & 1) && _wake(wq, target))
+		return 0;
+	/* The owner is awake. If it is busy, get a parked worker to steal the item. */
+	if(busy || (sleepers >> target & 1)){
+		while(sleepers != 0){
+			i = __builtin_ctzll(sleepers);
+			if(_wake(wq, i))
+				break;
+			sleepers &= sleepers - 1;
+		}
+	}
+	return 0;
+}
+
+void *workqueue_trytake(workqueue_t *wq, size_t worker){
+	worker_t *self = &wq->workers[worker];
+	void *item;
+	size_t i;
+
+	if(NULL != (item = _pop(self)))
+		return item;
+	for(i = 1; i < wq->nworkers; i++){
+		if(NULL != (item = _pop(&wq->workers[(worker + i) % wq->nworkers]))){
+			self->steals++;
+			return item;
+		}
+	}
+	return NULL;
+}
+
+void *workqueue_take(workqueue_t *wq, size_t worker){
+	worker_t *self = &wq->workers[worker];
+	uint64_t bit = 1ULL << worker;
+	void *item;
+	int spins;
+
+	__atomic_store_n(&self->busy, 0, __ATOMIC_RELAXED);
+	for(;;){
+		if(worker >= __atomic_load_n(&wq->active, __ATOMIC_RELAXED)){
+			/* Retired. Looking busy makes producers that still picked us
+			 * wake somebody to steal it, and then we finish our own queue. */
+			__atomic_store_n(&self->busy, 1, __ATOMIC_SEQ_CST);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			return _pop(self);
+		}
+
+		/* Parking and being woken cost two syscalls, so give the
+		 * producers a few chances to come up with something first */
+		for(spins = 0; spins < WORKQUEUE_SPINS; spins++){
+			if(NULL != (item = workqueue_trytake(wq, worker)))
+				goto found;
+			sched_yield();
+		}
+
+		__atomic_store_n(&self->futexword, 0, __ATOMIC_SEQ_CST);
+		__atomic_fetch_or(&wq->sleepers, bit, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		/* A resize that lowered active before our bit was up found
+		 * nobody to wake, so look again or we'd park for good */
+		if(worker >= __atomic_load_n(&wq->active, __ATOMIC_SEQ_CST)){
+			__atomic_fetch_and(&wq->sleepers, ~bit, __ATOMIC_SEQ_CST);
+			continue;
+		}
+		if(NULL != (item = workqueue_trytake(wq, worker))){
+			__atomic_fetch_and(&wq->sleepers, ~bit, __ATOMIC_SEQ_CST);
+			goto found;
+		}
+		self->parks++;
+		_futex(&self->futexword, FUTEX_WAIT_PRIVATE, 0);
+		/* In case the wakeup was spurious nobody cleared our bit */
+		__atomic_fetch_and(&wq->sleepers, ~bit, __ATOMIC_SEQ_CST);
+	}
+
+found:
+	__atomic_store_n(&self->busy, 1, __ATOMIC_RELAXED);
+	return item;
+}
+
+void workqueue_set_workers(workqueue_t *wq, size_t n){
+	size_t i;
+
+	if(n == 0)
+		n = 1;
+	if(n > wq->nworkers)
+		n = wq->nworkers;
+	__atomic_store_n(&wq->active, n, __ATOMIC_SEQ_CST);
+	/* Parked workers past the end have to wake up to notice */
+	for(i = n; i < wq->nworkers; i++)
+		_wake(wq, i);
+}
+
+size_t workqueue_workers(workqueue_t *wq){
+	return __atomic_load_n(&wq->active, __ATOMIC_RELAXED);
+}
+
+void workqueue_stats(workqueue_t *wq, unsigned long *steals, unsigned long *parks){
+	size_t i;
+
+	*steals = *parks = 0;
+	for(i = 0; i < wq->nworkers; i++){
+		*steals += __atomic_load_n(&wq->workers[i].steals, __ATOMIC_RELAXED);
+		*parks += __atomic_load_n(&wq->workers[i].parks, __ATOMIC_RELAXED);
+	}
+}
+
+void workqueue_destroy(workqueue_t *wq){
+	size_t i;
+
+	if(wq == NULL)
+		return;
+	for(i = 0; i < wq->nworkers; i++)
+		free(wq->workers[i].cells);
+	free(wq);
+}
@@ -0,0 +1,63 @@
+#ifndef __WORKQUEUE_H__
+#define __WORKQUEUE_H__
+
+#include <stddef.h>
+
+#define WORKQUEUE_MAX_WORKERS 64
+
+/*
+ * Hands work from any number of producers to a fixed set of workers
+ * without a shared lock. Every worker has its own bounded lock-free
+ * queue. Producers put each item on the emptier of two queues, a
+ * worker takes from its own queue first and steals from the others
+ * when it runs dry, and only parks (on a futex) when every queue is
+ * empty.
+ */
+typedef struct workqueue_t workqueue_t;
+
+/*
+ * Returns a queue for nworkers workers (at most WORKQUEUE_MAX_WORKERS),
+ * each holding up to capacity items (rounded up to a power of two),
+ * or NULL.
+ */
+workqueue_t *workqueue_create(size_t nworkers, size_t capacity);
+
+/*
+ * Queues item and wakes a worker if one is parked. Safe to call from
+ * any thread. Returns -1 if every worker's queue is full.
+ */
+int workqueue_submit(workqueue_t *wq, void *item);
+
+/*
+ * Returns the next item for worker (0 to nworkers - 1), waiting for
+ * one if there is none. Each worker must be taken by one thread.
+ *
+ * Once the worker is retired by workqueue_set_workers this drains
+ * its queue and then returns NULL, and the thread should stop.
+ */
+void *workqueue_take(workqueue_t *wq, size_t worker);
+
+/*
+ * Returns the next item for worker, or NULL right away if there is none.
+ */
+void *workqueue_trytake(workqueue_t *wq, size_t worker);
+
+/*
+ * Places new work on the first n workers only (1 to nworkers, all of
+ * them at first). Workers from n on finish what they have and then
+ * get NULL from workqueue_take; whatever still lands on their queues
+ * is stolen by the others. A retired worker may be started again
+ * once its thread has returned.
+ */
+void workqueue_set_workers(workqueue_t *wq, size_t n);
+size_t workqueue_workers(workqueue_t *wq);
+
+/*
+ * Reports how many items were taken from another worker's queue and
+ * how often a worker had to park.
+ */
+void workqueue_stats(workqueue_t *wq, unsigned long *steals, unsigned long *parks);
+
+void workqueue_destroy(workqueue_t *wq);
+
+#endif
@@ -7,6 +7,7 @@
 
  #include "steque.h"
  #include "shm_channel.h"
+ #include "affinity.h"
  #include <stddef.h>
  #include <curl/curl.h> 
 
@@ -29,6 +30,7 @@
 	pthread_mutex_t q_lock;
 	pthread_cond_t q_not_empty;
 	int completed;
+	affinity_t *affinity;	// where worker i runs, NULL leaves it to the scheduler
  } worker_pool_t;
 
  /**
@@ -87,6 +89,7 @@ void destroy_delegate_pool();
 
 /**
  * This handler performs the work that each cache daemon must perform.
+ * args is the worker's index, which picks its CPU when they are pinned.
  */
 void * worker_process(void *args);
 
@@ -7,6 +7,8 @@
 #include <errno.h>
 #include <getopt.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sys/resource.h>
 #include <sys/signal.h>
 #include <printf.h>
 #include <curl/curl.h>
@@ -21,8 +23,17 @@
 #define CACHE_FAILURE (-1)
 #endif // CACHE_FAILURE
 
+/*
+ * simplecache_init only records the paths. A file is opened the first time
+ * it is asked for and stays open while anybody holds a reference. Open files
+ * nobody is using sit on an LRU list and the oldest are closed once more than
+ * maxopen files are open.
+ */
 typedef struct{
-	int fildes;
+	int fildes;			// -1 while closed
+	int refs;
+	int prev, next;		// LRU list of open, unreferenced items
+	int pathoff;		// the path follows the key in key[]
 	char key[MAX_KEYLEN];
 } item_t;
 //Item definition
@@ -30,6 +41,11 @@ typedef struct{
 static int nitems;
 static item_t *items;
 
+static pthread_mutex_t fdlock = PTHREAD_MUTEX_INITIALIZER;
+static int lruhead = -1, lrutail = -1;	// most and least recently released
+static size_t nopen, maxopen;
+static unsigned long hits, misses, evictions;
+
 static int _itemcmp(const void *a, const void *b){
 	return strcmp(((item_t*) a)->key,((item_t*) b)->key);
 }
@@ -37,6 +53,39 @@ static int _itemcmp(const void *a, const void *b){
 extern unsigned long int cache_delay;
 
 
+// Called with fdlock held
+static void _lruremove(int i){
+	if(items[i].prev >= 0) items[items[i].prev].next = items[i].next;
+	else lruhead = items[i].next;
+	if(items[i].next >= 0) items[items[i].next].prev = items[i].prev;
+	else lrutail = items[i].prev;
+	items[i].prev = items[i].next = -1;
+}
+
+static void _lrupush(int i){
+	items[i].prev = -1;
+	items[i].next = lruhead;
+	if(lruhead >= 0) items[lruhead].prev = i;
+	else lrutail = i;
+	lruhead = i;
+}
+
+// Closes idle files until we're back under the limit
+static void _evict(){
+	while(nopen > maxopen && lrutail >= 0){
+		int victim = lrutail;
+		_lruremove(victim);
+		close(items[victim].fildes);
+		items[victim].fildes = -1;
+		nopen--;
+		evictions++;
+	}
+}
+
+void simplecache_set_max_open(size_t limit){
+	maxopen = limit > 0 ? limit : 1;
+}
+
 int simplecache_init(char *filename){
 	FILE *filelist;
 	int capacity = 14;
@@ -47,6 +96,16 @@ int simplecache_init(char *filename){
 		exit(CACHE_FAILURE);
 	}
 
+	// Unless told otherwise keep half of our descriptors for everything else
+	if(maxopen == 0){
+		struct rlimit rl;
+		maxopen = 512;
+		if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+			maxopen = rl.rlim_cur / 2;
+		if(maxopen < 16)
+			maxopen = 16;
+	}
+
 	items = (item_t*) malloc(capacity * sizeof(item_t));
 	nitems = 0;
 	while(fgets(items[nitems].key, MAX_KEYLEN, filelist)){
@@ -58,10 +117,14 @@ int simplecache_init(char *filename){
 		strsep(&ptr, " \t"); 		/* The key is first */
 		path = strsep(&ptr, " \t"); /* The path second */
 
-		if( 0 > (items[nitems].fildes = open(path, O_RDONLY))){
-			fprintf(stderr, "Unable to open file %s.\n", path);
+		if(path == NULL){
+			fprintf(stderr, "No path for %s.\n", items[nitems].key);
 			exit(CACHE_FAILURE);
 		}
+		items[nitems].pathoff = path - items[nitems].key;
+		items[nitems].fildes = -1;
+		items[nitems].refs = 0;
+		items[nitems].prev = items[nitems].next = -1;
 		nitems++;
 
 		if(nitems == capacity){
@@ -78,33 +141,101 @@ int simplecache_init(char *filename){
 	return EXIT_SUCCESS;
 }
 
-int simplecache_get(char *key){
+static int _find(char *key){
 	int lo = 0;
 	int hi = nitems - 1;
 	int mid, cmp;
 
-	if (cache_delay > 0) {
-		usleep(cache_delay);
-	}
-
 	while (lo <= hi) {
 		// Key is in items[lo..hi] or not present.
 		mid = lo + (hi - lo) / 2;
 		cmp = strcmp(key,items[mid].key);
 		if ( cmp < 0) hi = mid - 1;
 		else if (cmp > 0) lo = mid + 1;
-		else{
-			lseek(items[mid].fildes, 0, SEEK_SET);
-			return items[mid].fildes;
-		} 
+		else return mid;
 	}
 	return -1;
 }
 
+int simplecache_acquire(char *key, int *item){
+	int i, fildes;
+
+	if (cache_delay > 0) {
+		usleep(cache_delay);
+	}
+
+	if(0 > (i = _find(key)))
+		return -1;
+
+	pthread_mutex_lock(&fdlock);
+	if(items[i].fildes >= 0){
+		if(items[i].refs++ == 0)
+			_lruremove(i);
+		hits++;
+		fildes = items[i].fildes;
+		pthread_mutex_unlock(&fdlock);
+		*item = i;
+		return fildes;
+	}
+	misses++;
+	pthread_mutex_unlock(&fdlock);
+
+	// Open without the lock, items don't move after simplecache_init
+	if( 0 > (fildes = open(items[i].key + items[i].pathoff, O_RDONLY)))
+		return -1;
+
+	pthread_mutex_lock(&fdlock);
+	if(items[i].fildes >= 0){
+		// somebody opened it while we did
+		close(fildes);
+		if(items[i].refs++ == 0)
+			_lruremove(i);
+	} else {
+		items[i].fildes = fildes;
+		items[i].refs = 1;
+		nopen++;
+		_evict();
+	}
+	fildes = items[i].fildes;
+	pthread_mutex_unlock(&fdlock);
+
+	*item = i;
+	return fildes;
+}
+
+void simplecache_release(int item){
+	pthread_mutex_lock(&fdlock);
+	if(--items[item].refs == 0){
+		_lrupush(item);
+		_evict();
+	}
+	pthread_mutex_unlock(&fdlock);
+}
+
+int simplecache_get(char *key){
+	int item;
+	int fildes = simplecache_acquire(key, &item);
+
+	// Callers of the old interface never release, so the file stays open
+	if(fildes >= 0)
+		lseek(fildes, 0, SEEK_SET);
+	return fildes;
+}
+
+void simplecache_stats(unsigned long *nhits, unsigned long *nmisses, unsigned long *nevictions, size_t *nopened){
+	pthread_mutex_lock(&fdlock);
+	*nhits = hits;
+	*nmisses = misses;
+	*nevictions = evictions;
+	*nopened = nopen;
+	pthread_mutex_unlock(&fdlock);
+}
+
 void simplecache_destroy(){
 	int i;
 	for(i = 0; i < nitems; i++)
-		close(items[i].fildes);
+		if(items[i].fildes >= 0)
+			close(items[i].fildes);
 	
 	free(items);
 }
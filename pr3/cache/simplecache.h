@@ -1,6 +1,8 @@
 #ifndef _SIMPLECACHE_H_
 #define _SIMPLECACHE_H_
 
+#include <stddef.h>
+
 /* 
  * Initializes the input cache given the information from
  * the provided file.  Each row of the file is assumed
@@ -13,9 +15,40 @@ int simplecache_init(char *filename);
 
 /* 
  * Returns the file descriptor associated with the input key.
+ *
+ * Files are opened on first use. The descriptor returned here
+ * is never closed before simplecache_destroy; use
+ * simplecache_acquire to let idle files be closed again.
  */
 int simplecache_get(char *key);
 
+/*
+ * Like simplecache_get, but holds a reference on the open file
+ * and sets item for simplecache_release. While referenced the
+ * file is never closed. The descriptor is shared, so read it
+ * with pread. Returns -1 if the key is not found or the file
+ * can't be opened.
+ */
+int simplecache_acquire(char *key, int *item);
+
+/*
+ * Drops a reference taken by simplecache_acquire.
+ */
+void simplecache_release(int item);
+
+/*
+ * Sets how many files may stay open (Default: half of
+ * RLIMIT_NOFILE). Files in use are never closed.
+ */
+void simplecache_set_max_open(size_t limit);
+
+/*
+ * Reports how often an acquired file was already open (hits) or
+ * had to be opened (misses), how many idle files were closed to
+ * make room, and how many are open right now.
+ */
+void simplecache_stats(unsigned long *hits, unsigned long *misses, unsigned long *evictions, size_t *open);
+
 /* 
  * Frees all memory and closes all file descriptors that are associated with the cache
  */
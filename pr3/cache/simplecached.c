@@ -10,6 +10,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <stdint.h>
 #include "cache-student.h"
 #include "shm_channel.h"
 #include "simplecache.h"
@@ -29,6 +30,12 @@ int nthreads;
 
 static void _sig_handler(int signo){
 	if (signo == SIGTERM || signo == SIGINT){
+		unsigned long hits, misses, evictions;
+		size_t open;
+		simplecache_stats(&hits, &misses, &evictions, &open);
+		fprintf(stderr, "simplecached: fd cache hits: %lu misses: %lu evictions: %lu open: %zu\n",
+				hits, misses, evictions, open);
+
 		// This is where your IPC clean up should occur
 		cleanup_threading(nthreads);
 		destroy_delegate_pool();
@@ -44,6 +51,9 @@ static void _sig_handler(int signo){
 "  -c [cachedir]       Path to static files (Default: ./)\n"                  \
 "  -t [thread_count]   Thread count for work queue (Default is 8, Range is 1-100)\n"      \
 "  -d [delay]          Delay in simplecache_get (Default is 0, Range is 0-2500000 (microseconds)\n "	\
+"  -A [policy]         Pin workers: compact, scatter or CPUs like 0,2-5 (Default: off)\n"   \
+"  -B [policy]         Pin the thread reading the queue to the first CPU of such a policy\n" \
+"  -f [max_files]      Files kept open at once (Default: half the fd limit)\n"  \
 "  -h                  Show this help message\n"
 
 //OPTIONS
@@ -53,6 +63,9 @@ static struct option gLongOptions[] = {
   {"help",               no_argument,            NULL,           'h'},
   {"hidden",			 no_argument,			 NULL,			 'i'}, /* server side */
   {"delay", 			 required_argument,		 NULL, 			 'd'}, // delay.
+  {"affinity",           required_argument,      NULL,           'A'},
+  {"boss-affinity",      required_argument,      NULL,           'B'},
+  {"files",              required_argument,      NULL,           'f'},
   {NULL,                 0,                      NULL,             0}
 };
 
@@ -64,11 +77,12 @@ int main(int argc, char **argv) {
 	nthreads = 8;
 	char *cachedir = "locals.txt";
 	char option_char;
+	affinity_t *boss_affinity = NULL;
 
 	/* disable buffering to stdout */
 	setbuf(stdout, NULL);
 
-	while ((option_char = getopt_long(argc, argv, "d:ic:hlt:x", gLongOptions, NULL)) != -1) {
+	while ((option_char = getopt_long(argc, argv, "d:ic:hlt:xA:B:f:", gLongOptions, NULL)) != -1) {
 		switch (option_char) {
 			default:
 				Usage();
@@ -86,6 +100,19 @@ int main(int argc, char **argv) {
             case 'd':
 				cache_delay = (unsigned long int) atoi(optarg);
 				break;
+			case 'A': // worker affinity
+				if (NULL == (worker_pool.affinity = affinity_create(optarg))) {
+					exit(1);
+				}
+				break;
+			case 'B': // boss affinity
+				if (NULL == (boss_affinity = affinity_create(optarg))) {
+					exit(1);
+				}
+				break;
+			case 'f': // files kept open
+				simplecache_set_max_open(atoi(optarg));
+				break;
 			case 'i': // server side usage
 			case 'o': // do not modify
 			case 'a': // experimental
@@ -135,6 +162,16 @@ int main(int argc, char **argv) {
 	/*Initialize cache*/
 	simplecache_init(cachedir);
 
+	if (worker_pool.affinity != NULL) {
+		char cpus[256];
+		affinity_describe(worker_pool.affinity, nthreads, cpus, sizeof cpus);
+		fprintf(stderr, "simplecached: workers pinned to CPUs %s\n", cpus);
+	}
+	// After the workers, which would otherwise inherit it
+	if (boss_affinity != NULL) {
+		fprintf(stderr, "simplecached: boss pinned to CPU %d\n", affinity_pin(boss_affinity, 0));
+	}
+
 	// Cache should go here
 
 	// Keep on reading from the MQ and delegate the 
@@ -203,7 +240,7 @@ int init_worker_pool(size_t numOfDelegates) {
 int init_threads(size_t num_threads) {
 	for (int i = 0; i < num_threads; i++) {
 		// we want the delegate threads to be joinable to the delegator thread
-		int err = pthread_create(&worker_pool.pool[i], NULL, worker_process, NULL);
+		int err = pthread_create(&worker_pool.pool[i], NULL, worker_process, (void *)(uintptr_t) i);
 		if (err != 0) {
 			perror("simplecached: pthread_create failed to create worker thread");
 			return -1;
@@ -213,6 +250,9 @@ int init_threads(size_t num_threads) {
 }
 
 void * worker_process(void *args) {
+	// Pinned before it touches anything, so its stack and chunk buffer are on its node
+	affinity_pin(worker_pool.affinity, (uintptr_t) args);
+
 	for(;;) {
 		pthread_mutex_lock(&worker_pool.q_lock);
 
@@ -228,7 +268,8 @@ void * worker_process(void *args) {
 		shm_file_t *shm_file = (shm_file_t *)((char *)ipc_chan.shm_base + req->shm_offset);
 		memset(shm_file, 0, sizeof(shm_file_t));
 
-		int file_fd = simplecache_get(req->file_name);
+		int item;
+		int file_fd = simplecache_acquire(req->file_name, &item);
 		if (file_fd == -1) {
 			// This indicates a CACHE_MISS so we can just update the shm_file object
 			// reference in shared memory to CACHE_MISS and update the semaphore
@@ -240,6 +281,7 @@ void * worker_process(void *args) {
 
 		// This indicates a CACHE_HIT so we need to send the file in chunks to the shard memory
 		int err = send_file_to_shm(shm_file, file_fd, req);
+		simplecache_release(item);
 		if (err == -1) {
 			perror("simplecached send_file_to_shm failed");
 		}
@@ -268,7 +310,8 @@ int send_file_to_shm(shm_file_t *shm_file, int file_fd, cache_request_t *req) {
 	size_t bytes_read = 0;
 
 	sem_post(&shm_file->chunk_ready_sem); // Wake up our proxy
-	while((bytes_read = read(file_fd, buffer, CHUNK_SIZE)) > 0) {
+	// The descriptor is shared with other workers, so don't use its offset
+	while((bytes_read = pread(file_fd, buffer, CHUNK_SIZE, total_bytes_sent)) > 0) {
 		memcpy(shm_file->data, buffer, bytes_read);
 		shm_file->chunk_size = bytes_read; 
 		sem_post(&shm_file->chunk_ready_sem); // let proxy know there is chunks to read